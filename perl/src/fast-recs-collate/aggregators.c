@@ -2,12 +2,21 @@
 #include "aggregators.h"
 #include "hash.h"
 #include "lookup3.h"
+#include "tdigest.h"
+#include "kll.h"
+#include "hdrhist.h"
+#include "hll.h"
+#include "arena.h"
+#include "strset.h"
 
 #define __USE_XOPEN_EXTENDED
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static bool use_one_field(char *config_str, int *num_fields, char *fields[])
 {
@@ -23,6 +32,21 @@ static bool use_one_field(char *config_str, int *num_fields, char *fields[])
     }
 }
 
+/*
+ * Helpers for the aggregators that have to serialize variable-size data.
+ * Spill files are private to this process, so we don't worry about byte
+ * order.
+ */
+static void write_int(FILE *out, int val)
+{
+    fwrite(&val, sizeof(val), 1, out);
+}
+
+static bool read_int(FILE *in, int *val)
+{
+    return fread(val, sizeof(*val), 1, in) == 1;
+}
+
 static bool use_two_fields(char *config_str, int *num_fields, char *fields[])
 {
     if(*config_str)
@@ -41,6 +65,155 @@ static bool use_two_fields(char *config_str, int *num_fields, char *fields[])
     }
 }
 
+/*
+ * Helpers for add_batch_func: running counts, sums and extremes of a column
+ * of values, skipping the NANs.  With SSE2 they mask out the NANs (as zeros,
+ * which don't change a sum), count and multiply two values at a time, but
+ * they still add them up in order, so a sum comes out bit for bit the same
+ * as adding the values one by one.
+ */
+
+#ifdef __SSE2__
+static inline double low_lane(__m128d v)
+{
+    return _mm_cvtsd_f64(v);
+}
+
+static inline double high_lane(__m128d v)
+{
+    return _mm_cvtsd_f64(_mm_unpackhi_pd(v, v));
+}
+#endif
+
+static void batch_sums(double *vals, int n, double *count, double *sum)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128d one = _mm_set1_pd(1);
+    __m128d c = _mm_setzero_pd();
+    double s = *sum;
+    for(; i + 2 <= n; i += 2)
+    {
+        __m128d v = _mm_loadu_pd(vals + i);
+        __m128d valid = _mm_cmpord_pd(v, v);
+        v = _mm_and_pd(valid, v);
+        c = _mm_add_pd(c, _mm_and_pd(valid, one));
+        s += low_lane(v);
+        s += high_lane(v);
+    }
+    *count += low_lane(c) + high_lane(c);
+    *sum = s;
+#endif
+    for(; i < n; i++)
+    {
+        if(!isnan(vals[i]))
+        {
+            *count += 1;
+            *sum += vals[i];
+        }
+    }
+}
+
+static void batch_squares(double *vals, int n, double *count, double *sum, double *sum_of_squares)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128d one = _mm_set1_pd(1);
+    __m128d c = _mm_setzero_pd();
+    double s = *sum, ss = *sum_of_squares;
+    for(; i + 2 <= n; i += 2)
+    {
+        __m128d v = _mm_loadu_pd(vals + i);
+        __m128d valid = _mm_cmpord_pd(v, v);
+        v = _mm_and_pd(valid, v);
+        __m128d sq = _mm_mul_pd(v, v);
+        c = _mm_add_pd(c, _mm_and_pd(valid, one));
+        s += low_lane(v);
+        s += high_lane(v);
+        ss += low_lane(sq);
+        ss += high_lane(sq);
+    }
+    *count += low_lane(c) + high_lane(c);
+    *sum = s;
+    *sum_of_squares = ss;
+#endif
+    for(; i < n; i++)
+    {
+        if(!isnan(vals[i]))
+        {
+            *count += 1;
+            *sum += vals[i];
+            *sum_of_squares += vals[i] * vals[i];
+        }
+    }
+}
+
+/* only the pairs where neither value is a NAN count */
+static void batch_products(double *vals1, double *vals2, int n, double *count,
+                           double *sum1, double *sum2, double *sum_of_products)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128d one = _mm_set1_pd(1);
+    __m128d c = _mm_setzero_pd();
+    double s1 = *sum1, s2 = *sum2, sp = *sum_of_products;
+    for(; i + 2 <= n; i += 2)
+    {
+        __m128d v1 = _mm_loadu_pd(vals1 + i);
+        __m128d v2 = _mm_loadu_pd(vals2 + i);
+        __m128d valid = _mm_and_pd(_mm_cmpord_pd(v1, v1), _mm_cmpord_pd(v2, v2));
+        v1 = _mm_and_pd(valid, v1);
+        v2 = _mm_and_pd(valid, v2);
+        __m128d p = _mm_mul_pd(v1, v2);
+        c = _mm_add_pd(c, _mm_and_pd(valid, one));
+        s1 += low_lane(v1);
+        s1 += high_lane(v1);
+        s2 += low_lane(v2);
+        s2 += high_lane(v2);
+        sp += low_lane(p);
+        sp += high_lane(p);
+    }
+    *count += low_lane(c) + high_lane(c);
+    *sum1 = s1;
+    *sum2 = s2;
+    *sum_of_products = sp;
+#endif
+    for(; i < n; i++)
+    {
+        if(!isnan(vals1[i]) && !isnan(vals2[i]))
+        {
+            *count += 1;
+            *sum1 += vals1[i];
+            *sum2 += vals2[i];
+            *sum_of_products += vals1[i] * vals2[i];
+        }
+    }
+}
+
+/* the biggest of max and the values (negated first, for min) */
+static double batch_max(double *vals, int n, double max, bool negate)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128d sign = _mm_set1_pd(negate ? -0.0 : 0.0);
+    __m128d m = _mm_set1_pd(max);
+    for(; i + 2 <= n; i += 2)
+    {
+        __m128d v = _mm_xor_pd(_mm_loadu_pd(vals + i), sign);
+        __m128d valid = _mm_cmpord_pd(v, v);
+        m = _mm_max_pd(m, _mm_or_pd(_mm_and_pd(valid, v), _mm_andnot_pd(valid, m)));
+    }
+    max = low_lane(m) > high_lane(m) ? low_lane(m) : high_lane(m);
+#endif
+    for(; i < n; i++)
+    {
+        double val = negate ? -vals[i] : vals[i];
+        if(!isnan(val) && val > max)
+            max = val;
+    }
+    return max;
+}
+
 /*
  * Average
  */
@@ -73,10 +246,33 @@ static void avg_add(void *config_data, void *_d, char *ch_data[], double num_dat
     }
 }
 
-static void avg_dump(void *config_data, void *_d)
+static void avg_add_batch(void *config_data, void *_d, int n, double *num_data[])
+{
+    struct avg_data *d = _d;
+    batch_sums(num_data[0], n, &d->count, &d->total);
+}
+
+static void avg_dump(void *config_data, void *_d, FILE *out)
+{
+    struct avg_data *d = _d;
+    fprintf(out, "%g", d->total / d->count);
+}
+
+static void avg_merge(void *config_data, void *_d, void *_o)
+{
+    struct avg_data *d = _d, *o = _o;
+    d->total += o->total;
+    d->count += o->count;
+}
+
+static void avg_remove(void *config_data, void *_d, char *ch_data[], double num_data[])
 {
     struct avg_data *d = _d;
-    printf("%g", d->total / d->count);
+    if(!isnan(num_data[0]))
+    {
+        d->total -= num_data[0];
+        d->count -= 1;
+    }
 }
 
 /*
@@ -144,12 +340,12 @@ static void concat_add(void *_c, void *_d, char *ch_data[], double num_data[])
     d->buf_len += len;
 }
 
-static void concat_dump(void *_c, void *_d)
+static void concat_dump(void *_c, void *_d, FILE *out)
 {
     struct concat_data *d = _d;
-    putc('"', stdout);
-    fwrite(d->concat_buf, sizeof(char), d->buf_len, stdout);
-    putc('"', stdout);
+    putc('"', out);
+    fwrite(d->concat_buf, sizeof(char), d->buf_len, out);
+    putc('"', out);
 }
 
 static void concat_free(void *_c, void *_d)
@@ -158,6 +354,65 @@ static void concat_free(void *_c, void *_d)
     free(d->concat_buf);
 }
 
+static void concat_merge(void *_c, void *_d, void *_o)
+{
+    struct concat_config_data *c = _c;
+    struct concat_data *d = _d, *o = _o;
+    if(o->buf_len == 0)
+        return;
+
+    RESIZE_ARRAY_IF_NECESSARY(d->concat_buf, d->buf_size, d->buf_len + o->buf_len + c->delim_len);
+
+    if(d->buf_len > 0)
+    {
+        memcpy(d->concat_buf + d->buf_len, c->delim, c->delim_len);
+        d->buf_len += c->delim_len;
+    }
+
+    memcpy(d->concat_buf + d->buf_len, o->concat_buf, o->buf_len);
+    d->buf_len += o->buf_len;
+}
+
+static size_t concat_memory(void *_c, void *_d)
+{
+    struct concat_data *d = _d;
+    return d->buf_size;
+}
+
+/* the oldest value is at the front of the buffer */
+static void concat_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct concat_config_data *c = _c;
+    struct concat_data *d = _d;
+    int len = strlen(ch_data[0]);
+    if(len + c->delim_len <= d->buf_len)
+        len += c->delim_len;
+    else
+        len = d->buf_len;
+
+    memmove(d->concat_buf, d->concat_buf + len, d->buf_len - len);
+    d->buf_len -= len;
+}
+
+static void concat_serialize(void *_c, void *_d, FILE *out)
+{
+    struct concat_data *d = _d;
+    write_int(out, d->buf_len);
+    fwrite(d->concat_buf, sizeof(char), d->buf_len, out);
+}
+
+static bool concat_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct concat_data *d = _d;
+    concat_init(_c, _d);
+    int len;
+    if(!read_int(in, &len) || len < 0)
+        return false;
+    RESIZE_ARRAY_IF_NECESSARY(d->concat_buf, d->buf_size, len);
+    d->buf_len = fread(d->concat_buf, sizeof(char), len, in);
+    return d->buf_len == len;
+}
+
 /*
  * Count
  */
@@ -184,10 +439,28 @@ static void count_add(void *_c, void *_d, char *ch_data[], double num_data[])
     d->count++;
 }
 
-static void count_dump(void *_c, void *_d)
+static void count_add_batch(void *_c, void *_d, int n, double *num_data[])
+{
+    struct count_data *d = _d;
+    d->count += n;
+}
+
+static void count_dump(void *_c, void *_d, FILE *out)
+{
+    struct count_data *d = _d;
+    fprintf(out, "%llu", d->count);
+}
+
+static void count_merge(void *_c, void *_d, void *_o)
+{
+    struct count_data *d = _d, *o = _o;
+    d->count += o->count;
+}
+
+static void count_remove(void *_c, void *_d, char *ch_data[], double num_data[])
 {
     struct count_data *d = _d;
-    printf("%llu", d->count);
+    d->count--;
 }
 
 /*
@@ -228,6 +501,34 @@ static void cov_add(void *_c, void *_d, char *ch_data[], double num_data[])
     }
 }
 
+static void cov_add_batch(void *_c, void *_d, int n, double *num_data[])
+{
+    struct cov_data *d = _d;
+    batch_products(num_data[0], num_data[1], n, &d->count,
+                   &d->sum_of_first, &d->sum_of_second, &d->sum_of_products);
+}
+
+static void cov_merge(void *_c, void *_d, void *_o)
+{
+    struct cov_data *d = _d, *o = _o;
+    d->count += o->count;
+    d->sum_of_products += o->sum_of_products;
+    d->sum_of_first += o->sum_of_first;
+    d->sum_of_second += o->sum_of_second;
+}
+
+static void cov_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct cov_data *d = _d;
+    if(!isnan(num_data[0]) && !isnan(num_data[1]))
+    {
+        d->count--;
+        d->sum_of_products -= num_data[0] * num_data[1];
+        d->sum_of_first -= num_data[0];
+        d->sum_of_second -= num_data[1];
+    }
+}
+
 static double cov_val(struct cov_data *d)
 {
     double cov = (d->sum_of_products / d->count) -
@@ -235,10 +536,80 @@ static double cov_val(struct cov_data *d)
     return cov;
 }
 
-static void cov_dump(void *_c, void *_d)
+static void cov_dump(void *_c, void *_d, FILE *out)
 {
     struct cov_data *d = _d;
-    printf("%f", cov_val(d));
+    fprintf(out, "%f", cov_val(d));
+}
+
+/*
+ * For max and min over a --window: the values that might still become the
+ * max once the ones before them leave the window, in decreasing order, along
+ * with the order they were added in.  min keeps its values negated.
+ */
+
+struct extreme_deque
+{
+    int start, len, size;
+    uint64_t added, removed;
+    double *vals;
+    uint64_t *seqs;
+};
+
+static struct extreme_deque *deque_create(int size)
+{
+    struct extreme_deque *q = malloc(sizeof(*q));
+    q->start = q->len = 0;
+    q->size = size;
+    q->added = q->removed = 0;
+    q->vals = malloc(sizeof(*q->vals) * size);
+    q->seqs = malloc(sizeof(*q->seqs) * size);
+    return q;
+}
+
+static void deque_free(struct extreme_deque *q)
+{
+    if(q)
+    {
+        free(q->vals);
+        free(q->seqs);
+        free(q);
+    }
+}
+
+static size_t deque_memory(struct extreme_deque *q)
+{
+    return q ? sizeof(*q) + (sizeof(*q->vals) + sizeof(*q->seqs)) * q->size : 0;
+}
+
+static void deque_push(struct extreme_deque *q, double val)
+{
+    uint64_t seq = q->added++;
+    if(isnan(val))
+        return;
+
+    /* anything smaller that came before this value can never be the max */
+    while(q->len > 0 && q->vals[(q->start + q->len - 1) % q->size] <= val)
+        q->len--;
+
+    int i = (q->start + q->len++) % q->size;
+    q->vals[i] = val;
+    q->seqs[i] = seq;
+}
+
+static void deque_pop_oldest(struct extreme_deque *q)
+{
+    uint64_t seq = q->removed++;
+    if(q->len > 0 && q->seqs[q->start] == seq)
+    {
+        q->start = (q->start + 1) % q->size;
+        q->len--;
+    }
+}
+
+static double deque_max(struct extreme_deque *q)
+{
+    return q->len > 0 ? q->vals[q->start] : -INFINITY;
 }
 
 /*
@@ -248,6 +619,7 @@ static void cov_dump(void *_c, void *_d)
 struct max_data
 {
     double max;
+    struct extreme_deque *deque;    /* only with --window */
 };
 
 static bool max_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
@@ -259,19 +631,70 @@ static void max_init(void *_c, void *_d)
 {
     struct max_data *d = _d;
     d->max = -INFINITY;
+    d->deque = NULL;
+}
+
+static void max_window_init(void *_c, void *_d, int window_size)
+{
+    struct max_data *d = _d;
+    max_init(_c, _d);
+    d->deque = deque_create(window_size);
 }
 
 static void max_add(void *_c, void *_d, char *ch_data[], double num_data[])
 {
     struct max_data *d = _d;
-    if(!isnan(num_data[0]) && num_data[0] > d->max)
+    if(d->deque)
+    {
+        deque_push(d->deque, num_data[0]);
+        d->max = deque_max(d->deque);
+    }
+    else if(!isnan(num_data[0]) && num_data[0] > d->max)
         d->max = num_data[0];
 }
 
-static void max_dump(void *_c, void *_d)
+static void max_add_batch(void *_c, void *_d, int n, double *num_data[])
+{
+    struct max_data *d = _d;
+    if(d->deque)
+    {
+        for(int i = 0; i < n; i++)
+            max_add(_c, _d, NULL, &num_data[0][i]);
+    }
+    else
+        d->max = batch_max(num_data[0], n, d->max, false);
+}
+
+static void max_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct max_data *d = _d;
+    deque_pop_oldest(d->deque);
+    d->max = deque_max(d->deque);
+}
+
+static void max_free(void *_c, void *_d)
+{
+    struct max_data *d = _d;
+    deque_free(d->deque);
+}
+
+static size_t max_memory(void *_c, void *_d)
+{
+    struct max_data *d = _d;
+    return deque_memory(d->deque);
+}
+
+static void max_dump(void *_c, void *_d, FILE *out)
 {
     struct max_data *d = _d;
-    printf("%g", d->max);
+    fprintf(out, "%g", d->max);
+}
+
+static void max_merge(void *_c, void *_d, void *_o)
+{
+    struct max_data *d = _d, *o = _o;
+    if(o->max > d->max)
+        d->max = o->max;
 }
 
 /*
@@ -281,6 +704,7 @@ static void max_dump(void *_c, void *_d)
 struct min_data
 {
     double min;
+    struct extreme_deque *deque;    /* only with --window */
 };
 
 static bool min_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
@@ -292,19 +716,70 @@ static void min_init(void *_c, void *_d)
 {
     struct min_data *d = _d;
     d->min = INFINITY;
+    d->deque = NULL;
+}
+
+static void min_window_init(void *_c, void *_d, int window_size)
+{
+    struct min_data *d = _d;
+    min_init(_c, _d);
+    d->deque = deque_create(window_size);
 }
 
 static void min_add(void *_c, void *_d, char *ch_data[], double num_data[])
 {
     struct min_data *d = _d;
-    if(!isnan(num_data[0]) && num_data[0] < d->min)
+    if(d->deque)
+    {
+        deque_push(d->deque, -num_data[0]);
+        d->min = -deque_max(d->deque);
+    }
+    else if(!isnan(num_data[0]) && num_data[0] < d->min)
         d->min = num_data[0];
 }
 
-static void min_dump(void *_c, void *_d)
+static void min_add_batch(void *_c, void *_d, int n, double *num_data[])
+{
+    struct min_data *d = _d;
+    if(d->deque)
+    {
+        for(int i = 0; i < n; i++)
+            min_add(_c, _d, NULL, &num_data[0][i]);
+    }
+    else
+        d->min = -batch_max(num_data[0], n, -d->min, true);
+}
+
+static void min_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct min_data *d = _d;
+    deque_pop_oldest(d->deque);
+    d->min = -deque_max(d->deque);
+}
+
+static void min_free(void *_c, void *_d)
+{
+    struct min_data *d = _d;
+    deque_free(d->deque);
+}
+
+static size_t min_memory(void *_c, void *_d)
+{
+    struct min_data *d = _d;
+    return deque_memory(d->deque);
+}
+
+static void min_dump(void *_c, void *_d, FILE *out)
 {
     struct min_data *d = _d;
-    printf("%g", d->min);
+    fprintf(out, "%g", d->min);
+}
+
+static void min_merge(void *_c, void *_d, void *_o)
+{
+    struct min_data *d = _d, *o = _o;
+    if(o->min < d->min)
+        d->min = o->min;
 }
 
 /*
@@ -334,19 +809,51 @@ static void sum_add(void *_c, void *_d, char *ch_data[], double num_data[])
         d->sum += num_data[0];
 }
 
-static void sum_dump(void *_c, void *_d)
+static void sum_add_batch(void *_c, void *_d, int n, double *num_data[])
+{
+    struct sum_data *d = _d;
+    double count = 0;
+    batch_sums(num_data[0], n, &count, &d->sum);
+}
+
+static void sum_dump(void *_c, void *_d, FILE *out)
+{
+    struct sum_data *d = _d;
+    fprintf(out, "%g", d->sum);
+}
+
+static void sum_merge(void *_c, void *_d, void *_o)
+{
+    struct sum_data *d = _d, *o = _o;
+    d->sum += o->sum;
+}
+
+static void sum_remove(void *_c, void *_d, char *ch_data[], double num_data[])
 {
     struct sum_data *d = _d;
-    printf("%g", d->sum);
+    if(!isnan(num_data[0]))
+        d->sum -= num_data[0];
 }
 
 /*
  * Perc
+ *
+ * percentile and percentile_map keep every value, and find the ones they
+ * want when they're dumped.  All of them on the same field share one copy of
+ * the values (see perc_share): if only one percentile is read from it, we
+ * just select that one, otherwise we sort it once for all of them.
  */
 
+#define PERC_RADIX_MIN 256      /* sort fewer values than this with qsort */
+#define PERC_SELECT_MIN 16      /* and select among fewer by sorting them */
+
 struct perc_config_data
 {
-    double percentile;
+    int num_percentiles;
+    double *percentiles;
+    bool map;           /* percentile_map: output {"<percentile>":<value>,...} */
+    int readers;        /* number of percentiles read from our values,
+                           including by the instances sharing them */
 };
 
 struct perc_data
@@ -354,8 +861,58 @@ struct perc_data
     int values_len;
     int values_size;
     double *values;
+    bool sorted;
+    bool keep_sorted;   /* --window keeps values sorted as they come and go */
 };
 
+/*
+ * A list of percentiles separated by whitespace, like perl's split(' '), for
+ * percentile_map and the sketches.  (not strtok: our caller's in the middle
+ * of using it.)
+ */
+static bool parse_percentiles(char *str, double **percentiles, int *num_percentiles)
+{
+    int percentiles_size = 4;
+    *percentiles = malloc(sizeof(**percentiles) * percentiles_size);
+    *num_percentiles = 0;
+
+    char *p = str;
+    while(*p)
+    {
+        char *endp;
+        RESIZE_ARRAY_IF_NECESSARY(*percentiles, percentiles_size, *num_percentiles+1);
+        double percentile = (*percentiles)[(*num_percentiles)++] = strtod(p, &endp);
+        if(endp == p) return false;  /* failed to parse into number */
+        if(percentile < 0 || percentile > 100) return false;
+
+        p = endp + strspn(endp, " \t");
+        if(p == endp && *p) return false;
+    }
+
+    return *num_percentiles > 0;
+}
+
+/* {"<percentile>":<value>,...}, or {} if there are no values */
+static void dump_percentile_map(FILE *out, double *percentiles, double *values, int num_percentiles)
+{
+    fputc('{', out);
+    for(int i = 0; i < num_percentiles && !isnan(values[0]); i++)
+    {
+        if(i != 0) fputc(',', out);
+        fprintf(out, "\"%g\":%g", percentiles[i], values[i]);
+    }
+    fputc('}', out);
+}
+
+static bool perc_parse_percentiles(struct perc_config_data *c, char *str)
+{
+    if(!parse_percentiles(str, &c->percentiles, &c->num_percentiles))
+        return false;
+
+    c->readers = c->num_percentiles;
+    return true;
+}
+
 static bool perc_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
 {
     if(*config_str)
@@ -365,9 +922,9 @@ static bool perc_parse_args(void **config_data, char *config_str, int *num_field
         *comma++ = '\0';
 
         struct perc_config_data *c = *config_data = malloc(sizeof(struct perc_config_data));
-        char *endp;
-        c->percentile = strtod(config_str, &endp);
-        if(endp == config_str) return false;  /* failed to parse into number */
+        c->map = false;
+        if(!perc_parse_percentiles(c, config_str) || c->num_percentiles != 1)
+            return false;
 
         fields[0] = comma;
         *num_fields = 1;
@@ -380,266 +937,2618 @@ static bool perc_parse_args(void **config_data, char *config_str, int *num_field
     }
 }
 
+static bool perc_map_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    char *comma = strrchr(config_str, ',');
+    if(!comma) return false;
+    *comma++ = '\0';
+
+    struct perc_config_data *c = *config_data = malloc(sizeof(struct perc_config_data));
+    c->map = true;
+    if(!perc_parse_percentiles(c, config_str))
+        return false;
+
+    fields[0] = comma;
+    *num_fields = 1;
+
+    return true;
+}
+
 static void perc_init(void *_c, void *_d)
 {
     struct perc_data *d = _d;
     d->values_len = 0;
     d->values_size = 64;
     d->values = malloc(sizeof(*d->values) * d->values_size);
+    d->sorted = true;
+    d->keep_sorted = false;
 }
 
-static void perc_add(void *_c, void *_d, char *ch_data[], double num_data[])
+static void perc_window_init(void *_c, void *_d, int window_size)
 {
     struct perc_data *d = _d;
-    if(!isnan(num_data[0]))
-    {
+    perc_init(_c, _d);
+    d->keep_sorted = true;
+}
+
+/* where val is (or would go) in sorted values */
+static int perc_find(struct perc_data *d, double val)
+{
+    int lo = 0, hi = d->values_len;
+    while(lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if(d->values[mid] < val) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void perc_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct perc_data *d = _d;
+    if(!isnan(num_data[0]))
+    {
         RESIZE_ARRAY_IF_NECESSARY(d->values, d->values_size, d->values_len+1);
-        d->values[d->values_len++] = num_data[0];
+        if(d->keep_sorted)
+        {
+            int i = perc_find(d, num_data[0]);
+            memmove(d->values + i + 1, d->values + i, sizeof(*d->values) * (d->values_len - i));
+            d->values[i] = num_data[0];
+            d->values_len++;
+        }
+        else
+        {
+            d->values[d->values_len++] = num_data[0];
+            d->sorted = false;
+        }
+    }
+}
+
+static void perc_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct perc_data *d = _d;
+    if(!isnan(num_data[0]))
+    {
+        int i = perc_find(d, num_data[0]);
+        d->values_len--;
+        memmove(d->values + i, d->values + i + 1, sizeof(*d->values) * (d->values_len - i));
+    }
+}
+
+static int cmp_dbl(const void *s1, const void *s2)
+{
+    double d1 = *(double*)s1;
+    double d2 = *(double*)s2;
+    if(d1 < d2) return -1;
+    else if(d1 > d2) return 1;
+    else return 0;
+}
+
+/* the bits of a double, flipped so that they sort as unsigned ints in the
+ * same order the doubles do */
+static inline uint64_t dbl_radix_key(double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    return (bits & 0x8000000000000000ULL) ? ~bits : bits | 0x8000000000000000ULL;
+}
+
+static inline double radix_key_dbl(uint64_t key)
+{
+    uint64_t bits = (key & 0x8000000000000000ULL) ? key & ~0x8000000000000000ULL : ~key;
+    double val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+/* LSD radix sort, a byte at a time, skipping the bytes that are all the same */
+static void radix_sort_dbl(double *values, int len)
+{
+    if(len < PERC_RADIX_MIN)
+    {
+        qsort(values, len, sizeof(*values), cmp_dbl);
+        return;
+    }
+
+    uint64_t *keys = malloc(sizeof(*keys) * len * 2);
+    uint64_t *from = keys, *to = keys + len;
+    int counts[8][256] = {{0}};
+
+    for(int i = 0; i < len; i++)
+    {
+        from[i] = dbl_radix_key(values[i]);
+        for(int b = 0; b < 8; b++)
+            counts[b][(from[i] >> (b * 8)) & 0xff]++;
+    }
+
+    for(int b = 0; b < 8; b++)
+    {
+        int shift = b * 8;
+        if(counts[b][(from[0] >> shift) & 0xff] == len)
+            continue;
+
+        int offsets[256];
+        int total = 0;
+        for(int i = 0; i < 256; i++)
+        {
+            offsets[i] = total;
+            total += counts[b][i];
+        }
+
+        for(int i = 0; i < len; i++)
+            to[offsets[(from[i] >> shift) & 0xff]++] = from[i];
+
+        uint64_t *tmp = from;
+        from = to;
+        to = tmp;
+    }
+
+    for(int i = 0; i < len; i++)
+        values[i] = radix_key_dbl(from[i]);
+    free(keys);
+}
+
+static inline void swap_dbl(double *a, double *b)
+{
+    double tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/*
+ * Introselect: put the kth smallest value at values[k], with smaller ones
+ * before it and bigger ones after.  Quickselect with median of three pivots,
+ * falling back to sorting what's left if the partitions keep coming out
+ * lopsided.
+ */
+static void select_dbl(double *values, int len, int k)
+{
+    int lo = 0, hi = len - 1;
+    int depth = 0;
+    for(int n = len; n > 1; n >>= 1)
+        depth += 2;
+
+    while(hi - lo >= PERC_SELECT_MIN)
+    {
+        if(depth-- == 0)
+            break;
+
+        int mid = lo + (hi - lo) / 2;
+        if(values[mid] < values[lo]) swap_dbl(&values[mid], &values[lo]);
+        if(values[hi] < values[lo]) swap_dbl(&values[hi], &values[lo]);
+        if(values[hi] < values[mid]) swap_dbl(&values[hi], &values[mid]);
+        double pivot = values[mid];
+
+        int i = lo, j = hi;
+        while(i <= j)
+        {
+            while(values[i] < pivot) i++;
+            while(values[j] > pivot) j--;
+            if(i <= j)
+                swap_dbl(&values[i++], &values[j--]);
+        }
+
+        if(k <= j) hi = j;
+        else if(k >= i) lo = i;
+        else return;    /* values[j+1..i-1] are all the pivot */
+    }
+
+    qsort(values + lo, hi - lo + 1, sizeof(*values), cmp_dbl);
+}
+
+static double perc_value(struct perc_data *d, double percentile)
+{
+    int i = floor((percentile / 100) * d->values_len);
+    if(i >= d->values_len) i = d->values_len - 1;
+    if(i < 0) i = 0;
+
+    if(!d->sorted)
+        select_dbl(d->values, d->values_len, i);
+    return d->values[i];
+}
+
+static void perc_dump(void *_c, void *_d, FILE *out)
+{
+    struct perc_config_data *c = _c;
+    struct perc_data *d = _d;
+
+    /* more than one percentile of these values will be read, so sort them
+     * once instead of selecting each one */
+    if(!d->sorted && c->readers > 1)
+    {
+        radix_sort_dbl(d->values, d->values_len);
+        d->sorted = true;
+    }
+
+    if(c->map)
+    {
+        double values[c->num_percentiles];
+        for(int i = 0; i < c->num_percentiles; i++)
+            values[i] = d->values_len > 0 ? perc_value(d, c->percentiles[i]) : NAN;
+        dump_percentile_map(out, c->percentiles, values, c->num_percentiles);
+    }
+    else if(d->values_len > 0)
+    {
+        fprintf(out, "%g", perc_value(d, c->percentiles[0]));
+    }
+    else
+    {
+        fputs("null", out);
+    }
+}
+
+static void perc_free(void *_c, void *_d)
+{
+    struct perc_data *d = _d;
+    free(d->values);
+}
+
+static void perc_merge(void *_c, void *_d, void *_o)
+{
+    struct perc_data *d = _d, *o = _o;
+    RESIZE_ARRAY_IF_NECESSARY(d->values, d->values_size, d->values_len + o->values_len);
+    memcpy(d->values + d->values_len, o->values, sizeof(*d->values) * o->values_len);
+    d->values_len += o->values_len;
+    if(o->values_len > 0)
+        d->sorted = false;
+}
+
+static size_t perc_memory(void *_c, void *_d)
+{
+    struct perc_data *d = _d;
+    return sizeof(*d->values) * d->values_size;
+}
+
+static void perc_serialize(void *_c, void *_d, FILE *out)
+{
+    struct perc_data *d = _d;
+    write_int(out, d->values_len);
+    fwrite(d->values, sizeof(*d->values), d->values_len, out);
+}
+
+static bool perc_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct perc_data *d = _d;
+    perc_init(_c, _d);
+    int len;
+    if(!read_int(in, &len) || len < 0)
+        return false;
+    RESIZE_ARRAY_IF_NECESSARY(d->values, d->values_size, len);
+    d->values_len = fread(d->values, sizeof(*d->values), len, in);
+    d->sorted = d->values_len == 0;
+    return d->values_len == len;
+}
+
+/* any percentile or percentile_map can read another one's values */
+static bool perc_share(void *_c, struct aggregator *other, void *_o)
+{
+    struct perc_config_data *c = _c, *o = _o;
+    if(other->share_func != perc_share)
+        return false;
+
+    o->readers += c->num_percentiles;
+    return true;
+}
+
+/*
+ * Sketches: tdigest, kll and hdr estimate percentiles in a bounded amount of
+ * memory per clump, and can be merged.  They all take
+ * <parameter>,[<percentiles>,]<field>, and output a map like
+ * percentile_map's (of 50, 90, 99 and 99.9 if none are given).
+ */
+
+static double sketch_percentiles[] = { 50, 90, 99, 99.9 };
+
+struct sketch_config_data
+{
+    double parameter;   /* compression, k or significant digits */
+    int num_percentiles;
+    double *percentiles;
+};
+
+static bool sketch_parse_args(void **config_data, char *config_str, int *num_fields, char **fields,
+                              double min_parameter, double max_parameter)
+{
+    char *comma = strchr(config_str, ',');
+    if(!comma) return false;
+    *comma++ = '\0';
+
+    struct sketch_config_data *c = *config_data = malloc(sizeof(struct sketch_config_data));
+    char *endp;
+    c->parameter = strtod(config_str, &endp);
+    if(endp == config_str || *endp) return false;  /* failed to parse into number */
+    if(c->parameter < min_parameter || c->parameter > max_parameter) return false;
+
+    char *field = strrchr(comma, ',');
+    if(field)
+    {
+        *field++ = '\0';
+        if(!parse_percentiles(comma, &c->percentiles, &c->num_percentiles))
+            return false;
+    }
+    else
+    {
+        field = comma;
+        c->percentiles = sketch_percentiles;
+        c->num_percentiles = sizeof(sketch_percentiles) / sizeof(*sketch_percentiles);
+    }
+
+    fields[0] = field;
+    *num_fields = 1;
+
+    return true;
+}
+
+/*
+ * T-digest: tdigest,<compression>,[<percentiles>,]<field>.  About
+ * compression centroids (100 is a good start: a few KB), with a rank error
+ * of about q * (1 - q) * 8 / compression at quantile q.
+ */
+
+static bool td_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    return sketch_parse_args(config_data, config_str, num_fields, fields, 10, 100000);
+}
+
+static void td_init(void *_c, void *_d)
+{
+    struct sketch_config_data *c = _c;
+    tdigest_init(_d, c->parameter);
+}
+
+static void td_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    if(!isnan(num_data[0]))
+        tdigest_add(_d, num_data[0], 1);
+}
+
+static void td_dump(void *_c, void *_d, FILE *out)
+{
+    struct sketch_config_data *c = _c;
+    double values[c->num_percentiles];
+    for(int i = 0; i < c->num_percentiles; i++)
+        values[i] = tdigest_quantile(_d, c->percentiles[i] / 100);
+    dump_percentile_map(out, c->percentiles, values, c->num_percentiles);
+}
+
+static void td_free(void *_c, void *_d)
+{
+    tdigest_free(_d);
+}
+
+static void td_merge(void *_c, void *_d, void *_o)
+{
+    tdigest_merge(_d, _o);
+}
+
+static size_t td_memory(void *_c, void *_d)
+{
+    return tdigest_memory(_d);
+}
+
+static void td_serialize(void *_c, void *_d, FILE *out)
+{
+    tdigest_write(_d, out);
+}
+
+static bool td_deserialize(void *_c, void *_d, FILE *in)
+{
+    td_init(_c, _d);
+    return tdigest_read(_d, in);
+}
+
+/*
+ * KLL: kll,<k>,[<percentiles>,]<field>.  Under 3k values (200 is a good
+ * start: about 5KB), with a rank error of about 1.65 / k at any quantile.
+ */
+
+static bool kll_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    if(!sketch_parse_args(config_data, config_str, num_fields, fields, 8, 65536))
+        return false;
+
+    struct sketch_config_data *c = *config_data;
+    return c->parameter == floor(c->parameter);
+}
+
+static void kll_init(void *_c, void *_d)
+{
+    struct sketch_config_data *c = _c;
+    kll_sketch_init(_d, c->parameter);
+}
+
+static void kll_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    if(!isnan(num_data[0]))
+        kll_sketch_add(_d, num_data[0]);
+}
+
+static void kll_dump(void *_c, void *_d, FILE *out)
+{
+    struct sketch_config_data *c = _c;
+    double qs[c->num_percentiles], values[c->num_percentiles];
+    for(int i = 0; i < c->num_percentiles; i++)
+        qs[i] = c->percentiles[i] / 100;
+    kll_sketch_quantiles(_d, c->num_percentiles, qs, values);
+    dump_percentile_map(out, c->percentiles, values, c->num_percentiles);
+}
+
+static void kll_free(void *_c, void *_d)
+{
+    kll_sketch_free(_d);
+}
+
+static void kll_merge(void *_c, void *_d, void *_o)
+{
+    kll_sketch_merge(_d, _o);
+}
+
+static size_t kll_memory(void *_c, void *_d)
+{
+    return kll_sketch_memory(_d);
+}
+
+static void kll_serialize(void *_c, void *_d, FILE *out)
+{
+    kll_sketch_write(_d, out);
+}
+
+static bool kll_deserialize(void *_c, void *_d, FILE *in)
+{
+    kll_init(_c, _d);
+    return kll_sketch_read(_d, in);
+}
+
+/*
+ * HDR histogram: hdr,<digits>,[<percentiles>,]<field>, for non-negative
+ * integers (values are rounded, and negative ones count as 0).  Percentiles
+ * are within 1 / 10 ** digits (1 to 3) of the true value.  There are about
+ * 10 ** digits counts for each power of two up to the biggest value, so 3
+ * digits is about 8KB per power of two (under 512KB in all); any more would
+ * be MBs per clump.
+ */
+
+static bool hdr_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    if(!sketch_parse_args(config_data, config_str, num_fields, fields, 1, 3))
+        return false;
+
+    struct sketch_config_data *c = *config_data;
+    return c->parameter == floor(c->parameter);
+}
+
+static void hdr_init(void *_c, void *_d)
+{
+    struct sketch_config_data *c = _c;
+    hdrhist_init(_d, c->parameter);
+}
+
+static void hdr_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    if(!isnan(num_data[0]))
+        hdrhist_add(_d, num_data[0] < (double)INT64_MAX ? llround(num_data[0]) : INT64_MAX, 1);
+}
+
+static void hdr_dump(void *_c, void *_d, FILE *out)
+{
+    struct sketch_config_data *c = _c;
+    double values[c->num_percentiles];
+    for(int i = 0; i < c->num_percentiles; i++)
+        values[i] = hdrhist_quantile(_d, c->percentiles[i] / 100);
+    dump_percentile_map(out, c->percentiles, values, c->num_percentiles);
+}
+
+static void hdr_free(void *_c, void *_d)
+{
+    hdrhist_free(_d);
+}
+
+static void hdr_merge(void *_c, void *_d, void *_o)
+{
+    hdrhist_merge(_d, _o);
+}
+
+static size_t hdr_memory(void *_c, void *_d)
+{
+    return hdrhist_memory(_d);
+}
+
+static void hdr_serialize(void *_c, void *_d, FILE *out)
+{
+    hdrhist_write(_d, out);
+}
+
+static bool hdr_deserialize(void *_c, void *_d, FILE *in)
+{
+    hdr_init(_c, _d);
+    return hdrhist_read(_d, in);
+}
+
+/*
+ * Distinct count: dcount,<field>.  Exact (as long as no two values' 64-bit
+ * hashes collide), keeping a set of the hashes.  The first few go in the
+ * clump data itself, and after that in an open addressing table, at most
+ * half full, where 0 means an empty slot.
+ */
+
+#define DCOUNT_INLINE 4
+#define DCOUNT_INITIAL_TABLE_SIZE 16
+
+struct dcount_data
+{
+    int len;
+    int size;           /* DCOUNT_INLINE while they're inline */
+    union
+    {
+        uint64_t inline_hashes[DCOUNT_INLINE];
+        uint64_t *hashes;
+    } u;
+};
+
+static bool dcount_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    return use_one_field(config_str, num_fields, fields);
+}
+
+static void dcount_init(void *_c, void *_d)
+{
+    struct dcount_data *d = _d;
+    d->len = 0;
+    d->size = DCOUNT_INLINE;
+}
+
+static inline uint64_t *dcount_hashes(struct dcount_data *d)
+{
+    return d->size > DCOUNT_INLINE ? d->u.hashes : d->u.inline_hashes;
+}
+
+/* true if it wasn't there already (there has to be room for it) */
+static bool dcount_table_insert(uint64_t *hashes, int size, uint64_t hash)
+{
+    int mask = size - 1;
+    for(int i = hash & mask; ; i = (i + 1) & mask)
+    {
+        if(hashes[i] == hash)
+            return false;
+        if(hashes[i] == 0)
+        {
+            hashes[i] = hash;
+            return true;
+        }
+    }
+}
+
+static void dcount_grow(struct dcount_data *d)
+{
+    int size = d->size > DCOUNT_INLINE ? d->size * 2 : DCOUNT_INITIAL_TABLE_SIZE;
+    uint64_t *hashes = calloc(size, sizeof(*hashes));
+    uint64_t *old = dcount_hashes(d);
+    if(d->size > DCOUNT_INLINE)
+    {
+        for(int i = 0; i < d->size; i++)
+            if(old[i])
+                dcount_table_insert(hashes, size, old[i]);
+        free(old);
+    }
+    else
+    {
+        for(int i = 0; i < d->len; i++)
+            dcount_table_insert(hashes, size, old[i]);
+    }
+    d->u.hashes = hashes;
+    d->size = size;
+}
+
+static void dcount_add_hash(struct dcount_data *d, uint64_t hash)
+{
+    if(hash == 0)
+        hash = 1;
+
+    if(d->size == DCOUNT_INLINE)
+    {
+        for(int i = 0; i < d->len; i++)
+            if(d->u.inline_hashes[i] == hash)
+                return;
+        if(d->len < DCOUNT_INLINE)
+        {
+            d->u.inline_hashes[d->len++] = hash;
+            return;
+        }
+        dcount_grow(d);
+    }
+    else if((d->len + 1) * 2 > d->size)
+    {
+        dcount_grow(d);
+    }
+
+    if(dcount_table_insert(d->u.hashes, d->size, hash))
+        d->len++;
+}
+
+static void dcount_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    if(ch_data[0])
+        dcount_add_hash(_d, hash64(ch_data[0], strlen(ch_data[0]), 0));
+}
+
+static void dcount_dump(void *_c, void *_d, FILE *out)
+{
+    struct dcount_data *d = _d;
+    fprintf(out, "%d", d->len);
+}
+
+static void dcount_free(void *_c, void *_d)
+{
+    struct dcount_data *d = _d;
+    if(d->size > DCOUNT_INLINE)
+        free(d->u.hashes);
+}
+
+static void dcount_merge(void *_c, void *_d, void *_o)
+{
+    struct dcount_data *o = _o;
+    uint64_t *hashes = dcount_hashes(o);
+    int len = o->size > DCOUNT_INLINE ? o->size : o->len;
+    for(int i = 0; i < len; i++)
+        if(hashes[i])
+            dcount_add_hash(_d, hashes[i]);
+}
+
+static size_t dcount_memory(void *_c, void *_d)
+{
+    struct dcount_data *d = _d;
+    return d->size > DCOUNT_INLINE ? sizeof(*d->u.hashes) * d->size : 0;
+}
+
+static void dcount_serialize(void *_c, void *_d, FILE *out)
+{
+    struct dcount_data *d = _d;
+    uint64_t *hashes = dcount_hashes(d);
+    int len = d->size > DCOUNT_INLINE ? d->size : d->len;
+    write_int(out, d->len);
+    for(int i = 0; i < len; i++)
+        if(hashes[i])
+            fwrite(&hashes[i], sizeof(hashes[i]), 1, out);
+}
+
+static bool dcount_deserialize(void *_c, void *_d, FILE *in)
+{
+    dcount_init(_c, _d);
+    int len;
+    if(!read_int(in, &len) || len < 0)
+        return false;
+    for(int i = 0; i < len; i++)
+    {
+        uint64_t hash;
+        if(fread(&hash, sizeof(hash), 1, in) != 1)
+            return false;
+        dcount_add_hash(_d, hash);
+    }
+    return true;
+}
+
+/*
+ * HyperLogLog: hll,<precision>,<field>.  An estimate of the distinct count,
+ * with a standard error of about 1.04 / sqrt(2 ** precision) (4 to 18; 14
+ * is a good start: 16KB, and under 1%).  A clump with few values keeps a
+ * sparse list of them that's exact in practice, and never grows past the
+ * 2 ** precision bytes of registers.
+ */
+
+struct hll_config_data
+{
+    int precision;
+};
+
+static bool hll_agg_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    char *comma = strchr(config_str, ',');
+    if(!comma) return false;
+    *comma++ = '\0';
+
+    struct hll_config_data *c = *config_data = malloc(sizeof(struct hll_config_data));
+    char *endp;
+    long precision = strtol(config_str, &endp, 10);
+    if(endp == config_str || *endp) return false;  /* failed to parse into number */
+    if(precision < 4 || precision > 18) return false;
+    c->precision = precision;
+
+    return use_one_field(comma, num_fields, fields);
+}
+
+static void hll_agg_init(void *_c, void *_d)
+{
+    struct hll_config_data *c = _c;
+    hll_init(_d, c->precision);
+}
+
+static void hll_agg_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    if(ch_data[0])
+        hll_add_hash(_d, hash64(ch_data[0], strlen(ch_data[0]), 0));
+}
+
+static void hll_agg_dump(void *_c, void *_d, FILE *out)
+{
+    fprintf(out, "%.0f", hll_estimate(_d));
+}
+
+static void hll_agg_free(void *_c, void *_d)
+{
+    hll_release(_d);
+}
+
+static void hll_agg_merge(void *_c, void *_d, void *_o)
+{
+    hll_merge(_d, _o);
+}
+
+static size_t hll_agg_memory(void *_c, void *_d)
+{
+    return hll_memory(_d);
+}
+
+static void hll_agg_serialize(void *_c, void *_d, FILE *out)
+{
+    hll_write(_d, out);
+}
+
+static bool hll_agg_deserialize(void *_c, void *_d, FILE *in)
+{
+    hll_agg_init(_c, _d);
+    return hll_read(_d, in);
+}
+
+/*
+ * Mode
+ */
+
+static hash_val_t str_hash_func(const void *_k)
+{
+    char *k = (char*)_k;
+    return hashlittle(k, strlen(k), 0);
+}
+
+/* a value's count, and the table's node for it */
+struct table_entry
+{
+    hnode_t node;
+    double count;
+};
+
+struct mode_config_data
+{
+    /* every clump's table entries.  the table points into them, so they
+     * can't be moved once they're made. */
+    struct arena arena;
+};
+
+struct mode_data
+{
+    hash_t *hash_table;
+
+    /* bytes in our copies of the values */
+    size_t strs_bytes;
+};
+
+static bool mode_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    struct mode_config_data *c = *config_data = malloc(sizeof(struct mode_config_data));
+    arena_init(&c->arena);
+    return use_one_field(config_str, num_fields, fields);
+}
+
+static void mode_init(void *_c, void *_d)
+{
+    struct mode_data *d = _d;
+    d->hash_table = hash_create(HASHCOUNT_T_MAX, NULL, str_hash_func);
+    d->strs_bytes = 0;
+}
+
+static void mode_add_count(struct mode_config_data *c, struct mode_data *d, char *val,
+                           double count)
+{
+    hnode_t *node = hash_lookup(d->hash_table, val);
+    if(node == NULL)
+    {
+        struct table_entry *entry = arena_alloc(&c->arena, sizeof(*entry));
+        entry->count = 0;
+        node = hnode_init(&entry->node, entry);
+        hash_insert(d->hash_table, node, strdup(val));
+        d->strs_bytes += strlen(val) + 1;
+    }
+    struct table_entry *entry = hnode_get(node);
+    entry->count += count;
+
+    /* --window takes values back, and a value that's all gone shouldn't
+     * keep taking up room */
+    if(entry->count <= 0)
+    {
+        hash_delete(d->hash_table, node);
+        d->strs_bytes -= strlen(hnode_getkey(node)) + 1;
+        free((void*)hnode_getkey(node));
+        arena_free(&c->arena, entry, sizeof(*entry));
+    }
+}
+
+static void mode_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    mode_add_count(_c, _d, ch_data[0], 1);
+}
+
+static void mode_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    mode_add_count(_c, _d, ch_data[0], -1);
+}
+
+static void mode_dump(void *_c, void *_d, FILE *out)
+{
+    struct mode_data *d = _d;
+    hscan_t scan;
+    hash_scan_begin(&scan, d->hash_table);
+    hnode_t *node;
+    double max_num = 0;
+    char *max_val = NULL;
+    while((node = hash_scan_next(&scan)))
+    {
+        struct table_entry *entry = hnode_get(node);
+        if(entry->count > max_num)
+        {
+            max_num = entry->count;
+            max_val = (char*)hnode_getkey(node);
+        }
+    }
+    putc('"', out);
+    fputs(max_val, out);
+    putc('"', out);
+}
+
+static void mode_free(void *_c, void *_d)
+{
+    struct mode_config_data *c = _c;
+    struct mode_data *d = _d;
+
+    /* free all the hash keys and entries */
+    hscan_t scan;
+    hash_scan_begin(&scan, d->hash_table);
+    hnode_t *node;
+    while((node = hash_scan_next(&scan)))
+    {
+        hash_scan_delete(d->hash_table, node);
+        free((void*)hnode_getkey(node));
+        arena_free(&c->arena, hnode_get(node), sizeof(struct table_entry));
+    }
+
+    hash_destroy(d->hash_table);
+}
+
+static void mode_merge(void *_c, void *_d, void *_o)
+{
+    struct mode_data *o = _o;
+    hscan_t scan;
+    hash_scan_begin(&scan, o->hash_table);
+    hnode_t *node;
+    while((node = hash_scan_next(&scan)))
+    {
+        struct table_entry *entry = hnode_get(node);
+        mode_add_count(_c, _d, (char*)hnode_getkey(node), entry->count);
+    }
+}
+
+static size_t mode_memory(void *_c, void *_d)
+{
+    struct mode_data *d = _d;
+    return sizeof(hash_t) + sizeof(hnode_t*) * hash_size(d->hash_table) +
+           arena_block_size(sizeof(struct table_entry)) * hash_count(d->hash_table) +
+           d->strs_bytes;
+}
+
+static void mode_serialize(void *_c, void *_d, FILE *out)
+{
+    struct mode_data *d = _d;
+    write_int(out, hash_count(d->hash_table));
+
+    hscan_t scan;
+    hash_scan_begin(&scan, d->hash_table);
+    hnode_t *node;
+    while((node = hash_scan_next(&scan)))
+    {
+        struct table_entry *entry = hnode_get(node);
+        const char *val = hnode_getkey(node);
+        int len = strlen(val);
+        write_int(out, len);
+        fwrite(val, sizeof(char), len, out);
+        fwrite(&entry->count, sizeof(entry->count), 1, out);
+    }
+}
+
+static bool mode_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct mode_data *d = _d;
+    mode_init(_c, _d);
+
+    int num_vals;
+    if(!read_int(in, &num_vals))
+        return false;
+
+    int val_size = 64;
+    char *val = malloc(val_size);
+    bool ok = true;
+    for(int i = 0; ok && i < num_vals; i++)
+    {
+        int len;
+        double count;
+        ok = read_int(in, &len) && len >= 0;
+        if(!ok)
+            break;
+        RESIZE_ARRAY_IF_NECESSARY(val, val_size, len+1);
+        ok = fread(val, sizeof(char), len, in) == (size_t)len &&
+             fread(&count, sizeof(count), 1, in) == 1;
+        if(ok)
+        {
+            val[len] = '\0';
+            mode_add_count(_c, d, val, count);
+        }
+    }
+    free(val);
+    return ok;
+}
+
+
+/*
+ * Variance
+ */
+
+struct var_data
+{
+    double count;
+    double sum_of_squares;
+    double sum;
+};
+
+static bool var_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    return use_one_field(config_str, num_fields, fields);
+}
+
+static void var_init(void *_c, void *_d)
+{
+    struct var_data *d = _d;
+    d->count = 0;
+    d->sum_of_squares = 0;
+    d->sum = 0;
+}
+
+static void var_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct var_data *d = _d;
+    if(!isnan(num_data[0]))
+    {
+        d->count++;
+        d->sum_of_squares += num_data[0] * num_data[0];
+        d->sum += num_data[0];
+    }
+}
+
+static void var_add_batch(void *_c, void *_d, int n, double *num_data[])
+{
+    struct var_data *d = _d;
+    batch_squares(num_data[0], n, &d->count, &d->sum, &d->sum_of_squares);
+}
+
+static void var_merge(void *_c, void *_d, void *_o)
+{
+    struct var_data *d = _d, *o = _o;
+    d->count += o->count;
+    d->sum_of_squares += o->sum_of_squares;
+    d->sum += o->sum;
+}
+
+static void var_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct var_data *d = _d;
+    if(!isnan(num_data[0]))
+    {
+        d->count--;
+        d->sum_of_squares -= num_data[0] * num_data[0];
+        d->sum -= num_data[0];
+    }
+}
+
+static double var_val(struct var_data *d)
+{
+    double avg = d->sum / d->count;
+    double var = (d->sum_of_squares / d->count) - (avg * avg);
+    return var;
+}
+
+static void var_dump(void *_c, void *_d, FILE *out)
+{
+    struct var_data *d = _d;
+    fprintf(out, "%g", var_val(d));
+}
+
+/*
+ * Correlation
+ */
+
+struct corr_data
+{
+    struct cov_data cov_data;
+    struct var_data var_data1;
+    struct var_data var_data2;
+};
+
+static bool corr_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    return use_two_fields(config_str, num_fields, fields);
+}
+
+static void corr_init(void *_c, void *_d)
+{
+    struct corr_data *d = _d;
+    cov_init(_c, &d->cov_data);
+    var_init(_c, &d->var_data1);
+    var_init(_c, &d->var_data2);
+}
+
+static void corr_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct corr_data *d = _d;
+    cov_add(NULL, &d->cov_data, ch_data, num_data);
+    var_add(NULL, &d->var_data1, ch_data, num_data);
+    var_add(NULL, &d->var_data2, ch_data+1, num_data+1);
+}
+
+static void corr_add_batch(void *_c, void *_d, int n, double *num_data[])
+{
+    struct corr_data *d = _d;
+    cov_add_batch(NULL, &d->cov_data, n, num_data);
+    var_add_batch(NULL, &d->var_data1, n, num_data);
+    var_add_batch(NULL, &d->var_data2, n, num_data+1);
+}
+
+static void corr_merge(void *_c, void *_d, void *_o)
+{
+    struct corr_data *d = _d, *o = _o;
+    cov_merge(NULL, &d->cov_data, &o->cov_data);
+    var_merge(NULL, &d->var_data1, &o->var_data1);
+    var_merge(NULL, &d->var_data2, &o->var_data2);
+}
+
+static void corr_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct corr_data *d = _d;
+    cov_remove(NULL, &d->cov_data, ch_data, num_data);
+    var_remove(NULL, &d->var_data1, ch_data, num_data);
+    var_remove(NULL, &d->var_data2, ch_data+1, num_data+1);
+}
+
+static void corr_dump(void *_c, void *_d, FILE *out)
+{
+    struct corr_data *d = _d;
+    double cov = cov_val(&d->cov_data);
+    double var1 = var_val(&d->var_data1);
+    double var2 = var_val(&d->var_data2);
+    double corr = cov / sqrt(var1 * var2);
+    fprintf(out, "%g", corr);
+}
+
+/*
+ * Moments: stddev and ord2uni keep a running count, mean and sums of the
+ * 2nd, 3rd and 4th powers of the differences from the mean, updated one
+ * value at a time (Welford, extended by Terriberry) and merged with Chan's
+ * (and Pebay's) pairwise formulas, so they don't lose precision the way
+ * sums of powers do when the mean is big next to the spread.  Taking a
+ * value back out (for --window) runs the merge backwards.
+ */
+
+struct moments
+{
+    double count;
+    double mean;
+    double m2, m3, m4;
+};
+
+static void moments_init(void *_c, void *_d)
+{
+    struct moments *d = _d;
+    d->count = 0;
+    d->mean = 0;
+    d->m2 = d->m3 = d->m4 = 0;
+}
+
+/* fold b into a (as if a had seen b's values as well) */
+static void moments_merge_into(struct moments *a, struct moments *b)
+{
+    double n = a->count + b->count;
+    if(b->count == 0)
+        return;
+    if(a->count == 0)
+    {
+        *a = *b;
+        return;
+    }
+
+    double delta = b->mean - a->mean;
+    double delta2 = delta * delta;
+    double na = a->count, nb = b->count;
+
+    double m2 = a->m2 + b->m2 + delta2 * na * nb / n;
+    double m3 = a->m3 + b->m3 + delta * delta2 * na * nb * (na - nb) / (n * n) +
+                3 * delta * (na * b->m2 - nb * a->m2) / n;
+    double m4 = a->m4 + b->m4 +
+                delta2 * delta2 * na * nb * (na * na - na * nb + nb * nb) / (n * n * n) +
+                6 * delta2 * (na * na * b->m2 + nb * nb * a->m2) / (n * n) +
+                4 * delta * (na * b->m3 - nb * a->m3) / n;
+
+    a->mean += delta * nb / n;
+    a->m2 = m2;
+    a->m3 = m3;
+    a->m4 = m4;
+    a->count = n;
+}
+
+/* only count, mean and m2 (for stddev, which doesn't need the rest) */
+static inline void moments_add_2(struct moments *d, double x)
+{
+    d->count++;
+    double delta = x - d->mean;
+    d->mean += delta / d->count;
+    d->m2 += delta * (x - d->mean);
+}
+
+static inline void moments_add_4(struct moments *d, double x)
+{
+    double n1 = d->count;
+    double n = ++d->count;
+    double delta = x - d->mean;
+    double delta_n = delta / n;
+    double delta_n2 = delta_n * delta_n;
+    double term1 = delta * delta_n * n1;
+
+    d->mean += delta_n;
+    d->m4 += term1 * delta_n2 * (n * n - 3 * n + 3) + 6 * delta_n2 * d->m2 - 4 * delta_n * d->m3;
+    d->m3 += term1 * delta_n * (n - 2) - 3 * delta_n * d->m2;
+    d->m2 += term1;
+}
+
+/* take x back out: solve moments_merge_into(a, {1, x}) for a */
+static void moments_take_back(struct moments *d, double x)
+{
+    double n = d->count;
+    double na = n - 1;
+    if(na <= 0)
+    {
+        moments_init(NULL, d);
+        return;
+    }
+
+    double mean = (n * d->mean - x) / na;
+    double delta = x - mean;
+    double delta2 = delta * delta;
+
+    double m2 = d->m2 - delta2 * na / n;
+    double m3 = d->m3 - delta * delta2 * na * (na - 1) / (n * n) + 3 * delta * m2 / n;
+    double m4 = d->m4 - delta2 * delta2 * na * (na * na - na + 1) / (n * n * n) -
+                6 * delta2 * m2 / (n * n) + 4 * delta * m3 / n;
+
+    d->count = na;
+    d->mean = mean;
+    d->m2 = m2 > 0 ? m2 : 0;
+    d->m3 = m3;
+    d->m4 = m4 > 0 ? m4 : 0;
+}
+
+static void moments_merge(void *_c, void *_d, void *_o)
+{
+    moments_merge_into(_d, _o);
+}
+
+static void moments_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    if(!isnan(num_data[0]))
+        moments_take_back(_d, num_data[0]);
+}
+
+/* "<name>":<val>, or null if val isn't a number */
+static void dump_stat(FILE *out, bool first, const char *name, double val)
+{
+    if(!first) fputc(',', out);
+    if(isfinite(val))
+        fprintf(out, "\"%s\":%g", name, val);
+    else
+        fprintf(out, "\"%s\":null", name);
+}
+
+/*
+ * Standard deviation: stddev,<field>.  Of the whole population, like var.
+ * It can read the moments of an earlier stddev or ord2uni on the same field.
+ */
+
+static bool stddev_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    return use_one_field(config_str, num_fields, fields);
+}
+
+static void stddev_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    if(!isnan(num_data[0]))
+        moments_add_2(_d, num_data[0]);
+}
+
+static void stddev_dump(void *_c, void *_d, FILE *out)
+{
+    struct moments *d = _d;
+    if(d->count == 0)
+        fputs("null", out);
+    else
+        fprintf(out, "%g", sqrt(d->m2 / d->count));
+}
+
+static bool ord2uni_share(void *_c, struct aggregator *other, void *_o);
+
+static bool stddev_share(void *_c, struct aggregator *other, void *_o)
+{
+    return other->share_func == stddev_share || other->share_func == ord2uni_share;
+}
+
+/*
+ * Second order univariate statistics: ord2uni,<field>.  Outputs
+ * {"count":..,"mean":..,"variance":..,"stddev":..,"skewness":..,"kurtosis":..}
+ * (of the population), without skewness and kurtosis if all the values are
+ * the same.
+ */
+
+static bool ord2uni_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    return use_one_field(config_str, num_fields, fields);
+}
+
+static void ord2uni_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    if(!isnan(num_data[0]))
+        moments_add_4(_d, num_data[0]);
+}
+
+static void ord2uni_dump(void *_c, void *_d, FILE *out)
+{
+    struct moments *d = _d;
+    if(d->count == 0)
+    {
+        fputs("null", out);
+        return;
+    }
+
+    double variance = d->m2 / d->count;
+    fprintf(out, "{\"count\":%.0f", d->count);
+    dump_stat(out, false, "mean", d->mean);
+    dump_stat(out, false, "variance", variance);
+    dump_stat(out, false, "stddev", sqrt(variance));
+    if(variance > 0)
+    {
+        dump_stat(out, false, "skewness", d->m3 / d->count / (variance * sqrt(variance)));
+        dump_stat(out, false, "kurtosis", d->m4 / d->count / (variance * variance));
+    }
+    fputc('}', out);
+}
+
+static bool ord2uni_share(void *_c, struct aggregator *other, void *_o)
+{
+    return other->share_func == ord2uni_share;
+}
+
+/*
+ * Comoments: linreg and ord2biv keep the count, the means and the sums of
+ * squared differences from the means of two fields, and the sum of the
+ * products of their differences, with the same kind of updates and merges
+ * as the moments.  Only pairs where both values are numbers count.
+ */
+
+struct comoments
+{
+    double count;
+    double mean_x, mean_y;
+    double m2_x, m2_y;
+    double c_xy;
+};
+
+static void comoments_init(void *_c, void *_d)
+{
+    struct comoments *d = _d;
+    d->count = 0;
+    d->mean_x = d->mean_y = 0;
+    d->m2_x = d->m2_y = d->c_xy = 0;
+}
+
+static void comoments_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct comoments *d = _d;
+    double x = num_data[0], y = num_data[1];
+    if(isnan(x) || isnan(y))
+        return;
+
+    d->count++;
+    double dx = x - d->mean_x;
+    double dy = y - d->mean_y;
+    d->mean_x += dx / d->count;
+    d->mean_y += dy / d->count;
+    d->m2_x += dx * (x - d->mean_x);
+    d->m2_y += dy * (y - d->mean_y);
+    d->c_xy += dx * (y - d->mean_y);
+}
+
+static void comoments_merge(void *_c, void *_d, void *_o)
+{
+    struct comoments *d = _d, *o = _o;
+    if(o->count == 0)
+        return;
+    if(d->count == 0)
+    {
+        *d = *o;
+        return;
+    }
+
+    double n = d->count + o->count;
+    double dx = o->mean_x - d->mean_x;
+    double dy = o->mean_y - d->mean_y;
+    double weight = d->count * o->count / n;
+
+    d->m2_x += o->m2_x + dx * dx * weight;
+    d->m2_y += o->m2_y + dy * dy * weight;
+    d->c_xy += o->c_xy + dx * dy * weight;
+    d->mean_x += dx * o->count / n;
+    d->mean_y += dy * o->count / n;
+    d->count = n;
+}
+
+static void comoments_remove(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct comoments *d = _d;
+    double x = num_data[0], y = num_data[1];
+    if(isnan(x) || isnan(y))
+        return;
+
+    double n = d->count;
+    double na = n - 1;
+    if(na <= 0)
+    {
+        comoments_init(NULL, d);
+        return;
+    }
+
+    double mean_x = (n * d->mean_x - x) / na;
+    double mean_y = (n * d->mean_y - y) / na;
+    double weight = na / n;
+    d->m2_x -= (x - mean_x) * (x - mean_x) * weight;
+    d->m2_y -= (y - mean_y) * (y - mean_y) * weight;
+    d->c_xy -= (x - mean_x) * (y - mean_y) * weight;
+    if(d->m2_x < 0) d->m2_x = 0;
+    if(d->m2_y < 0) d->m2_y = 0;
+    d->mean_x = mean_x;
+    d->mean_y = mean_y;
+    d->count = na;
+}
+
+/* any linreg or ord2biv can read another one's comoments */
+static bool comoments_share(void *_c, struct aggregator *other, void *_o)
+{
+    return other->share_func == comoments_share;
+}
+
+/*
+ * Linear regression: linreg,<x field>,<y field>.  Least squares fit of
+ * y = alpha + beta * x, output as {"alpha":..,"beta":..,"beta_se":..,
+ * "alpha_se":..} with the standard errors of both.
+ */
+
+static bool linreg_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    return use_two_fields(config_str, num_fields, fields);
+}
+
+static void linreg_dump(void *_c, void *_d, FILE *out)
+{
+    struct comoments *d = _d;
+    if(d->count == 0)
+    {
+        fputs("null", out);
+        return;
+    }
+
+    double beta = d->c_xy / d->m2_x;
+    double alpha = d->mean_y - beta * d->mean_x;
+    double residuals = d->m2_y - beta * d->c_xy;
+    if(residuals < 0)
+        residuals = 0;
+    double beta_se = sqrt(residuals / (d->count - 2) / d->m2_x);
+    double alpha_se = beta_se * sqrt(d->m2_x / d->count + d->mean_x * d->mean_x);
+
+    fputc('{', out);
+    dump_stat(out, true, "alpha", alpha);
+    dump_stat(out, false, "beta", beta);
+    dump_stat(out, false, "beta_se", beta_se);
+    dump_stat(out, false, "alpha_se", alpha_se);
+    fputc('}', out);
+}
+
+/*
+ * Second order bivariate statistics: ord2biv,<field1>,<field2>.  Outputs
+ * {"count":..,"covariance":..,"correlation":..,"alpha":..,"beta":..}, the
+ * last two being the linear regression of field2 on field1 (left out if
+ * field1 is always the same).
+ */
+
+static bool ord2biv_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    return use_two_fields(config_str, num_fields, fields);
+}
+
+static void ord2biv_dump(void *_c, void *_d, FILE *out)
+{
+    struct comoments *d = _d;
+    if(d->count == 0)
+    {
+        fputs("null", out);
+        return;
+    }
+
+    fprintf(out, "{\"count\":%.0f", d->count);
+    dump_stat(out, false, "covariance", d->c_xy / d->count);
+    dump_stat(out, false, "correlation", d->m2_x > 0 && d->m2_y > 0 ?
+                                         d->c_xy / sqrt(d->m2_x * d->m2_y) : NAN);
+    if(d->m2_x != 0)
+    {
+        double beta = d->c_xy / d->m2_x;
+        dump_stat(out, false, "alpha", d->mean_y - beta * d->mean_x);
+        dump_stat(out, false, "beta", beta);
+    }
+    fputc('}', out);
+}
+
+/*
+ * First, last, firstrec, lastrec, recformax, recformin, records and array:
+ * the aggregators that keep JSON text around (values, or whole records) to
+ * print out verbatim.  The text is only copied out of the input when it's
+ * going to be kept, into an arena that belongs to the aggregator instance
+ * (which countby, uarray, uconcat and valuestokeys keep their strings in
+ * too).
+ */
+
+struct raw_record current_record;
+bool records_wanted;
+
+struct kept_config_data
+{
+    struct arena arena;
+    bool min;                   /* recformin, not recformax */
+    char *delim;                /* uconcat */
+    int delim_len;
+};
+
+/* some JSON text in the arena (or NULL), and which record it came from.
+ * merges go by the record numbers, since --cube's rollups are merged
+ * together in no particular order. */
+struct kept_text
+{
+    char *text;
+    int len;
+    uint64_t number;
+};
+
+/* wants_record if it needs the current_record (to keep it, or to see how
+ * its values were written) */
+static struct kept_config_data *kept_new_config(void **config_data, bool wants_record)
+{
+    struct kept_config_data *c = *config_data = malloc(sizeof(struct kept_config_data));
+    arena_init(&c->arena);
+    c->min = false;
+    c->delim = NULL;
+    c->delim_len = 0;
+    if(wants_record)
+        records_wanted = true;
+    return c;
+}
+
+static bool kept_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    kept_new_config(config_data, true);
+    return use_one_field(config_str, num_fields, fields);
+}
+
+static bool kept_record_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+{
+    kept_new_config(config_data, true);
+    return true;
+}
+
+static void kept_init(void *_c, void *_d)
+{
+    struct kept_text *d = _d;
+    d->text = NULL;
+    d->len = 0;
+    d->number = 0;
+}
+
+static void kept_drop(struct arena *arena, struct kept_text *d)
+{
+    if(d->text)
+        arena_free(arena, d->text, d->len);
+    d->text = NULL;
+    d->len = 0;
+}
+
+/* make room for len bytes of text in place of what's kept now */
+static char *kept_replace(struct arena *arena, struct kept_text *d, int len)
+{
+    if(d->text == NULL || arena_block_size(d->len) != arena_block_size(len))
+    {
+        kept_drop(arena, d);
+        d->text = arena_alloc(arena, len);
+    }
+    d->len = len;
+    return d->text;
+}
+
+static void kept_copy(struct arena *arena, struct kept_text *d, struct kept_text *other)
+{
+    if(other->text == NULL)
+        kept_drop(arena, d);
+    else
+        memcpy(kept_replace(arena, d, other->len), other->text, other->len);
+    d->number = other->number;
+}
+
+/* the record that's being added, back the way it was in the input (but all
+ * on one line), into current_record.len bytes of text */
+static void copy_record(char *text)
+{
+    memcpy(text, current_record.text, current_record.len);
+    for(int i = 0; i < current_record.num_cuts; i++)
+        text[current_record.cuts[i]] = current_record.cut_chars[i];
+    for(int i = 0; i < current_record.len; i++)
+        if(text[i] == '\n' || text[i] == '\r')
+            text[i] = ' ';
+}
+
+static void kept_record(struct arena *arena, struct kept_text *d)
+{
+    copy_record(kept_replace(arena, d, current_record.len));
+    d->number = current_record.number;
+}
+
+/* whether a value from the record was a string, and needs its quotes back
+ * (values that aren't in the record, like --cube's placeholder, are) */
+static inline bool value_quoted(char *val)
+{
+    return val <= current_record.text || val >= current_record.text + current_record.len ||
+           val[-1] == '"';
+}
+
+/* whether a value from the record was the JSON null */
+static inline bool value_null(char *val)
+{
+    return strcmp(val, "null") == 0 && !value_quoted(val);
+}
+
+/*
+ * What JavaScript's String() makes of a value, as the text that goes between
+ * quotes in JSON.  That's what the TypeScript aggregators use as an object
+ * key or set member: a string is its own text, a number is written the
+ * shortest way that reads back the same (so 1.0 and 1 are both "1"), an
+ * object is [object Object], and an array is its elements' strings (with
+ * null as nothing) joined with commas.  The result is only good until the
+ * next call.
+ */
+
+static char *js_buf;
+static int js_len, js_size;
+
+static void js_append(const char *text, int len)
+{
+    if(js_buf == NULL)
+    {
+        js_size = 64;
+        js_buf = malloc(js_size);
+    }
+    RESIZE_ARRAY_IF_NECESSARY(js_buf, js_size, js_len + len + 1);
+    memcpy(js_buf + js_len, text, len);
+    js_len += len;
+    js_buf[js_len] = '\0';
+}
+
+static void js_number(double value)
+{
+    if(value == 0)
+    {
+        js_append("0", 1);
+        return;
+    }
+    if(isinf(value))
+    {
+        js_append("-Infinity" + (value > 0), 9 - (value > 0));
+        return;
+    }
+
+    /* the fewest significant digits that read back as the same number */
+    char sci[32];
+    for(int precision = 1; precision <= 17; precision++)
+    {
+        snprintf(sci, sizeof(sci), "%.*e", precision - 1, value);
+        if(strtod(sci, NULL) == value)
+            break;
+    }
+
+    char digits[20];
+    int k = 0;
+    char *p = sci;
+    if(*p == '-')
+        js_append(p++, 1);
+    for(; *p != 'e'; p++)
+        if(*p != '.')
+            digits[k++] = *p;
+    while(k > 1 && digits[k-1] == '0')
+        k--;
+
+    /* the value is 0.<digits> * 10 ** n */
+    int n = atoi(p + 1) + 1;
+    if(k <= n && n <= 21)
+    {
+        js_append(digits, k);
+        for(int i = k; i < n; i++)
+            js_append("0", 1);
+    }
+    else if(0 < n && n <= 21)
+    {
+        js_append(digits, n);
+        js_append(".", 1);
+        js_append(digits + n, k - n);
+    }
+    else if(-6 < n && n <= 0)
+    {
+        js_append("0.", 2);
+        for(int i = n; i < 0; i++)
+            js_append("0", 1);
+        js_append(digits, k);
+    }
+    else
+    {
+        char exponent[16];
+        js_append(digits, 1);
+        if(k > 1)
+        {
+            js_append(".", 1);
+            js_append(digits + 1, k - 1);
+        }
+        js_append(exponent, snprintf(exponent, sizeof(exponent), "e%+d", n - 1));
+    }
+}
+
+/* the end of the JSON string or structure starting at text */
+static char *json_skip(char *text)
+{
+    int depth = 0;
+    do
+    {
+        if(*text == '"')
+        {
+            for(text++; *text != '"'; text++)
+                if(*text == '\\')
+                    text++;
+        }
+        else if(*text == '{' || *text == '[')
+        {
+            depth++;
+        }
+        else if(*text == '}' || *text == ']')
+        {
+            depth--;
+        }
+        text++;
+    } while(depth > 0);
+    return text;
+}
+
+/* add String() of the JSON value at *text, and move *text past it */
+static void js_string_value(char **text, bool in_array)
+{
+    char *p = *text + strspn(*text, " \t\r\n");
+    if(*p == '"')
+    {
+        char *end = json_skip(p);
+        js_append(p + 1, end - p - 2);
+        p = end;
+    }
+    else if(*p == '{')
+    {
+        js_append("[object Object]", 15);
+        p = json_skip(p);
+    }
+    else if(*p == '[')
+    {
+        p++;
+        for(bool first = true; ; first = false)
+        {
+            p += strspn(p, " \t\r\n");
+            if(*p == ']')
+                break;
+            if(!first)
+                js_append(",", 1);
+            js_string_value(&p, true);
+            p += strspn(p, " \t\r\n");
+            if(*p == ',')
+                p++;
+        }
+        p++;
+    }
+    else if(strncmp(p, "null", 4) == 0)
+    {
+        if(!in_array)
+            js_append("null", 4);
+        p += 4;
+    }
+    else if(strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0)
+    {
+        int len = *p == 't' ? 4 : 5;
+        js_append(p, len);
+        p += len;
+    }
+    else
+    {
+        js_number(strtod(p, &p));
+    }
+    *text = p;
+}
+
+static char *js_string(char *val)
+{
+    if(value_quoted(val))
+        return val;
+
+    js_len = 0;
+    js_append("", 0);
+    js_string_value(&val, false);
+    return js_buf;
+}
+
+/* the value's len bytes, into len + 2 bytes of text if it's quoted (an
+ * object or array that isn't is put all on one line) */
+static void copy_value(char *text, char *val, int len, bool quoted)
+{
+    if(quoted)
+        *text++ = '"';
+    memcpy(text, val, len);
+    if(quoted)
+        text[len] = '"';
+    else    /* an object or array may be spread over lines; ours is one */
+        for(int i = 0; i < len; i++)
+            if(text[i] == '\n' || text[i] == '\r')
+                text[i] = ' ';
+}
+
+static void kept_value(struct arena *arena, struct kept_text *d, char *val)
+{
+    int len = strlen(val);
+    bool quoted = value_quoted(val);
+    copy_value(kept_replace(arena, d, len + 2 * quoted), val, len, quoted);
+    d->number = current_record.number;
+}
+
+static void kept_dump(void *_c, void *_d, FILE *out)
+{
+    struct kept_text *d = _d;
+    if(d->text)
+        fwrite(d->text, sizeof(char), d->len, out);
+    else
+        fputs("null", out);
+}
+
+static void kept_free(void *_c, void *_d)
+{
+    struct kept_config_data *c = _c;
+    kept_drop(&c->arena, _d);
+}
+
+static size_t kept_memory(void *_c, void *_d)
+{
+    struct kept_text *d = _d;
+    return d->text ? arena_block_size(d->len) : 0;
+}
+
+static void kept_serialize(void *_c, void *_d, FILE *out)
+{
+    struct kept_text *d = _d;
+    fwrite(&d->number, sizeof(d->number), 1, out);
+    write_int(out, d->text ? d->len : -1);
+    if(d->text)
+        fwrite(d->text, sizeof(char), d->len, out);
+}
+
+static bool kept_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct kept_config_data *c = _c;
+    struct kept_text *d = _d;
+    kept_init(_c, _d);
+    int len;
+    if(fread(&d->number, sizeof(d->number), 1, in) != 1 || !read_int(in, &len))
+        return false;
+    if(len < 0)
+        return true;
+    if(fread(kept_replace(&c->arena, d, len), sizeof(char), len, in) != (size_t)len)
+    {
+        kept_drop(&c->arena, d);
+        return false;
     }
+    return true;
 }
 
-static int cmp_dbl(const void *s1, const void *s2)
+/*
+ * First and firstrec: the first value of a field (that isn't null), or the
+ * first record
+ */
+
+static void first_add(void *_c, void *_d, char *ch_data[], double num_data[])
 {
-    double d1 = *(double*)s1;
-    double d2 = *(double*)s2;
-    if(d1 < d2) return -1;
-    else if(d1 > d2) return 1;
-    else return 0;
+    struct kept_config_data *c = _c;
+    struct kept_text *d = _d;
+    if(d->text == NULL && ch_data[0] && !value_null(ch_data[0]))
+        kept_value(&c->arena, d, ch_data[0]);
 }
 
-static void perc_dump(void *_c, void *_d)
+static void firstrec_add(void *_c, void *_d, char *ch_data[], double num_data[])
 {
-    struct perc_config_data *c = _c;
-    struct perc_data *d = _d;
-    qsort(d->values, d->values_len, sizeof(*d->values), cmp_dbl);
-    double perc = d->values[(int)floor((c->percentile / 100) * d->values_len)];
-    printf("%g", perc);
+    struct kept_config_data *c = _c;
+    struct kept_text *d = _d;
+    if(d->text == NULL)
+        kept_record(&c->arena, d);
 }
 
-static void perc_free(void *_c, void *_d)
+static void first_merge(void *_c, void *_d, void *_o)
 {
-    struct concat_data *d = _d;
-    free(d->concat_buf);
+    struct kept_config_data *c = _c;
+    struct kept_text *d = _d, *o = _o;
+    if(o->text && (d->text == NULL || o->number < d->number))
+        kept_copy(&c->arena, d, o);
 }
 
 /*
- * Mode
+ * Last and lastrec: the field's value in the last record (null if it didn't
+ * have one), or the last record
  */
 
-static hash_val_t str_hash_func(const void *_k)
+struct last_data
 {
-    char *k = (char*)_k;
-    return hashlittle(k, strlen(k), 0);
+    struct kept_text kept;
+    bool seen;
+};
+
+static void last_init(void *_c, void *_d)
+{
+    struct last_data *d = _d;
+    kept_init(_c, &d->kept);
+    d->seen = false;
 }
 
-struct table_entry
+static void last_add(void *_c, void *_d, char *ch_data[], double num_data[])
 {
-    double count;
-};
+    struct kept_config_data *c = _c;
+    struct last_data *d = _d;
+    if(ch_data[0])
+        kept_value(&c->arena, &d->kept, ch_data[0]);
+    else
+        kept_drop(&c->arena, &d->kept);
+    d->kept.number = current_record.number;
+    d->seen = true;
+}
 
-struct mode_data
+static void last_merge(void *_c, void *_d, void *_o)
 {
-    hash_t *hash_table;
+    struct kept_config_data *c = _c;
+    struct last_data *d = _d, *o = _o;
+    if(o->seen && (!d->seen || o->kept.number > d->kept.number))
+    {
+        kept_copy(&c->arena, &d->kept, &o->kept);
+        d->seen = true;
+    }
+}
+
+static void last_serialize(void *_c, void *_d, FILE *out)
+{
+    struct last_data *d = _d;
+    kept_serialize(_c, &d->kept, out);
+    write_int(out, d->seen);
+}
+
+static bool last_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct last_data *d = _d;
+    int seen = 0;
+    bool ok = kept_deserialize(_c, &d->kept, in) && read_int(in, &seen);
+    d->seen = seen;
+    return ok;
+}
+
+static void lastrec_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct kept_config_data *c = _c;
+    kept_record(&c->arena, _d);
+}
+
+static void lastrec_merge(void *_c, void *_d, void *_o)
+{
+    struct kept_config_data *c = _c;
+    struct kept_text *d = _d, *o = _o;
+    if(o->text && (d->text == NULL || o->number > d->number))
+        kept_copy(&c->arena, d, o);
+}
 
-    /* this is just a pool of nodes */
-    int nodes_len, nodes_size;
-    hnode_t *nodes;
+/*
+ * Recformax and recformin: the record with the biggest (or smallest) value
+ * of a field.  The last one wins a tie, and the record is only copied when
+ * it takes the lead.
+ */
 
-    /* this is just a pool of table_entry objs */
-    int entries_len, entries_size;
-    struct table_entry *entries;
+struct recfor_data
+{
+    struct kept_text kept;
+    double value;
 };
 
-static bool mode_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+static bool recformin_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
 {
+    kept_new_config(config_data, true)->min = true;
     return use_one_field(config_str, num_fields, fields);
 }
 
-static void mode_init(void *_c, void *_d)
+static void recfor_init(void *_c, void *_d)
 {
-    struct mode_data *d = _d;
-    d->hash_table = hash_create(HASHCOUNT_T_MAX, NULL, str_hash_func);
-    d->nodes_size = d->entries_size = 32;
-    d->nodes_len = d->entries_len = 0;
-    d->nodes = malloc(sizeof(*d->nodes) * d->nodes_size);
-    d->entries = malloc(sizeof(*d->entries) * d->entries_size);
+    struct recfor_data *d = _d;
+    kept_init(_c, &d->kept);
+    d->value = NAN;
 }
 
-static void mode_add(void *_c, void *_d, char *ch_data[], double num_data[])
+static inline bool recfor_takes_lead(struct kept_config_data *c, struct recfor_data *d,
+                                     double value, uint64_t number)
 {
-    struct mode_data *d = _d;
-    hnode_t *node = hash_lookup(d->hash_table, ch_data[0]);
-    if(node == NULL)
+    if(d->kept.text == NULL)
+        return true;
+    if(value == d->value)
+        return number > d->kept.number;
+    return c->min ? value < d->value : value > d->value;
+}
+
+static void recfor_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct kept_config_data *c = _c;
+    struct recfor_data *d = _d;
+    if(!isnan(num_data[0]) && recfor_takes_lead(c, d, num_data[0], current_record.number))
     {
-        RESIZE_ARRAY_IF_NECESSARY(d->nodes, d->nodes_size, d->nodes_len+1);
-        RESIZE_ARRAY_IF_NECESSARY(d->entries, d->entries_size, d->entries_len+1);
-        struct table_entry *entry = &d->entries[d->entries_len++];
-        entry->count = 0;
-        node = hnode_init(&d->nodes[d->nodes_len++], entry);
-        hash_insert(d->hash_table, node, strdup(ch_data[0]));
+        kept_record(&c->arena, &d->kept);
+        d->value = num_data[0];
     }
-    struct table_entry *entry = hnode_get(node);
-    entry->count++;
 }
 
-static void mode_dump(void *_c, void *_d)
+static void recfor_merge(void *_c, void *_d, void *_o)
 {
-    printf("Mode dump!\n");
-    struct mode_data *d = _d;
-    hscan_t scan;
-    hash_scan_begin(&scan, d->hash_table);
-    hnode_t *node;
-    double max_num = 0;
-    char *max_val = NULL;
-    while((node = hash_scan_next(&scan)))
+    struct kept_config_data *c = _c;
+    struct recfor_data *d = _d, *o = _o;
+    if(o->kept.text && recfor_takes_lead(c, d, o->value, o->kept.number))
     {
-        struct table_entry *entry = hnode_get(node);
-        if(entry->count > max_num)
-        {
-            max_num = entry->count;
-            max_val = (char*)hnode_getkey(node);
-        }
+        kept_copy(&c->arena, &d->kept, &o->kept);
+        d->value = o->value;
     }
-    putc('"', stdout);
-    fputs(max_val, stdout);
-    putc('"', stdout);
 }
 
-static void mode_free(void *_c, void *_d)
+static void recfor_serialize(void *_c, void *_d, FILE *out)
 {
-    struct mode_data *d = _d;
+    struct recfor_data *d = _d;
+    kept_serialize(_c, &d->kept, out);
+    fwrite(&d->value, sizeof(d->value), 1, out);
+}
 
-    /* free all the hash keys */
-    hscan_t scan;
-    hash_scan_begin(&scan, d->hash_table);
-    hnode_t *node;
-    while((node = hash_scan_next(&scan)))
+static bool recfor_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct recfor_data *d = _d;
+    return kept_deserialize(_c, &d->kept, in) &&
+           fread(&d->value, sizeof(d->value), 1, in) == 1;
+}
+
+/*
+ * Records and array: every record, or every value of a field, in an array.
+ * They're kept as one block of text, separated by commas, that doubles as it
+ * fills up.
+ */
+
+struct kept_list
+{
+    char *text;
+    int len;
+    int size;                   /* of the block, or 0 if there isn't one */
+};
+
+static void kept_list_init(void *_c, void *_d)
+{
+    struct kept_list *d = _d;
+    d->text = NULL;
+    d->len = d->size = 0;
+}
+
+/* make room for len more bytes after a comma, and return where they go */
+static char *kept_list_append(struct arena *arena, struct kept_list *d, int len)
+{
+    int needed = d->len + (d->len > 0) + len;
+    if(needed > d->size)
     {
-        hash_scan_delete(d->hash_table, node);
-        free((void*)hnode_getkey(node));
+        int size = arena_block_size(needed > 2 * d->size ? needed : 2 * d->size);
+        d->text = arena_realloc(arena, d->text, d->size, size);
+        d->size = size;
     }
+    if(d->len > 0)
+        d->text[d->len++] = ',';
+    d->len += len;
+    return d->text + d->len - len;
+}
 
-    hash_destroy(d->hash_table);
+static void records_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct kept_config_data *c = _c;
+    copy_record(kept_list_append(&c->arena, _d, current_record.len));
+}
+
+static void array_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct kept_config_data *c = _c;
+    if(ch_data[0])
+    {
+        int len = strlen(ch_data[0]);
+        bool quoted = value_quoted(ch_data[0]);
+        copy_value(kept_list_append(&c->arena, _d, len + 2 * quoted), ch_data[0], len, quoted);
+    }
+}
+
+static void kept_list_dump(void *_c, void *_d, FILE *out)
+{
+    struct kept_list *d = _d;
+    putc('[', out);
+    fwrite(d->text, sizeof(char), d->len, out);
+    putc(']', out);
+}
 
-    /* free the pools of nodes and entries */
-    free(d->nodes);
-    free(d->entries);
+static void kept_list_free(void *_c, void *_d)
+{
+    struct kept_config_data *c = _c;
+    struct kept_list *d = _d;
+    if(d->text)
+        arena_free(&c->arena, d->text, d->size);
+}
+
+static void kept_list_merge(void *_c, void *_d, void *_o)
+{
+    struct kept_config_data *c = _c;
+    struct kept_list *o = _o;
+    if(o->len > 0)
+        memcpy(kept_list_append(&c->arena, _d, o->len), o->text, o->len);
+}
+
+static size_t kept_list_memory(void *_c, void *_d)
+{
+    struct kept_list *d = _d;
+    return d->size;
+}
+
+static void kept_list_serialize(void *_c, void *_d, FILE *out)
+{
+    struct kept_list *d = _d;
+    write_int(out, d->len);
+    fwrite(d->text, sizeof(char), d->len, out);
 }
 
+static bool kept_list_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct kept_config_data *c = _c;
+    struct kept_list *d = _d;
+    kept_list_init(_c, _d);
+    int len;
+    if(!read_int(in, &len) || len < 0)
+        return false;
+    if(len == 0)
+        return true;
+    d->size = arena_block_size(len);
+    d->text = arena_alloc(&c->arena, d->size);
+    d->len = fread(d->text, sizeof(char), len, in);
+    return d->len == len;
+}
 
 /*
- * Variance
+ * Countby: how many times each value of a field (but null) was seen, as an
+ * object (in the order the values were first seen).  Values are counted by
+ * what JavaScript's String() makes of them, so 1 and 1.0 are both "1".
  */
 
-struct var_data
+struct countby_data
 {
-    double count;
-    double sum_of_squares;
-    double sum;
+    struct strset set;
+    uint64_t *counts;           /* by index in set */
 };
 
-static bool var_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+static bool strs_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
 {
+    kept_new_config(config_data, true);
     return use_one_field(config_str, num_fields, fields);
 }
 
-static void var_init(void *_c, void *_d)
+static void countby_init(void *_c, void *_d)
 {
-    struct var_data *d = _d;
-    d->count = 0;
-    d->sum_of_squares = 0;
-    d->sum = 0;
+    struct countby_data *d = _d;
+    strset_init(&d->set);
+    d->counts = NULL;
 }
 
-static void var_add(void *_c, void *_d, char *ch_data[], double num_data[])
+static void countby_add_count(struct arena *arena, struct countby_data *d, char *val, uint64_t count)
 {
-    struct var_data *d = _d;
-    if(!isnan(num_data[0]))
+    int len = d->set.len, size = d->set.size;
+    int i = strset_add(&d->set, arena, val);
+    if(d->set.size != size)
+        d->counts = arena_realloc(arena, d->counts, sizeof(*d->counts) * size,
+                                  sizeof(*d->counts) * d->set.size);
+    if(d->set.len > len)
+        d->counts[i] = 0;
+    d->counts[i] += count;
+}
+
+static void countby_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct kept_config_data *c = _c;
+    if(ch_data[0] && !value_null(ch_data[0]))
+        countby_add_count(&c->arena, _d, js_string(ch_data[0]), 1);
+}
+
+static void countby_dump(void *_c, void *_d, FILE *out)
+{
+    struct countby_data *d = _d;
+    putc('{', out);
+    for(int i = 0; i < d->set.len; i++)
+        fprintf(out, "%s\"%s\":%llu", i ? "," : "", strset_str(&d->set, i),
+                (unsigned long long)d->counts[i]);
+    putc('}', out);
+}
+
+static void countby_free(void *_c, void *_d)
+{
+    struct kept_config_data *c = _c;
+    struct countby_data *d = _d;
+    if(d->counts)
+        arena_free(&c->arena, d->counts, sizeof(*d->counts) * d->set.size);
+    strset_release(&d->set, &c->arena);
+}
+
+static void countby_merge(void *_c, void *_d, void *_o)
+{
+    struct kept_config_data *c = _c;
+    struct countby_data *o = _o;
+    for(int i = 0; i < o->set.len; i++)
+        countby_add_count(&c->arena, _d, strset_str(&o->set, i), o->counts[i]);
+}
+
+static size_t countby_memory(void *_c, void *_d)
+{
+    struct countby_data *d = _d;
+    return strset_memory(&d->set) +
+           (d->counts ? arena_block_size(sizeof(*d->counts) * d->set.size) : 0);
+}
+
+static void countby_serialize(void *_c, void *_d, FILE *out)
+{
+    struct countby_data *d = _d;
+    strset_write(&d->set, out);
+    fwrite(d->counts, sizeof(*d->counts), d->set.len, out);
+}
+
+static bool countby_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct kept_config_data *c = _c;
+    struct countby_data *d = _d;
+    countby_init(_c, _d);
+    bool ok = strset_read(&d->set, &c->arena, in);
+    if(d->set.size)
     {
-        d->count++;
-        d->sum_of_squares += num_data[0] * num_data[0];
-        d->sum += num_data[0];
+        d->counts = arena_alloc(&c->arena, sizeof(*d->counts) * d->set.size);
+        if(!ok || fread(d->counts, sizeof(*d->counts), d->set.len, in) != (size_t)d->set.len)
+        {
+            memset(d->counts, 0, sizeof(*d->counts) * d->set.len);
+            return false;
+        }
     }
+    return ok;
 }
 
-static double var_val(struct var_data *d)
+/*
+ * Uarray and uconcat: the distinct values of a field (but null, and as
+ * JavaScript's String() would write them), sorted, in an array or joined by a
+ * delimiter
+ */
+
+/* str as it goes between quotes in JSON (to be freed) */
+static char *json_escape(const char *str)
 {
-    double avg = d->sum / d->count;
-    double var = (d->sum_of_squares / d->count) - (avg * avg);
-    return var;
+    char *escaped = malloc(strlen(str) * 6 + 1), *p = escaped;
+    for(; *str; str++)
+    {
+        unsigned char ch = *str;
+        char *special = strchr("\"\\\b\f\n\r\t", ch);
+        if(special)
+            p += sprintf(p, "\\%c", "\"\\bfnrt"[special - "\"\\\b\f\n\r\t"]);
+        else if(ch < 0x20)
+            p += sprintf(p, "\\u%04x", ch);
+        else
+            *p++ = ch;
+    }
+    *p = '\0';
+    return escaped;
 }
 
-static void var_dump(void *_c, void *_d)
+static bool uconcat_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
 {
-    struct var_data *d = _d;
-    printf("%g", var_val(d));
+    char *comma = strchr(config_str, ',');
+    if(!comma) return false;
+    *comma++ = '\0';
+
+    struct kept_config_data *c = kept_new_config(config_data, true);
+    c->delim = json_escape(config_str);
+    c->delim_len = strlen(c->delim);
+
+    return use_one_field(comma, num_fields, fields);
+}
+
+static void uniq_init(void *_c, void *_d)
+{
+    strset_init(_d);
+}
+
+static void uniq_add(void *_c, void *_d, char *ch_data[], double num_data[])
+{
+    struct kept_config_data *c = _c;
+    if(ch_data[0] && !value_null(ch_data[0]))
+        strset_add(_d, &c->arena, js_string(ch_data[0]));
+}
+
+static int cmp_str(const void *s1, const void *s2)
+{
+    return strcmp(*(char**)s1, *(char**)s2);
+}
+
+/* the set's strings, sorted (to be freed) */
+static char **uniq_sorted(struct strset *set)
+{
+    char **strs = malloc(sizeof(*strs) * (set->len + 1));
+    for(int i = 0; i < set->len; i++)
+        strs[i] = strset_str(set, i);
+    qsort(strs, set->len, sizeof(*strs), cmp_str);
+    return strs;
+}
+
+static void uarray_dump(void *_c, void *_d, FILE *out)
+{
+    struct strset *d = _d;
+    char **strs = uniq_sorted(d);
+    putc('[', out);
+    for(int i = 0; i < d->len; i++)
+        fprintf(out, "%s\"%s\"", i ? "," : "", strs[i]);
+    putc(']', out);
+    free(strs);
+}
+
+static void uconcat_dump(void *_c, void *_d, FILE *out)
+{
+    struct kept_config_data *c = _c;
+    struct strset *d = _d;
+    char **strs = uniq_sorted(d);
+    putc('"', out);
+    for(int i = 0; i < d->len; i++)
+    {
+        if(i)
+            fwrite(c->delim, sizeof(char), c->delim_len, out);
+        fputs(strs[i], out);
+    }
+    putc('"', out);
+    free(strs);
+}
+
+static void uniq_free(void *_c, void *_d)
+{
+    struct kept_config_data *c = _c;
+    strset_release(_d, &c->arena);
+}
+
+static void uniq_merge(void *_c, void *_d, void *_o)
+{
+    struct kept_config_data *c = _c;
+    struct strset *o = _o;
+    for(int i = 0; i < o->len; i++)
+        strset_add(_d, &c->arena, strset_str(o, i));
+}
+
+static size_t uniq_memory(void *_c, void *_d)
+{
+    return strset_memory(_d);
+}
+
+static void uniq_serialize(void *_c, void *_d, FILE *out)
+{
+    strset_write(_d, out);
+}
+
+static bool uniq_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct kept_config_data *c = _c;
+    strset_init(_d);
+    return strset_read(_d, &c->arena, in);
 }
 
 /*
- * Correlation
+ * Valuestokeys: an object from each value of one field (but null) to the
+ * value of another field in the last record with that value (or null, if it
+ * didn't have one)
  */
 
-struct corr_data
+struct vk_data
 {
-    struct cov_data cov_data;
-    struct var_data var_data1;
-    struct var_data var_data2;
+    struct strset set;
+    struct kept_text *values;   /* by index in set */
 };
 
-static bool corr_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
+static bool vk_parse_args(void **config_data, char *config_str, int *num_fields, char **fields)
 {
+    kept_new_config(config_data, true);
     return use_two_fields(config_str, num_fields, fields);
 }
 
-static void corr_init(void *_c, void *_d)
+static void vk_init(void *_c, void *_d)
 {
-    struct corr_data *d = _d;
-    cov_init(_c, &d->cov_data);
-    var_init(_c, &d->var_data1);
-    var_init(_c, &d->var_data2);
+    struct vk_data *d = _d;
+    strset_init(&d->set);
+    d->values = NULL;
 }
 
-static void corr_add(void *_c, void *_d, char *ch_data[], double num_data[])
+/* the value for key, adding key (with no value yet) if need be */
+static struct kept_text *vk_value(struct arena *arena, struct vk_data *d, char *key)
+{
+    int len = d->set.len, size = d->set.size;
+    int i = strset_add(&d->set, arena, key);
+    if(d->set.size != size)
+        d->values = arena_realloc(arena, d->values, sizeof(*d->values) * size,
+                                  sizeof(*d->values) * d->set.size);
+    if(d->set.len > len)
+        kept_init(NULL, &d->values[i]);
+    return &d->values[i];
+}
+
+static void vk_add(void *_c, void *_d, char *ch_data[], double num_data[])
 {
-    struct corr_data *d = _d;
-    cov_add(NULL, &d->cov_data, ch_data, num_data);
-    var_add(NULL, &d->var_data1, ch_data, num_data);
-    var_add(NULL, &d->var_data2, ch_data+1, num_data+1);
+    struct kept_config_data *c = _c;
+    if(ch_data[0] == NULL || value_null(ch_data[0]))
+        return;
+
+    struct kept_text *value = vk_value(&c->arena, _d, js_string(ch_data[0]));
+    if(ch_data[1])
+        kept_value(&c->arena, value, ch_data[1]);
+    else
+        kept_drop(&c->arena, value);
+    value->number = current_record.number;
 }
 
-static void corr_dump(void *_c, void *_d)
+static void vk_dump(void *_c, void *_d, FILE *out)
 {
-    struct corr_data *d = _d;
-    double cov = cov_val(&d->cov_data);
-    double var1 = var_val(&d->var_data1);
-    double var2 = var_val(&d->var_data2);
-    double corr = cov / sqrt(var1 * var2);
-    printf("%g", corr);
+    struct vk_data *d = _d;
+    putc('{', out);
+    for(int i = 0; i < d->set.len; i++)
+    {
+        fprintf(out, "%s\"%s\":", i ? "," : "", strset_str(&d->set, i));
+        kept_dump(_c, &d->values[i], out);
+    }
+    putc('}', out);
+}
+
+static void vk_free(void *_c, void *_d)
+{
+    struct kept_config_data *c = _c;
+    struct vk_data *d = _d;
+    for(int i = 0; i < d->set.len; i++)
+        kept_drop(&c->arena, &d->values[i]);
+    if(d->values)
+        arena_free(&c->arena, d->values, sizeof(*d->values) * d->set.size);
+    strset_release(&d->set, &c->arena);
+}
+
+static void vk_merge(void *_c, void *_d, void *_o)
+{
+    struct kept_config_data *c = _c;
+    struct vk_data *d = _d, *o = _o;
+    for(int i = 0; i < o->set.len; i++)
+    {
+        int len = d->set.len;
+        struct kept_text *value = vk_value(&c->arena, d, strset_str(&o->set, i));
+        if(d->set.len > len || o->values[i].number > value->number)
+            kept_copy(&c->arena, value, &o->values[i]);
+    }
+}
+
+static size_t vk_memory(void *_c, void *_d)
+{
+    struct vk_data *d = _d;
+    size_t bytes = strset_memory(&d->set);
+    if(d->values)
+        bytes += arena_block_size(sizeof(*d->values) * d->set.size);
+    for(int i = 0; i < d->set.len; i++)
+        bytes += kept_memory(_c, &d->values[i]);
+    return bytes;
+}
+
+static void vk_serialize(void *_c, void *_d, FILE *out)
+{
+    struct vk_data *d = _d;
+    strset_write(&d->set, out);
+    for(int i = 0; i < d->set.len; i++)
+        kept_serialize(_c, &d->values[i], out);
+}
+
+static bool vk_deserialize(void *_c, void *_d, FILE *in)
+{
+    struct kept_config_data *c = _c;
+    struct vk_data *d = _d;
+    vk_init(_c, _d);
+    bool ok = strset_read(&d->set, &c->arena, in);
+    if(d->set.size)
+        d->values = arena_alloc(&c->arena, sizeof(*d->values) * d->set.size);
+    /* every value is read (or left empty), so that they can all be freed */
+    for(int i = 0; i < d->set.len; i++)
+        ok = kept_deserialize(_c, &d->values[i], in) && ok;
+    return ok;
 }
 
 struct aggregator aggregators[] = {
+    {"array", "array", sizeof(struct kept_list),
+      kept_parse_args, kept_list_init, array_add, kept_list_dump, kept_list_free,
+      kept_list_merge, kept_list_serialize, kept_list_deserialize, kept_list_memory,
+      NULL, NULL, NULL, NULL,
+      true, true},
     {"average", "avg", sizeof(struct avg_data),
-      avg_parse_args, avg_init, avg_add, avg_dump, NULL},
+      avg_parse_args, avg_init, avg_add, avg_dump, NULL,
+      avg_merge, NULL, NULL, NULL,
+      avg_remove, NULL, NULL, avg_add_batch},
     {"concatenate", "concat", sizeof(struct concat_data),
-      concat_parse_args, concat_init, concat_add, concat_dump, concat_free},
+      concat_parse_args, concat_init, concat_add, concat_dump, concat_free,
+      concat_merge, concat_serialize, concat_deserialize, concat_memory,
+      concat_remove, NULL, NULL, NULL,
+      true},
     {"count", "ct", sizeof(struct count_data),
-      count_parse_args, count_init, count_add, count_dump, NULL},
+      count_parse_args, count_init, count_add, count_dump, NULL,
+      count_merge, NULL, NULL, NULL,
+      count_remove, NULL, NULL, count_add_batch},
+    {"countby", "cb", sizeof(struct countby_data),
+      strs_parse_args, countby_init, countby_add, countby_dump, countby_free,
+      countby_merge, countby_serialize, countby_deserialize, countby_memory,
+      NULL, NULL, NULL, NULL,
+      true, true},
     {"correlation", "corr", sizeof(struct corr_data),
-      corr_parse_args, corr_init, corr_add, corr_dump, NULL},
+      corr_parse_args, corr_init, corr_add, corr_dump, NULL,
+      corr_merge, NULL, NULL, NULL,
+      corr_remove, NULL, NULL, corr_add_batch},
     {"covariance", "cov", sizeof(struct cov_data),
-      cov_parse_args, cov_init, cov_add, cov_dump, NULL},
+      cov_parse_args, cov_init, cov_add, cov_dump, NULL,
+      cov_merge, NULL, NULL, NULL,
+      cov_remove, NULL, NULL, cov_add_batch},
+    {"distinctcount", "dcount", sizeof(struct dcount_data),
+      dcount_parse_args, dcount_init, dcount_add, dcount_dump, dcount_free,
+      dcount_merge, dcount_serialize, dcount_deserialize, dcount_memory,
+      NULL, NULL, NULL, NULL},
+    {"first", "first", sizeof(struct kept_text),
+      kept_parse_args, kept_init, first_add, kept_dump, kept_free,
+      first_merge, kept_serialize, kept_deserialize, kept_memory,
+      NULL, NULL, NULL, NULL,
+      false, true},
+    {"firstrecord", "firstrec", sizeof(struct kept_text),
+      kept_record_parse_args, kept_init, firstrec_add, kept_dump, kept_free,
+      first_merge, kept_serialize, kept_deserialize, kept_memory,
+      NULL, NULL, NULL, NULL},
+    {"hdrhistogram", "hdr", sizeof(struct hdrhist),
+      hdr_parse_args, hdr_init, hdr_add, hdr_dump, hdr_free,
+      hdr_merge, hdr_serialize, hdr_deserialize, hdr_memory,
+      NULL, NULL, NULL, NULL},
+    {"hyperloglog", "hll", sizeof(struct hll),
+      hll_agg_parse_args, hll_agg_init, hll_agg_add, hll_agg_dump, hll_agg_free,
+      hll_agg_merge, hll_agg_serialize, hll_agg_deserialize, hll_agg_memory,
+      NULL, NULL, NULL, NULL},
+    {"kll", "kll", sizeof(struct kll_sketch),
+      kll_parse_args, kll_init, kll_add, kll_dump, kll_free,
+      kll_merge, kll_serialize, kll_deserialize, kll_memory,
+      NULL, NULL, NULL, NULL},
+    {"last", "last", sizeof(struct last_data),
+      kept_parse_args, last_init, last_add, kept_dump, kept_free,
+      last_merge, last_serialize, last_deserialize, kept_memory,
+      NULL, NULL, NULL, NULL,
+      false, true},
+    {"lastrecord", "lastrec", sizeof(struct kept_text),
+      kept_record_parse_args, kept_init, lastrec_add, kept_dump, kept_free,
+      lastrec_merge, kept_serialize, kept_deserialize, kept_memory,
+      NULL, NULL, NULL, NULL},
+    {"linearregression", "linreg", sizeof(struct comoments),
+      linreg_parse_args, comoments_init, comoments_add, linreg_dump, NULL,
+      comoments_merge, NULL, NULL, NULL,
+      comoments_remove, NULL, comoments_share, NULL},
     {"maximum", "max", sizeof(struct max_data),
-      max_parse_args, max_init, max_add, max_dump, NULL},
+      max_parse_args, max_init, max_add, max_dump, max_free,
+      max_merge, NULL, NULL, max_memory,
+      max_remove, max_window_init, NULL, max_add_batch},
     {"minimum", "min", sizeof(struct min_data),
-      min_parse_args, min_init, min_add, min_dump, NULL},
+      min_parse_args, min_init, min_add, min_dump, min_free,
+      min_merge, NULL, NULL, min_memory,
+      min_remove, min_window_init, NULL, min_add_batch},
     {"mode", "mode", sizeof(struct mode_data),
-      mode_parse_args, mode_init, mode_add, mode_dump, mode_free},
+      mode_parse_args, mode_init, mode_add, mode_dump, mode_free,
+      mode_merge, mode_serialize, mode_deserialize, mode_memory,
+      mode_remove, NULL, NULL, NULL},
+    {"ord2bivariate", "ord2biv", sizeof(struct comoments),
+      ord2biv_parse_args, comoments_init, comoments_add, ord2biv_dump, NULL,
+      comoments_merge, NULL, NULL, NULL,
+      comoments_remove, NULL, comoments_share, NULL},
+    {"ord2univariate", "ord2uni", sizeof(struct moments),
+      ord2uni_parse_args, moments_init, ord2uni_add, ord2uni_dump, NULL,
+      moments_merge, NULL, NULL, NULL,
+      moments_remove, NULL, ord2uni_share, NULL},
     {"percentile", "perc", sizeof(struct perc_data),
-      perc_parse_args, perc_init, perc_add, perc_dump, perc_free},
+      perc_parse_args, perc_init, perc_add, perc_dump, perc_free,
+      perc_merge, perc_serialize, perc_deserialize, perc_memory,
+      perc_remove, perc_window_init, perc_share, NULL},
+    {"percentile_map", "percmap", sizeof(struct perc_data),
+      perc_map_parse_args, perc_init, perc_add, perc_dump, perc_free,
+      perc_merge, perc_serialize, perc_deserialize, perc_memory,
+      perc_remove, perc_window_init, perc_share, NULL},
+    {"recordformaximum", "recformax", sizeof(struct recfor_data),
+      kept_parse_args, recfor_init, recfor_add, kept_dump, kept_free,
+      recfor_merge, recfor_serialize, recfor_deserialize, kept_memory,
+      NULL, NULL, NULL, NULL},
+    {"recordforminimum", "recformin", sizeof(struct recfor_data),
+      recformin_parse_args, recfor_init, recfor_add, kept_dump, kept_free,
+      recfor_merge, recfor_serialize, recfor_deserialize, kept_memory,
+      NULL, NULL, NULL, NULL},
+    {"records", "recs", sizeof(struct kept_list),
+      kept_record_parse_args, kept_list_init, records_add, kept_list_dump, kept_list_free,
+      kept_list_merge, kept_list_serialize, kept_list_deserialize, kept_list_memory,
+      NULL, NULL, NULL, NULL,
+      true},
+    {"stddev", "stddev", sizeof(struct moments),
+      stddev_parse_args, moments_init, stddev_add, stddev_dump, NULL,
+      moments_merge, NULL, NULL, NULL,
+      moments_remove, NULL, stddev_share, NULL},
     {"sum", "sum", sizeof(struct sum_data),
-      sum_parse_args, sum_init, sum_add, sum_dump, NULL},
+      sum_parse_args, sum_init, sum_add, sum_dump, NULL,
+      sum_merge, NULL, NULL, NULL,
+      sum_remove, NULL, NULL, sum_add_batch},
+    {"tdigest", "td", sizeof(struct tdigest),
+      td_parse_args, td_init, td_add, td_dump, td_free,
+      td_merge, td_serialize, td_deserialize, td_memory,
+      NULL, NULL, NULL, NULL},
+    {"uarray", "uarray", sizeof(struct strset),
+      strs_parse_args, uniq_init, uniq_add, uarray_dump, uniq_free,
+      uniq_merge, uniq_serialize, uniq_deserialize, uniq_memory,
+      NULL, NULL, NULL, NULL,
+      false, true},
+    {"uconcatenate", "uconcat", sizeof(struct strset),
+      uconcat_parse_args, uniq_init, uniq_add, uconcat_dump, uniq_free,
+      uniq_merge, uniq_serialize, uniq_deserialize, uniq_memory,
+      NULL, NULL, NULL, NULL,
+      false, true},
+    {"valuestokeys", "vk", sizeof(struct vk_data),
+      vk_parse_args, vk_init, vk_add, vk_dump, vk_free,
+      vk_merge, vk_serialize, vk_deserialize, vk_memory,
+      NULL, NULL, NULL, NULL,
+      true, true},
     {"variance", "var", sizeof(struct var_data),
-      var_parse_args, var_init, var_add, var_dump, NULL},
-    {NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL}
+      var_parse_args, var_init, var_add, var_dump, NULL,
+      var_merge, NULL, NULL, NULL,
+      var_remove, NULL, NULL, var_add_batch},
+    {NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
 };
 
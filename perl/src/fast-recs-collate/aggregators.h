@@ -1,6 +1,8 @@
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 struct aggregator
 {
@@ -10,12 +12,83 @@ struct aggregator
     bool (*parse_args_func)(void **config_data, char*, int*, char**);
     void (*init_func)(void *config_data, void*clump_data);
     void (*add_func)(void *config_data, void *clump_data, char *ch_data[], double num_data[]);
-    void (*dump_func)(void *config_data, void *clump_data);
+    void (*dump_func)(void *config_data, void *clump_data, FILE *out);
     void (*free_func)(void *config_data, void *clump_data);
+
+    /* fold other_clump_data into clump_data, as if clump_data had also seen
+     * every value that other_clump_data saw (after the ones it's seen) */
+    void (*merge_func)(void *config_data, void *clump_data, void *other_clump_data);
+
+    /* write clump data out to a file, and read it back into uninitialized
+     * clump data (returning false if the file ends too soon; what's been
+     * read so far can still be freed).  NULL means the clump data is plain
+     * old data that can be copied byte for byte. */
+    void (*serialize_func)(void *config_data, void *clump_data, FILE *out);
+    bool (*deserialize_func)(void *config_data, void *clump_data, FILE *in);
+
+    /* how many bytes of memory the clump data points to, not counting the
+     * data_size bytes of the clump data itself.  NULL means none. */
+    size_t (*memory_func)(void *config_data, void *clump_data);
+
+    /* --window: take back the oldest add that hasn't been taken back yet.
+     * ch_data and num_data are the values that were passed to that add. */
+    void (*remove_func)(void *config_data, void *clump_data, char *ch_data[], double num_data[]);
+
+    /* --window: init clump data that will never hold more than window_size
+     * values at once (since remove_func takes them back).  NULL means
+     * init_func will do. */
+    void (*window_init_func)(void *config_data, void *clump_data, int window_size);
+
+    /* let this instance read an earlier instance's clump data (on the same
+     * input fields) instead of keeping its own.  returns true if it will:
+     * then it gets no clump data of its own, none of its functions but
+     * dump_func are called, and that gets the other instance's clump data.
+     * NULL means it never shares. */
+    bool (*share_func)(void *config_data, struct aggregator *other, void *other_config_data);
+
+    /* add n records' values at once, as if add_func had been called for each
+     * of them in turn.  num_data[j][k] is field j of record k (NAN if it's
+     * missing or isn't a number, as for add_func); there's no ch_data.  it
+     * mustn't change what memory_func returns.  NULL means add_func gets
+     * called for every record. */
+    void (*add_batch_func)(void *config_data, void *clump_data, int n, double *num_data[]);
+
+    /* true if what it dumps depends on the order its values came in, in a
+     * way that merging clumps (which puts all of one clump's values before
+     * the other's) can't get right, like concatenating them.  then --perfect
+     * doesn't build groupings by merging clumps at the end. */
+    bool order_sensitive;
+
+    /* true if it wants values that are true, false, null, an object or an
+     * array, as their JSON text (it must set records_wanted, since that's
+     * the only time they're read).  other aggregators see them as missing. */
+    bool wants_literals;
 };
 
 extern struct aggregator aggregators[];
 
+/*
+ * The JSON text of the record that's being added, from its '{' to its '}',
+ * for the aggregators that keep whole records (or values as they were
+ * written).  It's only there while add_func is running, and only if one of
+ * them set records_wanted when its args were parsed (which rules out
+ * --batch, since that adds records after they're gone).  The record's values
+ * have been NUL-terminated in place: the bytes at cuts[i] were really
+ * cut_chars[i].
+ */
+struct raw_record
+{
+    uint64_t number;            /* how many records came before it */
+    char *text;
+    int len;
+    int num_cuts;
+    int *cuts;
+    char *cut_chars;
+};
+
+extern struct raw_record current_record;
+extern bool records_wanted;
+
 #define RESIZE_ARRAY_IF_NECESSARY(ptr, size, desired_size) \
     if(size < desired_size) \
     { \
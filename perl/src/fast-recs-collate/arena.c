@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+void arena_init(struct arena *arena)
+{
+    arena->chunk = NULL;
+    arena->chunk_left = 0;
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+}
+
+static inline int arena_class(size_t size)
+{
+    if(size <= (1 << ARENA_MIN_SHIFT))
+        return 0;
+    return (64 - __builtin_clzll(size - 1)) - ARENA_MIN_SHIFT;
+}
+
+/* how many bytes a block of size bytes really takes up */
+size_t arena_block_size(size_t size)
+{
+    if(size > (1 << ARENA_MAX_SHIFT))
+        return size;
+    return (size_t)1 << (arena_class(size) + ARENA_MIN_SHIFT);
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    if(size > (1 << ARENA_MAX_SHIFT))
+        return malloc(size);
+
+    int class = arena_class(size);
+    void *block = arena->free_lists[class];
+    if(block)
+    {
+        arena->free_lists[class] = *(void**)block;
+        return block;
+    }
+
+    /* the rest of a chunk that's too small for this block is wasted, but
+     * that's never more than 1 << ARENA_MAX_SHIFT out of ARENA_CHUNK_SIZE */
+    size_t block_size = (size_t)1 << (class + ARENA_MIN_SHIFT);
+    if(arena->chunk_left < block_size)
+    {
+        arena->chunk = malloc(ARENA_CHUNK_SIZE);
+        arena->chunk_left = ARENA_CHUNK_SIZE;
+    }
+    block = arena->chunk;
+    arena->chunk += block_size;
+    arena->chunk_left -= block_size;
+    return block;
+}
+
+void *arena_realloc(struct arena *arena, void *block, size_t old_size, size_t size)
+{
+    if(block == NULL)
+        return arena_alloc(arena, size);
+    if(old_size > (1 << ARENA_MAX_SHIFT) && size > (1 << ARENA_MAX_SHIFT))
+        return realloc(block, size);
+    if(arena_block_size(old_size) == arena_block_size(size))
+        return block;
+
+    void *new_block = arena_alloc(arena, size);
+    memcpy(new_block, block, old_size < size ? old_size : size);
+    arena_free(arena, block, old_size);
+    return new_block;
+}
+
+void arena_free(struct arena *arena, void *block, size_t size)
+{
+    if(size > (1 << ARENA_MAX_SHIFT))
+    {
+        free(block);
+        return;
+    }
+
+    int class = arena_class(size);
+    *(void**)block = arena->free_lists[class];
+    arena->free_lists[class] = block;
+}
@@ -0,0 +1,29 @@
+#include <stddef.h>
+
+#define ARENA_MIN_SHIFT 4
+#define ARENA_MAX_SHIFT 16
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+/*
+ * An arena for the variable-size blocks that aggregators keep per clump, like
+ * copies of whole records.  Blocks come in power of two sizes carved out of
+ * big chunks, and a freed block goes on the free list for its size to be
+ * handed out again, so clumps that come and go (with eviction, or replacing
+ * the record they keep) don't pay for a malloc and free each time or scatter
+ * small blocks all over the heap.  Blocks bigger than 1 << ARENA_MAX_SHIFT
+ * bytes are malloc'd on their own.
+ *
+ * The caller has to remember how big each block it asked for was.
+ */
+struct arena
+{
+    char *chunk;                /* what's left of the chunk being carved up */
+    size_t chunk_left;
+    void *free_lists[ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1];
+};
+
+void arena_init(struct arena *arena);
+size_t arena_block_size(size_t size);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_realloc(struct arena *arena, void *block, size_t old_size, size_t size);
+void arena_free(struct arena *arena, void *block, size_t size);
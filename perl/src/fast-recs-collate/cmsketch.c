@@ -0,0 +1,72 @@
+
+#include <stdlib.h>
+#include "cmsketch.h"
+
+#define CM_MAX_COUNT 15
+
+/* odd multipliers that pick a different column in each row */
+static const uint64_t row_seeds[CM_SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+    0x165667b19e3779f9ULL, 0xff51afd7ed558ccdULL
+};
+
+/*
+ * Size the sketch for tracking the frequencies of about <capacity> keys:
+ * one column per key (rounded up to a power of two), and ten times that
+ * many additions between agings.
+ */
+struct cm_sketch *cm_create(uint64_t capacity)
+{
+    struct cm_sketch *cm = malloc(sizeof(*cm));
+    uint64_t width = 64;
+    while(width < capacity && width < (1ULL << 31))
+        width *= 2;
+
+    cm->width_mask = width - 1;
+    cm->counters = calloc(width * CM_SKETCH_DEPTH, sizeof(*cm->counters));
+    cm->additions = 0;
+    cm->sample_size = capacity * 10 > 1024 ? capacity * 10 : 1024;
+    return cm;
+}
+
+static inline uint8_t *cm_counter(struct cm_sketch *cm, int row, uint32_t hash)
+{
+    uint32_t col = (uint32_t)(((hash + 1) * row_seeds[row]) >> 32) & cm->width_mask;
+    return &cm->counters[(uint64_t)row * (cm->width_mask + 1) + col];
+}
+
+void cm_add(struct cm_sketch *cm, uint32_t hash)
+{
+    for(int row = 0; row < CM_SKETCH_DEPTH; row++)
+    {
+        uint8_t *counter = cm_counter(cm, row, hash);
+        if(*counter < CM_MAX_COUNT)
+            (*counter)++;
+    }
+
+    if(++cm->additions == cm->sample_size)
+    {
+        uint64_t len = (uint64_t)(cm->width_mask + 1) * CM_SKETCH_DEPTH;
+        for(uint64_t i = 0; i < len; i++)
+            cm->counters[i] >>= 1;
+        cm->additions /= 2;
+    }
+}
+
+int cm_estimate(struct cm_sketch *cm, uint32_t hash)
+{
+    int min = CM_MAX_COUNT;
+    for(int row = 0; row < CM_SKETCH_DEPTH; row++)
+    {
+        uint8_t counter = *cm_counter(cm, row, hash);
+        if(counter < min)
+            min = counter;
+    }
+    return min;
+}
+
+void cm_free(struct cm_sketch *cm)
+{
+    free(cm->counters);
+    free(cm);
+}
@@ -0,0 +1,22 @@
+
+#include <stdint.h>
+
+#define CM_SKETCH_DEPTH 4
+
+/*
+ * A count-min sketch of small (4-bit) counters, for estimating how often
+ * we've seen a key.  Every sample_size additions all the counters are halved,
+ * so that the estimates favour recent history.
+ */
+struct cm_sketch
+{
+    uint32_t width_mask;
+    uint8_t *counters;          /* CM_SKETCH_DEPTH rows of width_mask+1 */
+    uint64_t additions;
+    uint64_t sample_size;
+};
+
+struct cm_sketch *cm_create(uint64_t capacity);
+void cm_add(struct cm_sketch *cm, uint32_t hash);
+int cm_estimate(struct cm_sketch *cm, uint32_t hash);
+void cm_free(struct cm_sketch *cm);
@@ -324,6 +324,63 @@ hash_t *hash_create(hashcount_t maxcount, hash_comp_t compfun,
     return NULL;
 }
 
+/*
+ * Grow a dynamic table in one step so that it can hold the given number of
+ * nodes at a load factor of about one.  This is for clients that know (or
+ * can guess) how big the table is going to get, and would rather not pay for
+ * the string of doublings that grow_table() would do on the way there.
+ * Notes:
+ * 1.  Static tables never change size, and we never shrink a table here.
+ * 2.  Work out the smallest power of two that is at least the requested
+ *     count, stopping short of overflow.
+ * 3.  Every existing chain splits into several chains at once, so the new
+ *     mask exposes more than one extra bit of each hashed key.
+ * 4.  A node in old chain C always lands in a chain whose index is C plus a
+ *     multiple of the old table size.  Those chains are either C itself (which
+ *     we've just emptied) or chains in the new upper part of the table, so we
+ *     never disturb a chain that we still have to visit.
+ */
+
+void hash_presize(hash_t *hash, hashcount_t count)
+{
+    hnode_t **newtable;
+    hashcount_t newsize = hash->nchains;
+    hash_val_t chain;
+
+    if (!hash->dynamic || count <= hash->nchains)	/* 1 */
+	return;
+
+    while (newsize < count && 2 * newsize > newsize)	/* 2 */
+	newsize *= 2;
+
+    newtable = realloc(hash->table, sizeof *newtable * newsize);
+    if (!newtable)
+	return;
+
+    for (chain = hash->nchains; chain < newsize; chain++)
+	newtable[chain] = NULL;
+
+    hash->table = newtable;
+    hash->mask = compute_mask(newsize);		/* 3 */
+
+    for (chain = 0; chain < hash->nchains; chain++) {	/* 4 */
+	hnode_t *hptr = newtable[chain], *next;
+	newtable[chain] = NULL;
+
+	for (; hptr != 0; hptr = next) {
+	    hash_val_t newchain = hptr->hkey & hash->mask;
+	    next = hptr->next;
+	    hptr->next = newtable[newchain];
+	    newtable[newchain] = hptr;
+	}
+    }
+
+    hash->lowmark *= newsize / hash->nchains;
+    hash->highmark *= newsize / hash->nchains;
+    hash->nchains = newsize;
+    assert (hash_verify(hash));
+}
+
 /*
  * Select a different set of node allocator routines.
  */
@@ -518,17 +575,28 @@ hnode_t *hash_scan_next(hscan_t *scan)
 
 void hash_insert(hash_t *hash, hnode_t *node, const void *key)
 {
-    hash_val_t hkey, chain;
+    hash_insert_hkey(hash, node, key, hash->function(key));
+}
+
+/*
+ * Like hash_insert, for clients that have already hashed the key with the
+ * table's hashing function.
+ */
+
+void hash_insert_hkey(hash_t *hash, hnode_t *node, const void *key,
+	hash_val_t hkey)
+{
+    hash_val_t chain;
 
     assert (hash_val_t_bit != 0);
     assert (node->next == NULL);
     assert (hash->nodecount < hash->maxcount);	/* 1 */
     assert (hash_lookup(hash, key) == NULL);	/* 2 */
+    assert (hkey == hash->function(key));
 
     if (hash->dynamic && hash->nodecount >= hash->highmark)	/* 3 */
 	grow_table(hash);
 
-    hkey = hash->function(key);
     chain = hkey & hash->mask;	/* 4 */
 
     node->key = key;
@@ -556,10 +624,21 @@ void hash_insert(hash_t *hash, hnode_t *node, const void *key)
 
 hnode_t *hash_lookup(hash_t *hash, const void *key)
 {
-    hash_val_t hkey, chain;
+    return hash_lookup_hkey(hash, key, hash->function(key));	/* 1 */
+}
+
+/*
+ * Like hash_lookup, for clients that have already hashed the key with the
+ * table's hashing function (for example, so that they could prefetch the
+ * chain with hash_chain_head() while they did something else).
+ */
+
+hnode_t *hash_lookup_hkey(hash_t *hash, const void *key, hash_val_t hkey)
+{
+    hash_val_t chain;
     hnode_t *nptr;
 
-    hkey = hash->function(key);		/* 1 */
+    assert (hkey == hash->function(key));
     chain = hkey & hash->mask;		/* 2 */
 
     for (nptr = hash->table[chain]; nptr; nptr = nptr->next) {	/* 3 */
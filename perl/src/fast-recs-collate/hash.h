@@ -187,6 +187,7 @@ typedef struct hscan_t {
 } hscan_t;
 
 extern hash_t *hash_create(hashcount_t, hash_comp_t, hash_fun_t);
+extern void hash_presize(hash_t *, hashcount_t);
 extern void hash_set_allocator(hash_t *, hnode_alloc_t, hnode_free_t, void *);
 extern void hash_destroy(hash_t *);
 extern void hash_free_nodes(hash_t *);
@@ -194,7 +195,9 @@ extern void hash_free(hash_t *);
 extern hash_t *hash_init(hash_t *, hashcount_t, hash_comp_t,
 	hash_fun_t, hnode_t **, hashcount_t);
 extern void hash_insert(hash_t *, hnode_t *, const void *);
+extern void hash_insert_hkey(hash_t *, hnode_t *, const void *, hash_val_t);
 extern hnode_t *hash_lookup(hash_t *, const void *);
+extern hnode_t *hash_lookup_hkey(hash_t *, const void *, hash_val_t);
 extern hnode_t *hash_delete(hash_t *, hnode_t *);
 extern int hash_alloc_insert(hash_t *, const void *, void *);
 extern void hash_delete_free(hash_t *, hnode_t *);
@@ -231,6 +234,7 @@ extern void hnode_destroy(hnode_t *);
 #define hnode_get(N) ((N)->hash_data)
 #define hnode_getkey(N) ((N)->hash_key)
 #define hnode_put(N, V) ((N)->hash_data = (V))
+#define hash_chain_head(H, HK) ((H)->hash_table[(HK) & (H)->hash_mask])
 #endif
 
 #ifdef __cplusplus
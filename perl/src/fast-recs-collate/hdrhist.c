@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "hdrhist.h"
+
+#define HDRHIST_INITIAL_SIZE 64
+
+/*
+ * The counts go in buckets of sub_bucket_count sub-buckets each, where every
+ * bucket after the first covers twice the range of the one before at half
+ * the resolution.  Since the bottom half of each bucket overlaps the one
+ * before it, only the top halves are kept (except for the first).
+ */
+void hdrhist_init(struct hdrhist *h, int digits)
+{
+    int64_t largest_single_unit = 2;
+    for(int i = 0; i < digits; i++)
+        largest_single_unit *= 10;
+
+    int sub_bucket_count_magnitude = 0;
+    while(((int64_t)1 << sub_bucket_count_magnitude) < largest_single_unit)
+        sub_bucket_count_magnitude++;
+
+    h->sub_bucket_half_count_magnitude = sub_bucket_count_magnitude - 1;
+    h->counts_len = 0;
+    h->counts_size = HDRHIST_INITIAL_SIZE;
+    h->counts = malloc(sizeof(*h->counts) * h->counts_size);
+    h->total = 0;
+    h->min = INT64_MAX;
+    h->max = 0;
+}
+
+static inline int hdrhist_index(struct hdrhist *h, int64_t value)
+{
+    int half_magnitude = h->sub_bucket_half_count_magnitude;
+    uint64_t sub_bucket_mask = ((uint64_t)1 << (half_magnitude + 1)) - 1;
+    int bucket = (64 - __builtin_clzll((uint64_t)value | sub_bucket_mask)) - (half_magnitude + 1);
+    int sub_bucket = value >> bucket;
+    return ((bucket + 1) << half_magnitude) + (sub_bucket - (1 << half_magnitude));
+}
+
+/* the biggest value that would be counted at index */
+static int64_t hdrhist_value(struct hdrhist *h, int index)
+{
+    int half_magnitude = h->sub_bucket_half_count_magnitude;
+    int bucket = (index >> half_magnitude) - 1;
+    int64_t sub_bucket = (index & ((1 << half_magnitude) - 1)) + (1 << half_magnitude);
+    if(bucket < 0)
+    {
+        sub_bucket -= 1 << half_magnitude;
+        bucket = 0;
+    }
+    return (sub_bucket << bucket) + ((int64_t)1 << bucket) - 1;
+}
+
+static void hdrhist_grow(struct hdrhist *h, int len)
+{
+    if(len <= h->counts_len)
+        return;
+
+    if(len > h->counts_size)
+    {
+        while(h->counts_size < len)
+            h->counts_size *= 2;
+        h->counts = realloc(h->counts, sizeof(*h->counts) * h->counts_size);
+    }
+    memset(h->counts + h->counts_len, 0, sizeof(*h->counts) * (len - h->counts_len));
+    h->counts_len = len;
+}
+
+void hdrhist_add(struct hdrhist *h, int64_t value, uint64_t count)
+{
+    if(value < 0)
+        value = 0;
+
+    int index = hdrhist_index(h, value);
+    hdrhist_grow(h, index + 1);
+    h->counts[index] += count;
+    h->total += count;
+    if(value < h->min) h->min = value;
+    if(value > h->max) h->max = value;
+}
+
+void hdrhist_merge(struct hdrhist *h, struct hdrhist *other)
+{
+    hdrhist_grow(h, other->counts_len);
+    for(int i = 0; i < other->counts_len; i++)
+        h->counts[i] += other->counts[i];
+
+    h->total += other->total;
+    if(other->min < h->min) h->min = other->min;
+    if(other->max > h->max) h->max = other->max;
+}
+
+/*
+ * The value that's floor(q * total)th in order, as the top of its bucket
+ * (but no more than the max), like HdrHistogram does.
+ */
+double hdrhist_quantile(struct hdrhist *h, double q)
+{
+    if(h->total == 0)
+        return NAN;
+
+    uint64_t target = floor(q * h->total);
+    if(target >= h->total)
+        target = h->total - 1;
+
+    uint64_t seen = 0;
+    int i;
+    for(i = 0; i < h->counts_len - 1; i++)
+    {
+        seen += h->counts[i];
+        if(seen > target)
+            break;
+    }
+
+    int64_t value = hdrhist_value(h, i);
+    if(value > h->max) value = h->max;
+    if(value < h->min) value = h->min;
+    return value;
+}
+
+size_t hdrhist_memory(struct hdrhist *h)
+{
+    return sizeof(*h->counts) * h->counts_size;
+}
+
+/* spill files are private to this process, so byte order doesn't matter */
+void hdrhist_write(struct hdrhist *h, FILE *out)
+{
+    fwrite(&h->counts_len, sizeof(h->counts_len), 1, out);
+    fwrite(h->counts, sizeof(*h->counts), h->counts_len, out);
+    fwrite(&h->total, sizeof(h->total), 1, out);
+    fwrite(&h->min, sizeof(h->min), 1, out);
+    fwrite(&h->max, sizeof(h->max), 1, out);
+}
+
+/* into an h that's been through hdrhist_init; false if in ends too soon */
+bool hdrhist_read(struct hdrhist *h, FILE *in)
+{
+    int len = 0;
+    if(fread(&len, sizeof(len), 1, in) != 1 || len < 0)
+        return false;
+
+    hdrhist_grow(h, len);
+    return fread(h->counts, sizeof(*h->counts), len, in) == (size_t)len &&
+           fread(&h->total, sizeof(h->total), 1, in) == 1 &&
+           fread(&h->min, sizeof(h->min), 1, in) == 1 &&
+           fread(&h->max, sizeof(h->max), 1, in) == 1;
+}
+
+void hdrhist_free(struct hdrhist *h)
+{
+    free(h->counts);
+}
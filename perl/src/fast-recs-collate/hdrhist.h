@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * An HDR histogram (after Gil Tene's HdrHistogram) of non-negative integer
+ * values, like latencies in microseconds.  Values are counted in buckets
+ * that are exact up to 2 * 10 ** digits, and after that never wider than
+ * 1 / 10 ** digits of the values in them, so any quantile is within that
+ * relative error.  The counts only go up to the bucket of the biggest value
+ * seen: between 10 ** digits and 2 * 10 ** digits of them for each power of
+ * two.
+ */
+struct hdrhist
+{
+    int sub_bucket_half_count_magnitude;
+    int counts_len;
+    int counts_size;
+    uint64_t *counts;
+    uint64_t total;
+    int64_t min, max;
+};
+
+void hdrhist_init(struct hdrhist *h, int digits);
+void hdrhist_add(struct hdrhist *h, int64_t value, uint64_t count);
+void hdrhist_merge(struct hdrhist *h, struct hdrhist *other);
+double hdrhist_quantile(struct hdrhist *h, double q);
+size_t hdrhist_memory(struct hdrhist *h);
+void hdrhist_write(struct hdrhist *h, FILE *out);
+bool hdrhist_read(struct hdrhist *h, FILE *in);
+void hdrhist_free(struct hdrhist *h);
@@ -0,0 +1,283 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include "hll.h"
+#include "lookup3.h"
+
+#define HLL_SPARSE_INITIAL_SIZE 4
+
+/* one that starts out with all its registers, for lots of values */
+struct hll *hll_create(int precision)
+{
+    struct hll *hll = malloc(sizeof(*hll));
+    hll_init(hll, precision);
+    hll->registers = calloc(1 << precision, sizeof(*hll->registers));
+    return hll;
+}
+
+/* one that starts out sparse, for when there may be lots of them */
+void hll_init(struct hll *hll, int precision)
+{
+    hll->precision = precision;
+    hll->registers = NULL;
+    hll->sparse_len = hll->sparse_size = 0;
+    hll->sparse = NULL;
+}
+
+/* the longest run of leading zeros (plus one) after the top precision bits */
+static inline uint8_t hll_rank(uint64_t hash, int precision)
+{
+    uint64_t rest = (hash << precision) | (1ULL << (precision - 1));
+    return __builtin_clzll(rest) + 1;
+}
+
+static inline void hll_set_register(struct hll *hll, int reg, uint8_t rank)
+{
+    if(rank > hll->registers[reg])
+        hll->registers[reg] = rank;
+}
+
+/*
+ * A sparse entry's register is the top HLL_SPARSE_PRECISION bits of the
+ * hash, so its top precision bits are the dense register, and unless the
+ * bits between are all zero, they have the dense rank.
+ */
+static void hll_set_sparse_register(struct hll *hll, uint32_t entry)
+{
+    int extra = HLL_SPARSE_PRECISION - hll->precision;
+    uint32_t sparse_reg = entry >> 6;
+    uint32_t between = sparse_reg & ((1u << extra) - 1);
+    uint8_t rank = entry & 63;
+    if(between)
+        rank = extra - (32 - __builtin_clz(between)) + 1;
+    else
+        rank += extra;
+    hll_set_register(hll, sparse_reg >> extra, rank);
+}
+
+static void hll_densify(struct hll *hll)
+{
+    hll->registers = calloc(1 << hll->precision, sizeof(*hll->registers));
+    for(int i = 0; i < hll->sparse_len; i++)
+        hll_set_sparse_register(hll, hll->sparse[i]);
+
+    free(hll->sparse);
+    hll->sparse = NULL;
+    hll->sparse_len = hll->sparse_size = 0;
+}
+
+static inline bool hll_sparse_too_big(struct hll *hll, int len)
+{
+    return len * sizeof(*hll->sparse) > (1u << hll->precision) * sizeof(*hll->registers);
+}
+
+static void hll_sparse_insert(struct hll *hll, uint32_t entry)
+{
+    uint32_t reg = entry >> 6;
+    int lo = 0, hi = hll->sparse_len;
+    while(lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if((hll->sparse[mid] >> 6) < reg) lo = mid + 1;
+        else hi = mid;
+    }
+
+    /* same register: the entry with the bigger rank is bigger */
+    if(lo < hll->sparse_len && (hll->sparse[lo] >> 6) == reg)
+    {
+        if(entry > hll->sparse[lo])
+            hll->sparse[lo] = entry;
+        return;
+    }
+
+    if(hll_sparse_too_big(hll, hll->sparse_len + 1))
+    {
+        hll_densify(hll);
+        hll_set_sparse_register(hll, entry);
+        return;
+    }
+
+    if(hll->sparse_len == hll->sparse_size)
+    {
+        hll->sparse_size = hll->sparse_size ? hll->sparse_size * 2 : HLL_SPARSE_INITIAL_SIZE;
+        hll->sparse = realloc(hll->sparse, sizeof(*hll->sparse) * hll->sparse_size);
+    }
+    memmove(hll->sparse + lo + 1, hll->sparse + lo, sizeof(*hll->sparse) * (hll->sparse_len - lo));
+    hll->sparse[lo] = entry;
+    hll->sparse_len++;
+}
+
+/*
+ * The top <precision> bits of the hash pick a register, and the register
+ * remembers the longest run of leading zeros (plus one) that we've seen in
+ * the rest of the hash.
+ */
+void hll_add_hash(struct hll *hll, uint64_t hash)
+{
+    if(hll->registers)
+        hll_set_register(hll, hash >> (64 - hll->precision), hll_rank(hash, hll->precision));
+    else
+        hll_sparse_insert(hll, (uint32_t)(hash >> (64 - HLL_SPARSE_PRECISION)) << 6 |
+                               hll_rank(hash, HLL_SPARSE_PRECISION));
+}
+
+/* as if hll had seen every hash that other has (at the same precision) */
+void hll_merge(struct hll *hll, struct hll *other)
+{
+    if(!hll->registers && !other->registers)
+    {
+        int len = 0, size = hll->sparse_len + other->sparse_len;
+        uint32_t *sparse = malloc(sizeof(*sparse) * (size ? size : 1));
+        int i = 0, j = 0;
+        while(i < hll->sparse_len || j < other->sparse_len)
+        {
+            uint32_t a = i < hll->sparse_len ? hll->sparse[i] : UINT32_MAX;
+            uint32_t b = j < other->sparse_len ? other->sparse[j] : UINT32_MAX;
+            if((a >> 6) == (b >> 6))
+            {
+                sparse[len++] = a > b ? a : b;
+                i++;
+                j++;
+            }
+            else if((a >> 6) < (b >> 6))
+            {
+                sparse[len++] = a;
+                i++;
+            }
+            else
+            {
+                sparse[len++] = b;
+                j++;
+            }
+        }
+
+        free(hll->sparse);
+        hll->sparse = sparse;
+        hll->sparse_len = len;
+        hll->sparse_size = size ? size : 1;
+        if(hll_sparse_too_big(hll, len))
+            hll_densify(hll);
+        return;
+    }
+
+    if(!hll->registers)
+        hll_densify(hll);
+
+    if(other->registers)
+    {
+        for(int i = 0; i < 1 << hll->precision; i++)
+            hll_set_register(hll, i, other->registers[i]);
+    }
+    else
+    {
+        for(int i = 0; i < other->sparse_len; i++)
+            hll_set_sparse_register(hll, other->sparse[i]);
+    }
+}
+
+double hll_estimate(struct hll *hll)
+{
+    /* sparse, there are so many registers that linear counting is good
+     * for as many values as it can hold */
+    if(!hll->registers)
+    {
+        double sparse_m = 1 << HLL_SPARSE_PRECISION;
+        return sparse_m * log(sparse_m / (sparse_m - hll->sparse_len));
+    }
+
+    int m = 1 << hll->precision;
+    double alpha;
+    switch(m)
+    {
+        case 16: alpha = 0.673; break;
+        case 32: alpha = 0.697; break;
+        case 64: alpha = 0.709; break;
+        default: alpha = 0.7213 / (1 + 1.079 / m); break;
+    }
+
+    double sum = 0;
+    int zeros = 0;
+    for(int i = 0; i < m; i++)
+    {
+        sum += ldexp(1, -hll->registers[i]);
+        if(hll->registers[i] == 0)
+            zeros++;
+    }
+
+    double estimate = alpha * m * m / sum;
+
+    /* the raw estimate is badly biased for small cardinalities, where
+     * linear counting over the empty registers does much better.  with
+     * 64-bit hashes there is no need for a large-range correction. */
+    if(estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log((double)m / zeros);
+
+    return estimate;
+}
+
+size_t hll_memory(struct hll *hll)
+{
+    if(hll->registers)
+        return (1 << hll->precision) * sizeof(*hll->registers);
+    return hll->sparse_size * sizeof(*hll->sparse);
+}
+
+/* spill files are private to this process, so byte order doesn't matter */
+void hll_write(struct hll *hll, FILE *out)
+{
+    int sparse_len = hll->registers ? -1 : hll->sparse_len;
+    fwrite(&sparse_len, sizeof(sparse_len), 1, out);
+    if(hll->registers)
+        fwrite(hll->registers, sizeof(*hll->registers), 1 << hll->precision, out);
+    else
+        fwrite(hll->sparse, sizeof(*hll->sparse), hll->sparse_len, out);
+}
+
+/* into an hll that's been through hll_init; false if in ends too soon */
+bool hll_read(struct hll *hll, FILE *in)
+{
+    int sparse_len = 0;
+    if(fread(&sparse_len, sizeof(sparse_len), 1, in) != 1)
+        return false;
+
+    if(sparse_len < 0)
+    {
+        hll->registers = calloc(1 << hll->precision, sizeof(*hll->registers));
+        return fread(hll->registers, sizeof(*hll->registers), 1 << hll->precision, in) ==
+               (size_t)1 << hll->precision;
+    }
+    else if(sparse_len > 0)
+    {
+        hll->sparse = malloc(sizeof(*hll->sparse) * sparse_len);
+        hll->sparse_size = sparse_len;
+        hll->sparse_len = fread(hll->sparse, sizeof(*hll->sparse), sparse_len, in);
+        return hll->sparse_len == sparse_len;
+    }
+    return true;
+}
+
+/* free what an hll points to, but not the hll itself */
+void hll_release(struct hll *hll)
+{
+    free(hll->registers);
+    free(hll->sparse);
+}
+
+void hll_free(struct hll *hll)
+{
+    hll_release(hll);
+    free(hll);
+}
+
+/*
+ * lookup3 only gives us 32 bits at a time, so run it twice with different
+ * seeds to get a hash wide enough that HyperLogLog doesn't saturate.
+ */
+uint64_t hash64(const void *key, size_t length, uint64_t seed)
+{
+    uint32_t hi = hashlittle(key, length, (uint32_t)seed);
+    uint32_t lo = hashlittle(key, length, (uint32_t)(seed >> 32) ^ 0x9e3779b9);
+    return ((uint64_t)hi << 32) | lo;
+}
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define HLL_SPARSE_PRECISION 25
+
+/*
+ * A HyperLogLog cardinality estimator.  It keeps 2 ** precision one-byte
+ * registers, and so has a standard error of about 1.04 / sqrt(2 ** precision).
+ *
+ * One made with hll_init starts out sparse, like HyperLogLog++: a sorted list
+ * of the registers that aren't zero, at HLL_SPARSE_PRECISION, which is both
+ * smaller and more accurate while there are only a few of them.  It switches
+ * to the registers once the list would take up more room than they do.
+ */
+struct hll
+{
+    int precision;
+    uint8_t *registers;         /* NULL while it's sparse */
+    int sparse_len, sparse_size;
+    uint32_t *sparse;           /* register << 6 | rank, sorted by register */
+};
+
+struct hll *hll_create(int precision);
+void hll_init(struct hll *hll, int precision);
+void hll_add_hash(struct hll *hll, uint64_t hash);
+void hll_merge(struct hll *hll, struct hll *other);
+double hll_estimate(struct hll *hll);
+size_t hll_memory(struct hll *hll);
+void hll_write(struct hll *hll, FILE *out);
+bool hll_read(struct hll *hll, FILE *in);
+void hll_release(struct hll *hll);
+void hll_free(struct hll *hll);
+
+uint64_t hash64(const void *key, size_t length, uint64_t seed);
@@ -0,0 +1,324 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "kll.h"
+
+#define KLL_MIN_WIDTH 8         /* no level holds fewer values than this */
+#define KLL_INITIAL_SIZE 16
+
+struct kll_item
+{
+    double value;
+    uint64_t weight;
+};
+
+static int cmp_dbl(const void *s1, const void *s2)
+{
+    double d1 = *(double*)s1;
+    double d2 = *(double*)s2;
+    if(d1 < d2) return -1;
+    else if(d1 > d2) return 1;
+    else return 0;
+}
+
+static int cmp_item(const void *s1, const void *s2)
+{
+    return cmp_dbl(&((struct kll_item*)s1)->value, &((struct kll_item*)s2)->value);
+}
+
+static inline int kll_level_len(struct kll_sketch *kll, int level)
+{
+    return kll->levels[level+1] - kll->levels[level];
+}
+
+static int kll_capacity(struct kll_sketch *kll, int level)
+{
+    double capacity = kll->k;
+    for(int depth = kll->num_levels - 1 - level; depth > 0; depth--)
+        capacity *= 2.0 / 3;
+    return capacity < KLL_MIN_WIDTH ? KLL_MIN_WIDTH : (int)ceil(capacity);
+}
+
+static int kll_total_capacity(struct kll_sketch *kll)
+{
+    int total = 0;
+    for(int level = 0; level < kll->num_levels; level++)
+        total += kll_capacity(kll, level);
+    return total;
+}
+
+void kll_sketch_init(struct kll_sketch *kll, int k)
+{
+    kll->k = k;
+    kll->num_levels = 1;
+    kll->items_size = KLL_INITIAL_SIZE < k ? KLL_INITIAL_SIZE : k;
+    kll->items = malloc(sizeof(*kll->items) * kll->items_size);
+    kll->levels[0] = kll->levels[1] = kll->items_size;
+    kll->n = 0;
+    kll->random = 0x9e3779b9;
+}
+
+/* move the items to the end of a new array of size values */
+static void kll_resize(struct kll_sketch *kll, int size)
+{
+    int len = kll->levels[kll->num_levels] - kll->levels[0];
+    double *items = malloc(sizeof(*items) * size);
+    memcpy(items + size - len, kll->items + kll->levels[0], sizeof(*items) * len);
+
+    int shift = size - kll->levels[kll->num_levels];
+    for(int level = 0; level <= kll->num_levels; level++)
+        kll->levels[level] += shift;
+
+    free(kll->items);
+    kll->items = items;
+    kll->items_size = size;
+}
+
+/*
+ * Sort level (if it's level 0: the others are always sorted), and merge
+ * every other value of it into the level above.  If it has an odd number of
+ * values, the smallest one stays behind.  The levels below slide up into the
+ * space that frees.
+ */
+static void kll_compact(struct kll_sketch *kll, int level)
+{
+    int *levels = kll->levels;
+    double *items = kll->items;
+    int start = levels[level], end = levels[level+1], above_end = levels[level+2];
+    int len = end - start, above_len = above_end - end;
+
+    if(level == 0)
+        qsort(items + start, len, sizeof(*items), cmp_dbl);
+
+    int odd = len & 1;
+    double kept = items[start];
+
+    kll->random ^= kll->random << 13;
+    kll->random ^= kll->random >> 17;
+    kll->random ^= kll->random << 5;
+    int from = start + odd + (kll->random & 1);
+
+    int promoted = len / 2;
+    double *merged = malloc(sizeof(*merged) * (promoted + above_len));
+    int i = 0, j = end, out = 0;
+    while(i < promoted || j < above_end)
+    {
+        if(j == above_end || (i < promoted && items[from + 2*i] <= items[j]))
+            merged[out++] = items[from + 2*i++];
+        else
+            merged[out++] = items[j++];
+    }
+
+    int new_end = above_end - out;
+    memcpy(items + new_end, merged, sizeof(*items) * out);
+    free(merged);
+
+    int new_start = new_end - odd;
+    if(odd)
+        items[new_start] = kept;
+
+    int shift = new_start - start;
+    memmove(items + levels[0] + shift, items + levels[0], sizeof(*items) * (start - levels[0]));
+    for(int below = 0; below <= level; below++)
+        levels[below] += shift;
+    levels[level+1] = new_end;
+}
+
+/* compact the lowest level that's full, adding a level on top if need be */
+static void kll_compress(struct kll_sketch *kll)
+{
+    int level = 0;
+    while(level < kll->num_levels - 1 && kll_level_len(kll, level) < kll_capacity(kll, level))
+        level++;
+
+    if(level == kll->num_levels - 1)
+    {
+        if(kll->num_levels == KLL_MAX_LEVELS)
+            return;
+        kll->levels[kll->num_levels + 1] = kll->levels[kll->num_levels];
+        kll->num_levels++;
+    }
+
+    kll_compact(kll, level);
+}
+
+void kll_sketch_add(struct kll_sketch *kll, double value)
+{
+    if(kll->levels[0] == 0)
+    {
+        int capacity = kll_total_capacity(kll);
+        if(kll->items_size < capacity)
+        {
+            int size = kll->items_size * 2 > KLL_INITIAL_SIZE ? kll->items_size * 2 : KLL_INITIAL_SIZE;
+            kll_resize(kll, size < capacity ? size : capacity);
+        }
+        else
+            kll_compress(kll);
+
+        if(kll->levels[0] == 0)
+            kll_resize(kll, kll->items_size + KLL_MIN_WIDTH);
+    }
+
+    kll->items[--kll->levels[0]] = value;
+    kll->n++;
+}
+
+/* put other's values in with ours, level by level, then compact until they fit */
+void kll_sketch_merge(struct kll_sketch *kll, struct kll_sketch *other)
+{
+    while(kll->num_levels < other->num_levels)
+    {
+        kll->levels[kll->num_levels + 1] = kll->levels[kll->num_levels];
+        kll->num_levels++;
+    }
+
+    int len = (kll->levels[kll->num_levels] - kll->levels[0]) +
+              (other->levels[other->num_levels] - other->levels[0]);
+    int size = len > kll->items_size ? len : kll->items_size;
+    double *items = malloc(sizeof(*items) * size);
+
+    /* lay the levels out from the top down */
+    int out = size;
+    for(int level = kll->num_levels - 1; level >= 0; level--)
+    {
+        double *ours = kll->items + kll->levels[level];
+        int ours_len = kll_level_len(kll, level);
+        double *theirs = level < other->num_levels ? other->items + other->levels[level] : NULL;
+        int theirs_len = level < other->num_levels ? kll_level_len(other, level) : 0;
+
+        int level_end = out;
+        out -= ours_len + theirs_len;
+        int i = 0, j = 0, to = out;
+        while(i < ours_len || j < theirs_len)
+        {
+            /* level 0 isn't sorted, so it doesn't matter what order it's in */
+            if(j == theirs_len || (i < ours_len && ours[i] <= theirs[j]))
+                items[to++] = ours[i++];
+            else
+                items[to++] = theirs[j++];
+        }
+
+        kll->levels[level+1] = level_end;
+    }
+    kll->levels[0] = out;
+
+    free(kll->items);
+    kll->items = items;
+    kll->items_size = size;
+    kll->n += other->n;
+
+    while(kll->levels[kll->num_levels] - kll->levels[0] > kll_total_capacity(kll))
+    {
+        int start = kll->levels[0];
+        kll_compress(kll);
+        if(kll->levels[0] == start)
+            break;
+    }
+}
+
+/*
+ * values[i] is the value that's floor(qs[i] * n)th in order, counting each
+ * value's weight.  The sketch's values are only sorted once for all of them.
+ */
+void kll_sketch_quantiles(struct kll_sketch *kll, int num_qs, double *qs, double *values)
+{
+    if(kll->n == 0)
+    {
+        for(int q = 0; q < num_qs; q++)
+            values[q] = NAN;
+        return;
+    }
+
+    int len = kll->levels[kll->num_levels] - kll->levels[0];
+    struct kll_item *sorted = malloc(sizeof(*sorted) * len);
+    int i = 0;
+    for(int level = 0; level < kll->num_levels; level++)
+    {
+        for(int j = kll->levels[level]; j < kll->levels[level+1]; j++)
+        {
+            sorted[i].value = kll->items[j];
+            sorted[i++].weight = (uint64_t)1 << level;
+        }
+    }
+    qsort(sorted, len, sizeof(*sorted), cmp_item);
+
+    for(int q = 0; q < num_qs; q++)
+    {
+        uint64_t target = floor(qs[q] * kll->n);
+        if(target >= kll->n)
+            target = kll->n - 1;
+
+        values[q] = sorted[len-1].value;
+        uint64_t weight = 0;
+        for(i = 0; i < len; i++)
+        {
+            weight += sorted[i].weight;
+            if(weight > target)
+            {
+                values[q] = sorted[i].value;
+                break;
+            }
+        }
+    }
+
+    free(sorted);
+}
+
+size_t kll_sketch_memory(struct kll_sketch *kll)
+{
+    return sizeof(*kll->items) * kll->items_size;
+}
+
+/* spill files are private to this process, so byte order doesn't matter */
+void kll_sketch_write(struct kll_sketch *kll, FILE *out)
+{
+    fwrite(&kll->n, sizeof(kll->n), 1, out);
+    fwrite(&kll->num_levels, sizeof(kll->num_levels), 1, out);
+    for(int level = 0; level < kll->num_levels; level++)
+    {
+        int len = kll_level_len(kll, level);
+        fwrite(&len, sizeof(len), 1, out);
+    }
+    fwrite(kll->items + kll->levels[0], sizeof(*kll->items),
+           kll->levels[kll->num_levels] - kll->levels[0], out);
+}
+
+/* into a kll that's been through kll_sketch_init; false if in ends too soon */
+bool kll_sketch_read(struct kll_sketch *kll, FILE *in)
+{
+    int num_levels = 0;
+    int lens[KLL_MAX_LEVELS];
+    int len = 0;
+    if(fread(&kll->n, sizeof(kll->n), 1, in) != 1 ||
+       fread(&num_levels, sizeof(num_levels), 1, in) != 1 ||
+       num_levels < 1 || num_levels > KLL_MAX_LEVELS ||
+       fread(lens, sizeof(*lens), num_levels, in) != (size_t)num_levels)
+    {
+        kll->n = 0;
+        return false;
+    }
+    for(int level = 0; level < num_levels; level++)
+        len += lens[level];
+
+    free(kll->items);
+    kll->items = malloc(sizeof(*kll->items) * (len > 0 ? len : 1));
+    kll->items_size = len;
+    kll->num_levels = num_levels;
+    kll->levels[0] = 0;
+    for(int level = 0; level < num_levels; level++)
+        kll->levels[level+1] = kll->levels[level] + lens[level];
+
+    if(fread(kll->items, sizeof(*kll->items), len, in) != (size_t)len)
+    {
+        kll->n = 0;
+        for(int level = 0; level < num_levels; level++)
+            kll->levels[level] = len;
+        return false;
+    }
+    return true;
+}
+
+void kll_sketch_free(struct kll_sketch *kll)
+{
+    free(kll->items);
+}
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KLL_MAX_LEVELS 40
+
+/*
+ * A KLL quantile sketch (Karnin, Lang & Liberty).  Values go into a stack of
+ * compactors: when one fills up it's sorted, and every other value (starting
+ * at random from the first or second) is promoted to the next level up, with
+ * twice the weight.  Level h holds about k * (2/3) ** (top - h) values, so
+ * the whole sketch holds under 3k, and the rank error is about 1.65 / k
+ * (with 99% confidence), whatever the quantile.
+ */
+struct kll_sketch
+{
+    int k;
+    int num_levels;
+    int items_size;
+    double *items;              /* level h is items[levels[h]..levels[h+1]],
+                                   with the free space before level 0 */
+    int levels[KLL_MAX_LEVELS + 1];
+    uint64_t n;
+    uint32_t random;
+};
+
+void kll_sketch_init(struct kll_sketch *kll, int k);
+void kll_sketch_add(struct kll_sketch *kll, double value);
+void kll_sketch_merge(struct kll_sketch *kll, struct kll_sketch *other);
+void kll_sketch_quantiles(struct kll_sketch *kll, int num_qs, double *qs, double *values);
+size_t kll_sketch_memory(struct kll_sketch *kll);
+void kll_sketch_write(struct kll_sketch *kll, FILE *out);
+bool kll_sketch_read(struct kll_sketch *kll, FILE *in);
+void kll_sketch_free(struct kll_sketch *kll);
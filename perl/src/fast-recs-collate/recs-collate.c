@@ -4,25 +4,197 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
 #define __USE_XOPEN_EXTENDED
 #include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "interpreter.h"
 #include "lookup3.h"
 #include "hash.h"
+#include "hll.h"
+#include "cmsketch.h"
 #include "aggregators.h"
 #include "json.h"
 
 #define MAX_INFIELDS_PER_AGGREGATOR 2
 #define MAX_CLUMPS_INFINITE -1
+#define MAX_CLUMPS_PER_SLAB 65536
 
+/* how many clumps we keep in the little array before moving to the table */
+#define SMALL_TABLE_SIZE 16
+
+/* the most records for the same clump that wait to be added as a batch */
+#define RUN_SIZE 64
+
+/* default number of entries in the hot clump cache (--hot-cache) */
+#define DEFAULT_HOT_CACHE_SIZE 256
+
+/* with --eviction clock, each eviction frees up 1/CLOCK_EVICT_FRACTION of
+ * the clumps (but at least one and no more than CLOCK_MAX_EVICT_BATCH) */
+#define CLOCK_EVICT_FRACTION 64
+#define CLOCK_MAX_EVICT_BATCH 4096
+
+/* with --eviction tinylfu, the share of --size (in percent) that goes to
+ * the admission window */
+#define TINYLFU_WINDOW_PERCENT 1
+
+/* bits in the per-slot CLOCK metadata */
+#define CLOCK_IN_USE 1
+#define CLOCK_REFERENCED 2
+
+/* for --expected-groups auto: how much input to look at before guessing how
+ * many groups there will be, and how precise a HyperLogLog to guess with */
+#define GROUP_SAMPLE_BYTES (4 << 20)
+#define GROUP_SAMPLE_HLL_PRECISION 12
+
+/* key fields whose type we haven't been told give up on being integers if
+ * none of their values in this many records were */
+#define KEY_TYPE_SAMPLE_RECORDS 1000
+
+/* a clump key's int_mask and grouping have a bit per key field */
+#define MAX_KEY_FIELDS 32
+
+/* --session-gap: the timer wheel has WHEEL_LEVELS levels of WHEEL_SLOTS
+ * slots, and a tick is 1/SESSION_TICKS_PER_GAP of the gap */
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define SESSION_TICKS_PER_GAP 16
+
+/* --memory-limit: how many files we split spilled clumps between (on the top
+ * SPILL_PARTITION_BITS bits of their key hashes).  The merge at the end only
+ * has to hold one file's worth of keys in memory at once, and a file that's
+ * still too big is split again on the next bits down, SPILL_LEVELS deep. */
+#define SPILL_PARTITION_BITS 4
+#define SPILL_PARTITIONS (1 << SPILL_PARTITION_BITS)
+#define SPILL_LEVELS (32 / SPILL_PARTITION_BITS)
+
+/* --max-memory auto: how much of the cgroup's memory limit the clumps get */
+#define CGROUP_MEMORY_PERCENT 75
+
+/* --size auto: every AUTO_SIZE_INTERVAL records, look at what share of the
+ * clumps we created were for keys we'd just evicted.  more than AUTO_SIZE_TARGET_PERCENT
+ * and we grow the clump limit by a quarter; less than a quarter of that and
+ * we shrink it by an eighth (if we're evicting at all).  without a memory cap on the command line or
+ * from our cgroup, the cap is AUTO_SIZE_DEFAULT_MEMORY. */
+#define AUTO_SIZE_INTERVAL 10000
+#define AUTO_SIZE_TARGET_PERCENT 5
+#define AUTO_SIZE_MIN_CREATED 100
+#define AUTO_SIZE_INITIAL 1024
+#define AUTO_SIZE_MIN 64
+#define AUTO_SIZE_DEFAULT_MEMORY (256L << 20)
+#define AUTO_SIZE_MAX_GHOSTS (1 << 20)
+#define AUTO_SIZE_LOG_LEN 16
+
+enum key_type
+{
+    KEY_AUTO,
+    KEY_INT,
+    KEY_STRING
+};
+
+/*
+ * A clump's key: one value per key field.  A value from an integer (or
+ * maybe-integer) key field is stored as an int64 if printing the int64 gives
+ * back exactly the same string, and as a string (NULL if the field was
+ * missing) otherwise.  Since that only depends on the value, equal values
+ * always have the same representation.
+ */
+union key_val
+{
+    int64_t i;
+    char *s;
+};
+
+struct clump_key
+{
+    uint32_t int_mask;          /* bit i is set if vals[i] is an integer */
+    uint32_t grouping;          /* bit i is set if field i is rolled up */
+    union key_val vals[];
+};
+
+/*
+ * A clump is this header, then the aggregator data, then the key, then
+ * whatever the eviction policy needs to keep per clump (nothing at all
+ * for --perfect).
+ */
 struct clump
 {
     hnode_t hash_node;
-    char **key_values;
-    struct clump *next, *prev;  /* for doing LRU eviction */
+    struct clump_key *key;      /* lives at the end of this clump */
     double aggregator_data[];   /* use doubles to get double alignment */
 };
 
+/* records for the same clump, waiting to be added to it (see flush_run) */
+struct clump_run
+{
+    struct clump *clump;
+    int len;
+};
+
+enum eviction_policy
+{
+    EVICT_NONE,                 /* --perfect: we never evict */
+    EVICT_LRU,
+    EVICT_CLOCK,
+    EVICT_TINYLFU
+};
+
+/* EVICT_LRU: a doubly linked list, most recently used first */
+struct lru_links
+{
+    struct clump *next, *prev;
+};
+
+struct lru_list
+{
+    struct clump *head, *tail;
+    long len;
+};
+
+/* EVICT_TINYLFU: which of the two LRU lists the clump is on */
+struct tinylfu_links
+{
+    struct lru_links links;
+    bool in_window;
+};
+
+/* EVICT_CLOCK: the clump's slot in the clock metadata */
+struct clock_slot
+{
+    uint32_t slot;
+};
+
+/* --tumble: a window of time that's still open, and the clumps that have
+ * been created for it (linked through their tumble data), oldest first */
+struct open_window
+{
+    double start;
+    struct clump *head, *tail;
+};
+
+/* --session-gap: when the clump last saw a record, and the next clump in
+ * its timer wheel slot */
+struct session_data
+{
+    double last_time;
+    struct clump *next;
+};
+
+/* --window: the values of the last window_size records added to a clump,
+ * num_interesting_fields of each, oldest first starting at start */
+struct window_ring
+{
+    int start, len;
+    char **vals;
+    double *dbl_vals;
+};
+
 
 struct str_ref
 {
@@ -31,6 +203,47 @@ struct str_ref
     bool is_set;
 };
 
+struct collate_stats
+{
+    uint64_t records;
+    uint64_t clumps_created;
+    uint64_t evictions;
+    uint64_t hot_cache_lookups;
+    uint64_t hot_cache_hits;
+    uint64_t tinylfu_admitted;
+    uint64_t tinylfu_rejected;
+    uint64_t memo_hits;
+    uint64_t windows_closed;
+    uint64_t late_records;
+    uint64_t untimed_records;
+    uint64_t sessions_closed;
+
+    uint64_t spills;
+    uint64_t spilled_clumps;
+    long spilled_bytes;
+
+    uint64_t recreated;         /* clumps whose key was evicted recently */
+    uint64_t size_grows;
+    uint64_t size_shrinks;
+
+    double estimated_groups;    /* 0 if we never made a guess */
+    long sampled_bytes;         /* 0 if the guess came from --expected-groups */
+};
+
+/* --size auto: one change to the clump limit, for the stats */
+struct size_change
+{
+    uint64_t records;
+    int from, to;
+    double recreate_rate;
+};
+
+struct hot_cache_entry
+{
+    uint32_t hkey;
+    struct clump *clump;
+};
+
 struct agg_instance
 {
     struct aggregator *agg;
@@ -38,6 +251,9 @@ struct agg_instance
     int num_input_fields;
     int input_fields[MAX_INFIELDS_PER_AGGREGATOR];
     void *config_data;
+    int shares;         /* the earlier instance whose clump data this one
+                           reads instead of having its own (see share_func),
+                           or -1 */
 };
 
 struct collate_state
@@ -48,77 +264,360 @@ struct collate_state
     int num_agg_instances;
     struct agg_instance *agg_instances;
 
+    /* --cube, --rollup and --grouping-sets: each record goes into cube_max
+     * clumps, one for each grouping (the mask of key fields it rolls up, and
+     * outputs as cube_default).  without them, there's just grouping 0. */
     int cube_max;
+    uint32_t *groupings;
     char *cube_default;
 
+    /* with --perfect, records only go into the finest grouping, the fields
+     * that all of them keep (cube_max is 1), and the num_rollups others are
+     * rolled up from it at the end, finest first.  keep_base is false if
+     * the finest grouping wasn't asked for, and is just thrown away. */
+    int num_rollups;
+    uint32_t *rollups;
+    bool keep_base;
+
     hash_t *clump_table;
 
+    /* until there are more than SMALL_TABLE_SIZE clumps, they live in this
+     * little array instead of clump_table, and we find them by comparing
+     * their cached hashes all at once.  once we outgrow it we move everything
+     * into clump_table and never look back. */
+    bool small_table;
+    int small_len;
+    uint32_t small_hkeys[SMALL_TABLE_SIZE];
+    struct clump *small_clumps[SMALL_TABLE_SIZE];
+
+    /* a direct-mapped cache from key hashes to recently used clumps, which we
+     * check before going to clump_table.  it's small enough to stay in L1, so
+     * on skewed input most records never touch the table.  NULL if disabled. */
+    struct hot_cache_entry *hot_cache;
+    int hot_cache_mask;
+
     int num_interesting_fields;
     int num_key_fields;
     char **interesting_field_names;
 
+    /* how to store each key field (see struct clump_key), and for KEY_AUTO
+     * fields, how many integers we've seen */
+    enum key_type *key_types;
+    uint64_t *key_ints_seen;
+    int key_size;
+    struct clump_key *tmp_key;
+
     int interesting_field;
     struct str_ref *interesting_fields;
     char **tmp_interesting_vals;
     double *tmp_double_vals;
 
+    /* with records_wanted, which of this record's values are true, false,
+     * null, an object or an array: only the aggregators that want_literals
+     * see those */
+    bool *literal_vals;
+    bool any_literals;
+
     int next_clump;
     int total_available_clumps;
+    int agg_data_size;
     int clump_size;
     char *available_clumps;
-    struct clump *clumps_head, *clumps_tail;
+
+    /* evicted clumps whose memory we can reuse, linked through hash_next */
+    struct clump *free_clumps;
+
+    enum eviction_policy eviction_policy;
+    int evict_data_offset;      /* from aggregator_data to the policy's data */
+
+    /* EVICT_LRU uses just the lru list.  EVICT_TINYLFU puts new clumps on
+     * the window list, and only lets them into the lru list (the main
+     * region) if the sketch says they're used more often than the clump
+     * they'd push out. */
+    struct lru_list lru;
+    struct lru_list window;
+    long window_max;
+    struct cm_sketch *sketch;
+
+    /* EVICT_CLOCK: one byte of CLOCK_* bits per slot, kept apart from the
+     * clumps so that a hit only has to touch this array.  slots are handed
+     * out in order as clumps are allocated, and stay with the clump's memory. */
+    uint8_t *clock_bits;
+    struct clump **clock_clumps;
+    uint32_t clock_len;
+    uint32_t clock_hand;
+    int clock_evict_batch;
+
+    /* while this is set, we're feeding keys to it to guess how many groups
+     * the input has, so we can presize the table (--expected-groups auto) */
+    struct hll *sample_hll;
+    long sample_half_bytes;
+    double sample_half_estimate;
+
+    long input_bytes;           /* bytes in the files we've finished with */
+    long total_input_bytes;     /* -1 if we can't know, eg. reading a pipe */
+
+    /* --batch: records whose keys have been hashed and whose clumps are
+     * being prefetched, waiting to be added in order.  each record has
+     * num_interesting_fields string offsets (-1 for null) and doubles, and
+     * cube_max hashed keys. */
+    int batch_size;
+    int batch_len;
+    int *batch_offsets;
+    double *batch_dbl_vals;
+    hash_val_t *batch_hkeys;
+    int batch_strs_len, batch_strs_size;
+    char *batch_strs;
+
+    /* the raw key values of the last record (memo_lens[i] is -1 if field i
+     * was missing) and the clump it went into for each cube index.  a record
+     * with exactly the same key text goes straight into those clumps.  a
+     * clump that's released is cleared out of memo_clumps, and then the memo
+     * can't be used until a record is added the usual way. */
+    bool memo_have_key;
+    int *memo_lens;
+    char *memo_strs;
+    int memo_strs_size;
+    struct clump **memo_clumps;
+
+    /* a record for the same clump as the last record's (for each cube
+     * index) doesn't go through the aggregators that have an add_batch_func
+     * right away: its values for their fields (run_fields) wait in a run,
+     * and then they get the whole run at once.  run i's values of field j
+     * start at run_vals[(i * num_interesting_fields + j) * RUN_SIZE].  a run
+     * has to be flushed before anything reads or frees its clump's data. */
+    bool run_batching;
+    int run_slot;               /* the run the next add_to_clump is for */
+    int runs_pending;           /* how many runs have records in them */
+    struct clump_run *runs;
+    double *run_vals;
+    int num_run_fields;
+    int *run_fields;
+
+    /* --window: each clump keeps the values of the last window_size records
+     * added to it, takes the oldest back out of its aggregators when a new
+     * one comes in, and is output every time it's full.  the ring lives after
+     * the eviction data. */
+    int window_size;
+    int window_data_offset;
+
+    /* --tumble: records are also keyed on which tumble_size window of
+     * tumble_field they fall in, using the extra window_start key field.
+     * the watermark is the latest time we've seen, less allowed_lateness;
+     * once it passes the end of a window, all of the window's clumps are
+     * output at once, and any records that show up for it later are dropped.
+     * open_windows is sorted by start. */
+    double tumble_size;
+    double allowed_lateness;
+    int tumble_field;
+    int window_key_field;
+    char window_key_buf[32];
+    double watermark;
+    struct open_window *open_windows;
+    int open_windows_len, open_windows_size;
+    int tumble_data_offset;
+
+    /* --session-gap: each key's clump is a session, which is output and
+     * closed once we see a time more than session_gap after its last record.
+     * the sessions are kept in a hierarchical timer wheel (by event time,
+     * in ticks of session_tick seconds) so that we don't have to scan the
+     * table to find the ones that are done.  a session's timer is set when
+     * it's created; when it goes off, the session is closed if it's really
+     * done, and otherwise the timer is set again for its new end. */
+    double session_gap;
+    double session_tick;
+    int session_field;
+    int session_data_offset;
+    double record_time;         /* the current record's time */
+    double session_now;         /* the latest time we've seen */
+    int64_t wheel_tick;
+    long wheel_len;
+    struct clump *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+
+    /* --adjacent: the one running clump.  it never goes in clump_table. */
+    struct clump *adjacent_clump;
+
+    /* --assume-sorted: the running clump for each rollup level (indexed by
+     * how many key fields it keeps), which also never go in clump_table */
+    bool assume_sorted;
+    bool verify_sorted;
+    struct clump **sorted_clumps;
+
+    /* how much memory the clumps in the table are using, in all and broken
+     * down by aggregator (indexed like aggregators[]), with the clump
+     * headers, keys and windows counted under the extra entry at the end */
+    long clump_bytes;
+    long peak_clump_bytes;
+    int num_aggregator_types;
+    long *mem_bytes;
+    long *peak_mem_bytes;
+
+    /* --max-memory: evict clumps to keep clump_bytes under this */
+    long max_memory;
+
+    /* --size auto: max_clumps moves between auto_size_min and
+     * auto_size_max.  ghosts holds the hashes of recently evicted keys,
+     * one per slot (a newer eviction just overwrites an older one), so we
+     * can tell when a new clump is one we threw away too soon.  the last
+     * AUTO_SIZE_LOG_LEN changes are kept in size_log for --stats. */
+    bool auto_size;
+    int auto_size_min, auto_size_max;
+    hash_val_t *ghosts;
+    hash_val_t ghost_mask;
+    uint64_t auto_size_records;
+    uint64_t auto_size_created;
+    uint64_t auto_size_evictions;
+    uint64_t auto_size_recreated;
+    struct size_change size_log[AUTO_SIZE_LOG_LEN];
+
+    /* --memory-limit: once clump_bytes passes memory_limit, every clump is
+     * written to one of the spill files (picked by key hash, so all of a
+     * key's partial clumps land in the same file) and the table starts over.
+     * at the end we merge each file back together on its own.  merging is
+     * set while we do that, since there's nowhere left to spill to. */
+    long memory_limit;
+    FILE **spill_files;
+    bool merging;
+
+    bool show_stats;
+    struct collate_stats stats;
+
+    /* where the clumps are output (--output, or stdout) */
+    FILE *out;
+
+    /* --query: with more than one query, the parser fills in the fields of
+     * a separate scan state, which has the union of all the queries' fields,
+     * and each record is handed to each query in turn.  scan_fields[i] is
+     * where this query's field i is in the scan state. */
+    struct collate_state **queries;
+    int num_queries;
+    int *scan_fields;
+
+    /* --query: its arguments, split out of its string into query_strs (see
+     * split_query).  its options point into them until it's finished. */
+    char **query_argv;
+    char *query_strs;
 };
 
+/* add the records waiting in a run to its clump */
+void flush_run(struct collate_state *state, int slot)
+{
+    struct clump_run *run = &state->runs[slot];
+    if(run->len == 0)
+        return;
+
+    double *vals = &state->run_vals[slot * state->num_interesting_fields * RUN_SIZE];
+    char *agg_data = (char*)&run->clump->aggregator_data[0];
+    for(int i = 0; i < state->num_agg_instances; i++)
+    {
+        struct agg_instance *agg_inst = &state->agg_instances[i];
+        if(agg_inst->shares >= 0)
+            continue;
+
+        if(agg_inst->agg->add_batch_func)
+        {
+            double *columns[MAX_INFIELDS_PER_AGGREGATOR];
+            for(int j = 0; j < agg_inst->num_input_fields; j++)
+                columns[j] = &vals[agg_inst->input_fields[j] * RUN_SIZE];
+            agg_inst->agg->add_batch_func(agg_inst->config_data, agg_data, run->len, columns);
+        }
+        agg_data += agg_inst->agg->data_size;
+    }
+
+    run->len = 0;
+    state->runs_pending--;
+}
+
+static inline void flush_runs(struct collate_state *state)
+{
+    for(int i = 0; state->runs_pending > 0 && i < state->cube_max; i++)
+        flush_run(state, i);
+}
+
 void dump_clump(struct clump *clump, struct collate_state *cs)
 {
-    fputc('{', stdout);
+    flush_runs(cs);
+
+    fputc('{', cs->out);
     int i = 0;
     for(i = 0; i < cs->num_key_fields; i++)
     {
-        if(i != 0) putc(',', stdout);
+        if(i != 0) putc(',', cs->out);
 
-        char *val = clump->key_values[i];
-        if(val)
-            printf("\"%s\":\"%s\"", cs->interesting_field_names[i], val);
+        union key_val *val = &clump->key->vals[i];
+        if(clump->key->grouping & (1u << i))
+            fprintf(cs->out, "\"%s\":\"%s\"", cs->interesting_field_names[i], cs->cube_default);
+        else if(clump->key->int_mask & (1u << i))
+            fprintf(cs->out, "\"%s\":\"%lld\"", cs->interesting_field_names[i], (long long)val->i);
+        else if(val->s)
+            fprintf(cs->out, "\"%s\":\"%s\"", cs->interesting_field_names[i], val->s);
         else
-            printf("\"%s\":null", cs->interesting_field_names[i]);
+            fprintf(cs->out, "\"%s\":null", cs->interesting_field_names[i]);
     }
 
     char *agg_data = (char*)&clump->aggregator_data[0];
+    char *inst_data[cs->num_agg_instances];
     for(int j = 0; j < cs->num_agg_instances; j++)
     {
         struct agg_instance *agg_inst = &cs->agg_instances[j];
-        if(i != 0) putc(',', stdout);
-        printf("\"%s\":", agg_inst->output_field_name);
-        agg_inst->agg->dump_func(agg_inst->config_data, agg_data);
-        agg_data += agg_inst->agg->data_size;
+        if(agg_inst->shares >= 0)
+        {
+            inst_data[j] = inst_data[agg_inst->shares];
+        }
+        else
+        {
+            inst_data[j] = agg_data;
+            agg_data += agg_inst->agg->data_size;
+        }
+
+        if(i != 0) putc(',', cs->out);
+        fprintf(cs->out, "\"%s\":", agg_inst->output_field_name);
+        agg_inst->agg->dump_func(agg_inst->config_data, inst_data[j], cs->out);
     }
 
-    fputs("}\n", stdout);
+    fputs("}\n", cs->out);
+}
+
+/*
+ * Do clumps get output when they're flushed (evicted or at the end)?  Not
+ * if they're output as records are added to them.
+ */
+static inline bool dump_on_flush(struct collate_state *state)
+{
+    return !state->incremental && state->window_size == 0;
 }
 
 /* use this itty bitty piece of global data so our hash functions know how many
- * strings to expect. */
+ * values to expect. */
 int num_key_fields;
 
 int hash_comp_func(const void *_k1, const void *_k2)
 {
-    char **k1 = (char**)_k1;
-    char **k2 = (char**)_k2;
+    const struct clump_key *k1 = _k1;
+    const struct clump_key *k2 = _k2;
+
+    if(k1->grouping != k2->grouping)
+        return k1->grouping < k2->grouping ? -1 : 1;
+
+    /* integers sort before strings */
+    if(k1->int_mask != k2->int_mask)
+        return k1->int_mask > k2->int_mask ? -1 : 1;
+
     for(int i = 0; i < num_key_fields; i++)
     {
-        if(k1[i] == NULL || k2[i] == NULL)
+        if(k1->int_mask & (1u << i))
         {
-            if(k1[i] == k2[i])
-                return 0;
-            else if(k1[i] == NULL)
-                return -1;
-            else
-                return 1;
+            if(k1->vals[i].i != k2->vals[i].i)
+                return k1->vals[i].i < k2->vals[i].i ? -1 : 1;
+        }
+        else if(k1->vals[i].s == NULL || k2->vals[i].s == NULL)
+        {
+            if(k1->vals[i].s != k2->vals[i].s)
+                return k1->vals[i].s == NULL ? -1 : 1;
         }
         else
         {
-            int cmp = strcmp(k1[i], k2[i]);
+            int cmp = strcmp(k1->vals[i].s, k2->vals[i].s);
             if(cmp != 0)
                 return cmp;
         }
@@ -126,17 +625,124 @@ int hash_comp_func(const void *_k1, const void *_k2)
     return 0;
 }
 
+/* the finalizer from MurmurHash3, folded down to 32 bits */
+static inline uint32_t hash_int(int64_t val, uint32_t seed)
+{
+    uint64_t h = (uint64_t)val ^ seed;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
 hash_val_t hash_func(const void *_k)
 {
-    char **k = (char**)_k;
+    const struct clump_key *k = _k;
     int hash = 0;
     for(int i = 0; i < num_key_fields; i++)
-        if(k[i])
-            hash = hashlittle(k[i], strlen(k[i]), hash);
+    {
+        if(k->int_mask & (1u << i))
+            hash = hash_int(k->vals[i].i, hash);
+        else if(k->vals[i].s)
+            hash = hashlittle(k->vals[i].s, strlen(k->vals[i].s), hash);
+    }
+
+    if(k->grouping)
+        hash = hash_int(k->grouping, hash);
 
     return hash;
 }
 
+/*
+ * Parse str as an int64, but only if it's written exactly the way printf
+ * would write that int64 back out (no "+", no leading zeros, no "-0").
+ */
+static bool parse_canonical_int(const char *str, int64_t *out)
+{
+    const char *p = str;
+    bool negative = false;
+    uint64_t val = 0;
+
+    if(*p == '-')
+    {
+        negative = true;
+        p++;
+    }
+
+    if(*p < '0' || *p > '9')
+        return false;
+    if(*p == '0' && (p[1] != '\0' || negative))
+        return false;
+
+    for(; *p; p++)
+    {
+        if(*p < '0' || *p > '9')
+            return false;
+        int digit = *p - '0';
+        if(val > (UINT64_MAX - digit) / 10)
+            return false;
+        val = val * 10 + digit;
+    }
+
+    if(negative)
+    {
+        if(val > (uint64_t)INT64_MAX + 1)
+            return false;
+        *out = (int64_t)(0 - val);
+    }
+    else
+    {
+        if(val > INT64_MAX)
+            return false;
+        *out = (int64_t)val;
+    }
+    return true;
+}
+
+/*
+ * Build the lookup key for a set of key values, in a grouping (0 if none of
+ * the fields are rolled up).  String values still point at the caller's
+ * strings.
+ */
+void make_key(struct collate_state *state, char *key_vals[], uint32_t grouping,
+              struct clump_key *key)
+{
+    key->int_mask = 0;
+    key->grouping = grouping;
+    for(int i = 0; i < state->num_key_fields; i++)
+    {
+        if(grouping & (1u << i))
+        {
+            key->vals[i].s = NULL;
+        }
+        else if(state->key_types[i] != KEY_STRING && key_vals[i] &&
+           parse_canonical_int(key_vals[i], &key->vals[i].i))
+        {
+            key->int_mask |= 1u << i;
+            state->key_ints_seen[i]++;
+        }
+        else
+        {
+            key->vals[i].s = key_vals[i];
+        }
+    }
+}
+
+/*
+ * Once we've seen KEY_TYPE_SAMPLE_RECORDS records, stop trying to parse
+ * integers out of KEY_AUTO fields that never had one.  That's safe to do
+ * on the fly: none of their values so far were stored as integers, and from
+ * now on none will be.
+ */
+void settle_key_types(struct collate_state *state)
+{
+    for(int i = 0; i < state->num_key_fields; i++)
+        if(state->key_types[i] == KEY_AUTO)
+            state->key_types[i] = state->key_ints_seen[i] ? KEY_INT : KEY_STRING;
+}
+
 /*
  * This callback will be called every time the parser parses a string.
  * In this callback, however, we are only concerned with strings that
@@ -162,7 +768,8 @@ void string_callback(struct parse_state *parse_state, void *_state)
         start_off++;
         one_past_end_off--;
 
-        /* NULL-terminate the parsed string by writing a null into the buffer */
+        /* NULL-terminate the parsed string by writing a null into the buffer
+         * (over the closing quote, which goes back once we're done with it) */
         parse_state->buffer->buf[one_past_end_off] = '\0';
 
         /* str is now our parsed string */
@@ -183,6 +790,8 @@ void string_callback(struct parse_state *parse_state, void *_state)
         /* if this wasn't an interesting string, use -1 to note that */
         if(state->interesting_field_names[i] == NULL)
             state->interesting_field = -1;
+
+        parse_state->buffer->buf[one_past_end_off] = '"';
     }
 }
 
@@ -191,6 +800,8 @@ void string_callback(struct parse_state *parse_state, void *_state)
  * We only want to pay attention to string or integer values in the top-level
  * object, so we bail if the stack is the wrong depth (we're parsing a value
  * in a sub-hash) or it's the wrong type (object, array, true, false, or null)
+ * -- unless an aggregator keeps values as they were written (records_wanted),
+ * and then those are their JSON text, which collate_record sorts out.
  *
  * If this is a top-level scalar value and we've just seen a key for a field
  * we care about, we insert pointers to this value into a table of interesting values
@@ -208,7 +819,7 @@ void value_callback(struct parse_state *parse_state, void *_state)
 
         /* if this is an object, array, true, false, or null, then bail */
         int ch = parse_state->buffer->buf[start_off - parse_state->buffer->base_offset];
-        if(ch == '{' || ch == '[' || ch == 't' || ch == 'f' || ch == 'n')
+        if(!records_wanted && (ch == '{' || ch == '[' || ch == 't' || ch == 'f' || ch == 'n'))
             return;
 
         /* if this is a string, ditch the quotation marks */
@@ -232,194 +843,2096 @@ void value_callback(struct parse_state *parse_state, void *_state)
     }
 }
 
-struct clump *find_or_create_clump(struct collate_state *state, char *key_vals[])
+/*
+ * Returns a bitmask of the entries in the small table whose (truncated) hash
+ * matches hkey.
+ */
+static inline unsigned small_table_matches(struct collate_state *state, uint32_t hkey)
 {
-    /* do the hash lookup based on key_vals */
-    struct clump *clump = (struct clump*)hash_lookup(state->clump_table, key_vals);
-
-    if(clump)
+    unsigned matches = 0;
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi32(hkey);
+    for(int i = 0; i < SMALL_TABLE_SIZE; i += 4)
     {
-        /* remove this clump from wherever it is in the LRU list */
-        if(clump->next) clump->next->prev = clump->prev;
-        else state->clumps_tail = clump->prev;
-
-        if(clump->prev) clump->prev->next = clump->next;
-        else state->clumps_head = clump->next;
+        __m128i hkeys = _mm_loadu_si128((__m128i*)&state->small_hkeys[i]);
+        __m128i eq = _mm_cmpeq_epi32(hkeys, needle);
+        matches |= (unsigned)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
     }
-    else
-    {
-        /* this clump doesn't exist in the table -- we'll have to create it */
-
-        /* first find the memory.  if we're on a fixed number of clumps and
-         * we've hit that limit, evict.  otherwise, allocate. */
-        if(state->max_clumps != MAX_CLUMPS_INFINITE &&
-           hash_count(state->clump_table) >= state->max_clumps)
-        {
-            /* do an LRU eviction */
-            clump = state->clumps_tail;
+#else
+    for(int i = 0; i < SMALL_TABLE_SIZE; i++)
+        matches |= (unsigned)(state->small_hkeys[i] == hkey) << i;
+#endif
+    return matches & ((1u << state->small_len) - 1);
+}
 
-            state->clumps_tail = state->clumps_tail->prev;
-            if(state->clumps_tail) state->clumps_tail->next = NULL;
-            else state->clumps_head = NULL;
+/* move the small table's clumps into clump_table */
+void promote_small_table(struct collate_state *state)
+{
+    for(int i = 0; i < state->small_len; i++)
+    {
+        struct clump *clump = state->small_clumps[i];
+        hash_insert(state->clump_table, &clump->hash_node, clump->key);
+    }
+    state->small_len = 0;
+    state->small_table = false;
+}
 
-            if(!state->incremental)
-                dump_clump(clump, state);
+hashcount_t clump_count(struct collate_state *state)
+{
+    return state->small_table ? state->small_len : hash_count(state->clump_table);
+}
 
-            hash_delete(state->clump_table, &clump->hash_node);
+static inline struct hot_cache_entry *hot_cache_entry(struct collate_state *state, hash_val_t hkey)
+{
+    return &state->hot_cache[hkey & state->hot_cache_mask];
+}
 
-            for(int i = 0; i < state->num_key_fields; i++)
-                free(clump->key_values[i]);
-            free(clump->key_values[state->num_key_fields]);
-        }
-        else
+struct clump *lookup_clump(struct collate_state *state, struct clump_key *key, hash_val_t hkey)
+{
+    if(state->small_table)
+    {
+        unsigned matches = small_table_matches(state, hkey);
+        while(matches)
         {
-            /* allocate a clump */
-            clump = malloc(state->clump_size);
+            int i = __builtin_ctz(matches);
+            if(hash_comp_func(state->small_clumps[i]->key, key) == 0)
+                return state->small_clumps[i];
+            matches &= matches - 1;
         }
+        return NULL;
+    }
 
-        /* now create a copy of the key (set of key fields) that will belong to the table */
-        clump->key_values = malloc(sizeof(char*) * (state->num_key_fields+1));
-        for(int i = 0; i < state->num_key_fields; i++)
+    if(state->hot_cache)
+    {
+        struct hot_cache_entry *entry = hot_cache_entry(state, hkey);
+        state->stats.hot_cache_lookups++;
+        if(entry->clump && entry->hkey == (uint32_t)hkey &&
+           hash_comp_func(entry->clump->key, key) == 0)
         {
-            if(key_vals[i])
-                clump->key_values[i] = strdup(key_vals[i]);
-            else
-                clump->key_values[i] = NULL;
+            state->stats.hot_cache_hits++;
+            return entry->clump;
         }
-        clump->key_values[state->num_key_fields] = NULL;
 
-        /* now give all the aggregator instances a chance to init their data in the clump */
-        char *agg_data = (char*)&clump->aggregator_data[0];
-        for(int i = 0; i < state->num_agg_instances; i++)
+        struct clump *clump = (struct clump*)hash_lookup_hkey(state->clump_table, key, hkey);
+        if(clump)
         {
-            struct agg_instance *agg_inst = &state->agg_instances[i];
-            agg_inst->agg->init_func(agg_inst->config_data, agg_data);
-            agg_data += agg_inst->agg->data_size;
+            entry->hkey = hkey;
+            entry->clump = clump;
         }
-
-        /* insert this clump into the hash table */
-        hnode_init(&clump->hash_node, 0);
-        hash_insert(state->clump_table, &clump->hash_node, clump->key_values);
+        return clump;
     }
 
-    /* move this clump to the front of the LRU list */
-    clump->next = state->clumps_head;
-    clump->prev = NULL;
-
-    if(state->clumps_head) state->clumps_head->prev = clump;
-    else state->clumps_tail = clump;
-    state->clumps_head = clump;
-
-    return clump;
+    return (struct clump*)hash_lookup_hkey(state->clump_table, key, hkey);
 }
 
-void find_and_add_to_clump(struct collate_state *state, char *vals[], double d_vals[])
+void insert_clump(struct collate_state *state, struct clump *clump, hash_val_t hkey)
 {
-    struct clump *clump = find_or_create_clump(state, vals);
+    hnode_init(&clump->hash_node, 0);
 
-    char *agg_data = (char*)&clump->aggregator_data[0];
-    for(int i = 0; i < state->num_agg_instances; i++)
-    {
-        char *agg_vals[MAX_INFIELDS_PER_AGGREGATOR];
-        double agg_d_vals[MAX_INFIELDS_PER_AGGREGATOR];
-        struct agg_instance *agg_inst = &state->agg_instances[i];
+    if(state->small_table && state->small_len == SMALL_TABLE_SIZE)
+        promote_small_table(state);
 
-        /* map the values to the ones that the aggregator cares about */
+    if(state->small_table)
+    {
+        /* hash_insert would set this; the eviction policies want it too */
+        clump->hash_node.hash_hkey = hkey;
+        state->small_hkeys[state->small_len] = hkey;
+        state->small_clumps[state->small_len++] = clump;
+    }
+    else
+    {
+        hash_insert_hkey(state->clump_table, &clump->hash_node, clump->key, hkey);
+        if(state->hot_cache)
+        {
+            struct hot_cache_entry *entry = hot_cache_entry(state, hkey);
+            entry->hkey = hkey;
+            entry->clump = clump;
+        }
+    }
+}
 
-        for(int j = 0; j < agg_inst->num_input_fields; j++)
+void remove_clump(struct collate_state *state, struct clump *clump)
+{
+    if(state->small_table)
+    {
+        for(int i = 0; i < state->small_len; i++)
         {
-            agg_vals[j] = vals[agg_inst->input_fields[j]];
-            agg_d_vals[j] = d_vals[agg_inst->input_fields[j]];
+            if(state->small_clumps[i] == clump)
+            {
+                state->small_len--;
+                state->small_hkeys[i] = state->small_hkeys[state->small_len];
+                state->small_clumps[i] = state->small_clumps[state->small_len];
+                break;
+            }
+        }
+    }
+    else
+    {
+        /* the clump's memory is about to be reused for a different key, so
+         * make sure the hot cache forgets about it */
+        if(state->hot_cache)
+        {
+            struct hot_cache_entry *entry = hot_cache_entry(state, clump->hash_node.hash_hkey);
+            if(entry->clump == clump)
+                entry->clump = NULL;
         }
 
-        /* run the aggregator's add callback! */
+        hash_delete(state->clump_table, &clump->hash_node);
+    }
+}
 
-        agg_inst->agg->add_func(agg_inst->config_data, agg_data, agg_vals, agg_d_vals);
-        agg_data += agg_inst->agg->data_size;
+/*
+ * Memory accounting.  kind is an index into aggregators[], or
+ * num_aggregator_types for the clump headers, keys and windows.
+ */
+static inline void count_bytes(struct collate_state *state, int kind, long bytes)
+{
+    state->clump_bytes += bytes;
+    state->mem_bytes[kind] += bytes;
+    if(bytes > 0)
+    {
+        if(state->clump_bytes > state->peak_clump_bytes)
+            state->peak_clump_bytes = state->clump_bytes;
+        if(state->mem_bytes[kind] > state->peak_mem_bytes[kind])
+            state->peak_mem_bytes[kind] = state->mem_bytes[kind];
     }
+}
 
-    if(state->incremental)
-        dump_clump(clump, state);
+static inline int agg_kind(struct agg_instance *agg_inst)
+{
+    return agg_inst->agg - aggregators;
 }
 
+/* true if there's no room for another clump */
+static inline bool clumps_full(struct collate_state *state)
+{
+    if(state->max_clumps != MAX_CLUMPS_INFINITE && clump_count(state) >= state->max_clumps)
+        return true;
+    return state->max_memory && state->clump_bytes >= state->max_memory &&
+           clump_count(state) > 0;
+}
 
 /*
- * This callback is called at the end of each object.  If the object that's ending
- * is the top-level object, this is where we do the work of finding or creating
- * the bucket for this record and letting each aggregator instance aggregate.
+ * Clumps are never freed (an evicted clump's memory is reused for the clump
+ * that replaces it), so we hand them out of big slabs rather than calling
+ * malloc for each one.
  */
-void object_callback(struct parse_state *parse_state, void *_state)
+struct clump *alloc_clump(struct collate_state *state)
 {
-    struct collate_state *state = _state;
-    if(parse_state->parse_stack_length == 1) // object
+    if(state->next_clump == state->total_available_clumps)
     {
-        /* NULL-terminate all values */
-        char *buf = (char*)parse_state->buffer->buf - parse_state->buffer->base_offset;
-        for(int i = 0; i < state->num_interesting_fields; i++)
+        if(state->total_available_clumps < MAX_CLUMPS_PER_SLAB)
+            state->total_available_clumps *= 2;
+        state->available_clumps = malloc((size_t)state->clump_size * (size_t)state->total_available_clumps);
+        state->next_clump = 0;
+    }
+
+    return (struct clump*)(state->available_clumps + (size_t)state->clump_size * (size_t)state->next_clump++);
+}
+
+/*
+ * Get the table and the clump slab ready for this many groups, so that they
+ * don't have to grow a bit at a time as the groups show up.
+ */
+void presize_clumps(struct collate_state *state, double groups)
+{
+    if(state->max_clumps != MAX_CLUMPS_INFINITE && groups > state->max_clumps)
+        groups = state->max_clumps;
+    if(groups > INT_MAX)
+        groups = INT_MAX;
+
+    long needed = (long)groups - (long)clump_count(state);
+    if(needed <= 0)
+        return;
+
+    if(needed > state->total_available_clumps - state->next_clump)
+    {
+        /* if we can't have it all at once, the slabs just grow as we go */
+        char *slab = malloc((size_t)state->clump_size * (size_t)needed);
+        if(slab == NULL)
+            return;
+        state->available_clumps = slab;
+        state->total_available_clumps = (int)needed;
+        state->next_clump = 0;
+    }
+
+    hash_presize(state->clump_table, (hashcount_t)groups);
+}
+
+void sample_key(struct collate_state *state, char *key_vals[])
+{
+    uint64_t hash = 0;
+    for(int i = 0; i < state->num_key_fields; i++)
+        if(key_vals[i])
+            hash = hash64(key_vals[i], strlen(key_vals[i]), hash);
+
+    hll_add_hash(state->sample_hll, hash);
+}
+
+/*
+ * We've seen the first <bytes> bytes of input; make our guess about how many
+ * groups the whole input will have.  Distinct keys tend to grow like a power
+ * of the input size (Heaps' law), so we compare the estimate half-way through
+ * the sample to the estimate at the end to find that power, and extrapolate
+ * to the total input size.  If we don't know how big the input is (or we've
+ * seen all of it), the best we can say is what we've seen so far.
+ */
+void finish_sampling(struct collate_state *state, long bytes, bool eof)
+{
+    double estimate = hll_estimate(state->sample_hll);
+
+    if(!eof && state->total_input_bytes > bytes && state->sample_half_estimate > 0)
+    {
+        double alpha = log(estimate / state->sample_half_estimate) /
+                       log((double)bytes / state->sample_half_bytes);
+        if(alpha < 0) alpha = 0;
+        if(alpha > 1) alpha = 1;
+        estimate *= pow((double)state->total_input_bytes / bytes, alpha);
+    }
+
+    hll_free(state->sample_hll);
+    state->sample_hll = NULL;
+
+    state->stats.estimated_groups = estimate;
+    state->stats.sampled_bytes = bytes;
+
+    if(!eof)
+        presize_clumps(state, estimate);
+}
+
+static inline struct lru_links *clump_lru(struct collate_state *state, struct clump *clump)
+{
+    return (struct lru_links*)((char*)clump->aggregator_data + state->evict_data_offset);
+}
+
+static inline struct clock_slot *clump_clock(struct collate_state *state, struct clump *clump)
+{
+    return (struct clock_slot*)((char*)clump->aggregator_data + state->evict_data_offset);
+}
+
+static inline struct tinylfu_links *clump_tinylfu(struct collate_state *state, struct clump *clump)
+{
+    return (struct tinylfu_links*)((char*)clump->aggregator_data + state->evict_data_offset);
+}
+
+void lru_push_front(struct collate_state *state, struct lru_list *list, struct clump *clump)
+{
+    struct lru_links *links = clump_lru(state, clump);
+    links->next = list->head;
+    links->prev = NULL;
+
+    if(list->head) clump_lru(state, list->head)->prev = clump;
+    else list->tail = clump;
+    list->head = clump;
+    list->len++;
+}
+
+void lru_unlink(struct collate_state *state, struct lru_list *list, struct clump *clump)
+{
+    struct lru_links *links = clump_lru(state, clump);
+    if(links->next) clump_lru(state, links->next)->prev = links->prev;
+    else list->tail = links->prev;
+
+    if(links->prev) clump_lru(state, links->prev)->next = links->next;
+    else list->head = links->next;
+    list->len--;
+}
+
+/* start tracking a new clump for eviction */
+void track_clump(struct collate_state *state, struct clump *clump)
+{
+    if(state->eviction_policy == EVICT_LRU)
+    {
+        lru_push_front(state, &state->lru, clump);
+    }
+    else if(state->eviction_policy == EVICT_CLOCK)
+    {
+        state->clock_bits[clump_clock(state, clump)->slot] = CLOCK_IN_USE;
+    }
+    else if(state->eviction_policy == EVICT_TINYLFU)
+    {
+        clump_tinylfu(state, clump)->in_window = true;
+        lru_push_front(state, &state->window, clump);
+
+        /* while the main region has room, it takes whatever falls out of
+         * the window without having to earn its place */
+        while(state->window.len > state->window_max &&
+              state->lru.len < state->max_clumps - state->window_max)
+        {
+            struct clump *oldest = state->window.tail;
+            lru_unlink(state, &state->window, oldest);
+            clump_tinylfu(state, oldest)->in_window = false;
+            lru_push_front(state, &state->lru, oldest);
+        }
+    }
+}
+
+/* note that an existing clump was just used */
+void touch_clump(struct collate_state *state, struct clump *clump)
+{
+    if(state->eviction_policy == EVICT_LRU)
+    {
+        /* move this clump to the front of the LRU list, unless it's
+         * already there */
+        if(clump != state->lru.head)
+        {
+            lru_unlink(state, &state->lru, clump);
+            lru_push_front(state, &state->lru, clump);
+        }
+    }
+    else if(state->eviction_policy == EVICT_CLOCK)
+    {
+        state->clock_bits[clump_clock(state, clump)->slot] |= CLOCK_REFERENCED;
+    }
+    else if(state->eviction_policy == EVICT_TINYLFU)
+    {
+        struct lru_list *list = clump_tinylfu(state, clump)->in_window ?
+                                &state->window : &state->lru;
+        if(clump != list->head)
+        {
+            lru_unlink(state, list, clump);
+            lru_push_front(state, list, clump);
+        }
+    }
+}
+
+/*
+ * Free what a clump that's no longer in the table points to, and put its
+ * memory on the free list.
+ */
+void window_free(struct collate_state *state, struct clump *clump);
+
+void release_clump(struct collate_state *state, struct clump *clump)
+{
+    flush_runs(state);
+
+    for(int i = 0; i < state->cube_max; i++)
+        if(state->memo_clumps[i] == clump)
+            state->memo_clumps[i] = NULL;
+
+    if(state->window_size)
+        window_free(state, clump);
+
+    int keys_kind = state->num_aggregator_types;
+    for(int i = 0; i < state->num_key_fields; i++)
+    {
+        if(!(clump->key->int_mask & (1u << i)) && clump->key->vals[i].s)
+        {
+            count_bytes(state, keys_kind, -(long)(strlen(clump->key->vals[i].s) + 1));
+            free(clump->key->vals[i].s);
+        }
+    }
+
+    char *agg_data = (char*)&clump->aggregator_data[0];
+    for(int i = 0; i < state->num_agg_instances; i++)
+    {
+        struct agg_instance *agg_inst = &state->agg_instances[i];
+        if(agg_inst->shares >= 0)
+            continue;
+        long bytes = agg_inst->agg->data_size;
+        if(agg_inst->agg->memory_func)
+            bytes += agg_inst->agg->memory_func(agg_inst->config_data, agg_data);
+        count_bytes(state, agg_kind(agg_inst), -bytes);
+
+        if(agg_inst->agg->free_func)
+            agg_inst->agg->free_func(agg_inst->config_data, agg_data);
+        agg_data += agg_inst->agg->data_size;
+    }
+
+    count_bytes(state, keys_kind, -(long)(state->clump_size - state->agg_data_size));
+    clump->hash_node.hash_next = (hnode_t*)state->free_clumps;
+    state->free_clumps = clump;
+}
+
+/*
+ * Flush a clump out of the table and put its memory on the free list.
+ */
+void evict_clump(struct collate_state *state, struct clump *clump)
+{
+    if(dump_on_flush(state))
+        dump_clump(clump, state);
+
+    if(state->auto_size)
+    {
+        hash_val_t hkey = clump->hash_node.hash_hkey;
+        state->ghosts[hkey & state->ghost_mask] = hkey;
+    }
+
+    remove_clump(state, clump);
+    state->stats.evictions++;
+    release_clump(state, clump);
+}
+
+/*
+ * We're out of room: evict the least recently used clump, or with CLOCK,
+ * sweep the hand around evicting a batch of clumps that haven't been
+ * referenced since it last passed them.
+ */
+void make_room(struct collate_state *state)
+{
+    if(state->eviction_policy == EVICT_LRU)
+    {
+        struct clump *clump = state->lru.tail;
+        lru_unlink(state, &state->lru, clump);
+        evict_clump(state, clump);
+    }
+    else if(state->eviction_policy == EVICT_TINYLFU)
+    {
+        /* the oldest clump in the window gets into the main region only if
+         * it's more popular than the main region's oldest clump.  either way,
+         * the loser gets evicted. */
+        struct clump *candidate = state->window.tail;
+        struct clump *victim = state->lru.tail;
+
+        if(candidate && victim &&
+           cm_estimate(state->sketch, candidate->hash_node.hash_hkey) >
+           cm_estimate(state->sketch, victim->hash_node.hash_hkey))
+        {
+            lru_unlink(state, &state->lru, victim);
+            evict_clump(state, victim);
+
+            lru_unlink(state, &state->window, candidate);
+            clump_tinylfu(state, candidate)->in_window = false;
+            lru_push_front(state, &state->lru, candidate);
+            state->stats.tinylfu_admitted++;
+        }
+        else if(candidate)
+        {
+            lru_unlink(state, &state->window, candidate);
+            evict_clump(state, candidate);
+            if(victim)
+                state->stats.tinylfu_rejected++;
+        }
+        else
+        {
+            lru_unlink(state, &state->lru, victim);
+            evict_clump(state, victim);
+        }
+    }
+    else if(state->eviction_policy == EVICT_CLOCK)
+    {
+        /* with --max-memory, there may be fewer clumps than a batch */
+        int batch = state->clock_evict_batch;
+        if(clump_count(state) < (hashcount_t)batch)
+            batch = clump_count(state);
+
+        int evicted = 0;
+        while(evicted < batch)
+        {
+            uint32_t slot = state->clock_hand;
+            if(++state->clock_hand == state->clock_len)
+                state->clock_hand = 0;
+
+            if(state->clock_bits[slot] & CLOCK_REFERENCED)
+            {
+                state->clock_bits[slot] &= ~CLOCK_REFERENCED;
+            }
+            else if(state->clock_bits[slot] & CLOCK_IN_USE)
+            {
+                state->clock_bits[slot] = 0;
+                evict_clump(state, state->clock_clumps[slot]);
+                evicted++;
+            }
+        }
+    }
+}
+
+struct clump *new_clump(struct collate_state *state)
+{
+    struct clump *clump = state->free_clumps;
+    if(clump)
+    {
+        state->free_clumps = (struct clump*)clump->hash_node.hash_next;
+        return clump;
+    }
+
+    clump = alloc_clump(state);
+    if(state->eviction_policy == EVICT_CLOCK)
+    {
+        clump_clock(state, clump)->slot = state->clock_len;
+        state->clock_clumps[state->clock_len++] = clump;
+    }
+    return clump;
+}
+
+static inline struct window_ring *clump_window(struct collate_state *state, struct clump *clump)
+{
+    return (struct window_ring*)((char*)clump->aggregator_data + state->window_data_offset);
+}
+
+void window_init(struct collate_state *state, struct clump *clump)
+{
+    struct window_ring *ring = clump_window(state, clump);
+    int n = state->window_size * state->num_interesting_fields;
+    ring->start = ring->len = 0;
+    ring->vals = malloc(sizeof(*ring->vals) * n);
+    ring->dbl_vals = malloc(sizeof(*ring->dbl_vals) * n);
+    count_bytes(state, state->num_aggregator_types,
+                (sizeof(*ring->vals) + sizeof(*ring->dbl_vals)) * n);
+}
+
+/* forget the values of the oldest record in the window */
+void window_drop_oldest(struct collate_state *state, struct window_ring *ring)
+{
+    char **vals = &ring->vals[ring->start * state->num_interesting_fields];
+    for(int i = 0; i < state->num_interesting_fields; i++)
+    {
+        if(vals[i])
+        {
+            count_bytes(state, state->num_aggregator_types, -(long)(strlen(vals[i]) + 1));
+            free(vals[i]);
+        }
+    }
+
+    ring->start = (ring->start + 1) % state->window_size;
+    ring->len--;
+}
+
+void window_free(struct collate_state *state, struct clump *clump)
+{
+    struct window_ring *ring = clump_window(state, clump);
+    while(ring->len > 0)
+        window_drop_oldest(state, ring);
+
+    free(ring->vals);
+    free(ring->dbl_vals);
+    count_bytes(state, state->num_aggregator_types,
+                -(long)((sizeof(*ring->vals) + sizeof(*ring->dbl_vals)) *
+                        state->window_size * state->num_interesting_fields));
+}
+
+/*
+ * Make room in the window for a new record's values: if it's full, take the
+ * oldest record's values back out of the aggregators.  Then save the new
+ * values, for when it's their turn to go.
+ */
+void window_slide(struct collate_state *state, struct clump *clump,
+                  char *vals[], double d_vals[])
+{
+    struct window_ring *ring = clump_window(state, clump);
+    int n = state->num_interesting_fields;
+
+    if(ring->len == state->window_size)
+    {
+        char **old_vals = &ring->vals[ring->start * n];
+        double *old_d_vals = &ring->dbl_vals[ring->start * n];
+
+        char *agg_data = (char*)&clump->aggregator_data[0];
+        for(int i = 0; i < state->num_agg_instances; i++)
+        {
+            char *agg_vals[MAX_INFIELDS_PER_AGGREGATOR];
+            double agg_d_vals[MAX_INFIELDS_PER_AGGREGATOR];
+            struct agg_instance *agg_inst = &state->agg_instances[i];
+            if(agg_inst->shares >= 0)
+                continue;
+
+            for(int j = 0; j < agg_inst->num_input_fields; j++)
+            {
+                agg_vals[j] = old_vals[agg_inst->input_fields[j]];
+                agg_d_vals[j] = old_d_vals[agg_inst->input_fields[j]];
+            }
+
+            if(agg_inst->agg->memory_func)
+            {
+                long before = agg_inst->agg->memory_func(agg_inst->config_data, agg_data);
+                agg_inst->agg->remove_func(agg_inst->config_data, agg_data, agg_vals, agg_d_vals);
+                count_bytes(state, agg_kind(agg_inst),
+                            agg_inst->agg->memory_func(agg_inst->config_data, agg_data) - before);
+            }
+            else
+            {
+                agg_inst->agg->remove_func(agg_inst->config_data, agg_data, agg_vals, agg_d_vals);
+            }
+            agg_data += agg_inst->agg->data_size;
+        }
+
+        window_drop_oldest(state, ring);
+    }
+
+    int slot = (ring->start + ring->len++) % state->window_size;
+    for(int i = 0; i < n; i++)
+    {
+        ring->vals[slot * n + i] = vals[i] ? strdup(vals[i]) : NULL;
+        if(vals[i])
+            count_bytes(state, state->num_aggregator_types, strlen(vals[i]) + 1);
+    }
+    memcpy(&ring->dbl_vals[slot * n], d_vals, sizeof(*d_vals) * n);
+}
+
+/* set up a new clump for key (the clump gets its own copy of the key) */
+void init_clump(struct collate_state *state, struct clump *clump, struct clump_key *key)
+{
+    state->stats.clumps_created++;
+
+    int keys_kind = state->num_aggregator_types;
+    count_bytes(state, keys_kind, state->clump_size - state->agg_data_size);
+
+    /* now create a copy of the key (set of key fields) that will belong to the table */
+    clump->key = (struct clump_key*)((char*)clump->aggregator_data + state->agg_data_size);
+    clump->key->int_mask = key->int_mask;
+    clump->key->grouping = key->grouping;
+    for(int i = 0; i < state->num_key_fields; i++)
+    {
+        if(key->int_mask & (1u << i))
+            clump->key->vals[i].i = key->vals[i].i;
+        else if(key->vals[i].s)
+        {
+            clump->key->vals[i].s = strdup(key->vals[i].s);
+            count_bytes(state, keys_kind, strlen(key->vals[i].s) + 1);
+        }
+        else
+            clump->key->vals[i].s = NULL;
+    }
+
+    /* now give all the aggregator instances a chance to init their data in the clump */
+    char *agg_data = (char*)&clump->aggregator_data[0];
+    for(int i = 0; i < state->num_agg_instances; i++)
+    {
+        struct agg_instance *agg_inst = &state->agg_instances[i];
+        if(agg_inst->shares >= 0)
+            continue;
+        if(state->window_size && agg_inst->agg->window_init_func)
+            agg_inst->agg->window_init_func(agg_inst->config_data, agg_data, state->window_size);
+        else
+            agg_inst->agg->init_func(agg_inst->config_data, agg_data);
+
+        long bytes = agg_inst->agg->data_size;
+        if(agg_inst->agg->memory_func)
+            bytes += agg_inst->agg->memory_func(agg_inst->config_data, agg_data);
+        count_bytes(state, agg_kind(agg_inst), bytes);
+
+        agg_data += agg_inst->agg->data_size;
+    }
+    if(state->window_size)
+        window_init(state, clump);
+}
+
+/*
+ * --size auto: if too many of the keys we've been evicting have come back,
+ * we're splitting groups for nothing, so make room for more clumps (as long
+ * as the memory cap has room for them).  if hardly any come back, the
+ * clumps we're holding on to aren't worth the memory, so keep fewer.
+ */
+void adjust_size(struct collate_state *state)
+{
+    struct collate_stats *stats = &state->stats;
+    uint64_t created = stats->clumps_created - state->auto_size_created;
+    uint64_t evictions = stats->evictions - state->auto_size_evictions;
+    uint64_t recreated = stats->recreated - state->auto_size_recreated;
+    state->auto_size_records = stats->records;
+    if(created < AUTO_SIZE_MIN_CREATED)
+        return;
+
+    double rate = (double)recreated / created;
+    int from = state->max_clumps;
+    int to = from;
+    if(rate * 100 > AUTO_SIZE_TARGET_PERCENT &&
+       state->clump_bytes < state->max_memory - state->max_memory / 8)
+    {
+        long grown = (long)from + from / 4 + 1;
+        to = grown > state->auto_size_max ? state->auto_size_max : grown;
+    }
+    else if(rate * 100 < AUTO_SIZE_TARGET_PERCENT / 4.0 && evictions > 0)
+    {
+        int shrunk = from - from / 8;
+        to = shrunk < state->auto_size_min ? state->auto_size_min : shrunk;
+    }
+
+    if(to != from)
+    {
+        state->max_clumps = to;
+        while(clump_count(state) > state->max_clumps)
+            make_room(state);
+
+        uint64_t changes = stats->size_grows + stats->size_shrinks;
+        state->size_log[changes % AUTO_SIZE_LOG_LEN] = (struct size_change){
+            .records = stats->records, .from = from, .to = to, .recreate_rate = rate };
+        if(to > from)
+            stats->size_grows++;
+        else
+            stats->size_shrinks++;
+    }
+
+    /* the evictions we just made count toward the next round */
+    state->auto_size_created = stats->clumps_created;
+    state->auto_size_evictions = stats->evictions;
+    state->auto_size_recreated = stats->recreated;
+}
+
+void spill_clumps(struct collate_state *state);
+void tumble_track(struct collate_state *state, struct clump *clump);
+void session_track(struct collate_state *state, struct clump *clump);
+
+struct clump *find_or_create_clump(struct collate_state *state, struct clump_key *key,
+                                   hash_val_t hkey)
+{
+    /* do the lookup based on the key */
+    struct clump *clump = lookup_clump(state, key, hkey);
+
+    if(state->sketch)
+        cm_add(state->sketch, hkey);
+
+    if(clump)
+    {
+        touch_clump(state, clump);
+        return clump;
+    }
+
+    /* this clump doesn't exist in the table -- we'll have to create it */
+
+    if(state->auto_size)
+    {
+        hash_val_t *ghost = &state->ghosts[hkey & state->ghost_mask];
+        if(*ghost == hkey)
+        {
+            state->stats.recreated++;
+            *ghost = 0;
+        }
+
+        if(state->stats.records - state->auto_size_records >= AUTO_SIZE_INTERVAL)
+            adjust_size(state);
+    }
+
+    /* first find the memory.  if we're on a fixed number of clumps and
+     * we've hit that limit, evict.  otherwise, allocate. */
+    if(clumps_full(state))
+        make_room(state);
+    else if(state->memory_limit && !state->merging &&
+            state->clump_bytes >= state->memory_limit)
+        spill_clumps(state);
+
+    clump = new_clump(state);
+    init_clump(state, clump, key);
+
+    /* insert this clump into the table */
+    insert_clump(state, clump, hkey);
+    track_clump(state, clump);
+    if(state->tumble_size > 0)
+        tumble_track(state, clump);
+    if(state->session_gap > 0)
+        session_track(state, clump);
+
+    return clump;
+}
+
+static inline void session_touch(struct collate_state *state, struct clump *clump);
+
+/* run a record's values through a clump's aggregators */
+void add_to_clump(struct collate_state *state, struct clump *clump,
+                  char *vals[], double d_vals[])
+{
+    if(state->window_size)
+        window_slide(state, clump, vals, d_vals);
+    if(state->session_gap > 0)
+        session_touch(state, clump);
+
+    bool in_run = false;
+    if(state->run_batching)
+    {
+        int slot = state->run_slot++ % state->cube_max;
+        struct clump_run *run = &state->runs[slot];
+        if(run->clump != clump || run->len == RUN_SIZE)
+        {
+            /* this record starts the next run, but there's no point in
+             * holding it back until we know there'll be more */
+            flush_run(state, slot);
+            run->clump = clump;
+        }
+        else
+        {
+            double *run_vals = &state->run_vals[slot * state->num_interesting_fields * RUN_SIZE];
+            for(int j = 0; j < state->num_run_fields; j++)
+            {
+                int field = state->run_fields[j];
+                run_vals[field * RUN_SIZE + run->len] = d_vals[field];
+            }
+            if(run->len++ == 0)
+                state->runs_pending++;
+            in_run = true;
+        }
+    }
+
+    char *agg_data = (char*)&clump->aggregator_data[0];
+    for(int i = 0; i < state->num_agg_instances; i++)
+    {
+        char *agg_vals[MAX_INFIELDS_PER_AGGREGATOR];
+        double agg_d_vals[MAX_INFIELDS_PER_AGGREGATOR];
+        struct agg_instance *agg_inst = &state->agg_instances[i];
+        if(agg_inst->shares >= 0)
+            continue;
+        if(in_run && agg_inst->agg->add_batch_func)
+        {
+            agg_data += agg_inst->agg->data_size;
+            continue;
+        }
+
+        /* map the values to the ones that the aggregator cares about */
+
+        for(int j = 0; j < agg_inst->num_input_fields; j++)
+        {
+            agg_vals[j] = vals[agg_inst->input_fields[j]];
+            agg_d_vals[j] = d_vals[agg_inst->input_fields[j]];
+            if(state->any_literals && !agg_inst->agg->wants_literals &&
+               state->literal_vals[agg_inst->input_fields[j]])
+                agg_vals[j] = NULL;
+        }
+
+        /* run the aggregator's add callback! */
+
+        if(agg_inst->agg->memory_func)
+        {
+            long before = agg_inst->agg->memory_func(agg_inst->config_data, agg_data);
+            agg_inst->agg->add_func(agg_inst->config_data, agg_data, agg_vals, agg_d_vals);
+            count_bytes(state, agg_kind(agg_inst),
+                        agg_inst->agg->memory_func(agg_inst->config_data, agg_data) - before);
+        }
+        else
+        {
+            agg_inst->agg->add_func(agg_inst->config_data, agg_data, agg_vals, agg_d_vals);
+        }
+        agg_data += agg_inst->agg->data_size;
+    }
+
+    if(state->incremental ||
+       (state->window_size && clump_window(state, clump)->len == state->window_size))
+        dump_clump(clump, state);
+
+    /* growing this clump may have put us over --max-memory.  we're done with
+     * it, so it's fair game for eviction along with the rest. */
+    while(state->max_memory && state->clump_bytes > state->max_memory &&
+          clump_count(state) > 1)
+        make_room(state);
+}
+
+void find_and_add_to_clump(struct collate_state *state, struct clump_key *key,
+                           char *vals[], double d_vals[], hash_val_t hkey)
+{
+    struct clump *clump = find_or_create_clump(state, key, hkey);
+    add_to_clump(state, clump, vals, d_vals);
+}
+
+/*
+ * Spilling (--memory-limit).  A spilled clump is its key hash, its key (the
+ * int mask, then for each field an int64, or a length and that many bytes,
+ * with -1 for null) and then each aggregator's data.  The files only live as
+ * long as we do, so the byte order is whatever ours is.
+ */
+void write_spilled(struct collate_state *state, hash_val_t hkey, struct clump_key *key,
+                   char *agg_data, FILE *out)
+{
+    fwrite(&hkey, sizeof(hkey), 1, out);
+    fwrite(&key->int_mask, sizeof(key->int_mask), 1, out);
+    fwrite(&key->grouping, sizeof(key->grouping), 1, out);
+    for(int i = 0; i < state->num_key_fields; i++)
+    {
+        union key_val *val = &key->vals[i];
+        if(key->int_mask & (1u << i))
+        {
+            fwrite(&val->i, sizeof(val->i), 1, out);
+        }
+        else
+        {
+            int len = val->s ? (int)strlen(val->s) : -1;
+            fwrite(&len, sizeof(len), 1, out);
+            if(len > 0)
+                fwrite(val->s, sizeof(char), len, out);
+        }
+    }
+
+    for(int i = 0; i < state->num_agg_instances; i++)
+    {
+        struct agg_instance *agg_inst = &state->agg_instances[i];
+        if(agg_inst->shares >= 0)
+            continue;
+        if(agg_inst->agg->serialize_func)
+            agg_inst->agg->serialize_func(agg_inst->config_data, agg_data, out);
+        else
+            fwrite(agg_data, agg_inst->agg->data_size, 1, out);
+        agg_data += agg_inst->agg->data_size;
+    }
+}
+
+void write_spilled_clump(struct collate_state *state, struct clump *clump, FILE *out)
+{
+    flush_runs(state);
+    write_spilled(state, clump->hash_node.hash_hkey, clump->key,
+                  (char*)&clump->aggregator_data[0], out);
+}
+
+void check_spill_file(FILE *f)
+{
+    if(ferror(f))
+    {
+        fprintf(stderr, "recs-collate: error using spill file: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/* a spill file ended part way through a clump */
+void spill_file_truncated(FILE *f)
+{
+    check_spill_file(f);
+    fprintf(stderr, "recs-collate: error using spill file: it ends part way through a clump\n");
+    exit(1);
+}
+
+/*
+ * Read a spilled clump's key into state->tmp_key (its strings go in *strs,
+ * which is grown as needed) and its aggregator data into agg_data.  Returns
+ * false at the end of the file, and fails if the file ends part way through
+ * a clump.
+ */
+bool read_spilled_clump(struct collate_state *state, FILE *in, hash_val_t *hkey,
+                        char **strs, int *strs_size, char *agg_data)
+{
+    struct clump_key *key = state->tmp_key;
+    if(fread(hkey, sizeof(*hkey), 1, in) != 1)
+    {
+        check_spill_file(in);
+        return false;
+    }
+    if(fread(&key->int_mask, sizeof(key->int_mask), 1, in) != 1 ||
+       fread(&key->grouping, sizeof(key->grouping), 1, in) != 1)
+        spill_file_truncated(in);
+
+    int offsets[state->num_key_fields];
+    int strs_len = 0;
+    for(int i = 0; i < state->num_key_fields; i++)
+    {
+        if(key->int_mask & (1u << i))
+        {
+            if(fread(&key->vals[i].i, sizeof(key->vals[i].i), 1, in) != 1)
+                spill_file_truncated(in);
+            continue;
+        }
+
+        int len;
+        if(fread(&len, sizeof(len), 1, in) != 1)
+            spill_file_truncated(in);
+        offsets[i] = len < 0 ? -1 : strs_len;
+        if(len < 0)
+            continue;
+
+        RESIZE_ARRAY_IF_NECESSARY(*strs, *strs_size, strs_len + len + 1);
+        if(fread(*strs + strs_len, sizeof(char), len, in) != (size_t)len)
+            spill_file_truncated(in);
+        strs_len += len;
+        (*strs)[strs_len++] = '\0';
+    }
+
+    /* now that the buffer's done moving, point the key at it */
+    for(int i = 0; i < state->num_key_fields; i++)
+        if(!(key->int_mask & (1u << i)))
+            key->vals[i].s = offsets[i] == -1 ? NULL : *strs + offsets[i];
+
+    for(int i = 0; i < state->num_agg_instances; i++)
+    {
+        struct agg_instance *agg_inst = &state->agg_instances[i];
+        if(agg_inst->shares >= 0)
+            continue;
+        if(agg_inst->agg->deserialize_func ?
+           !agg_inst->agg->deserialize_func(agg_inst->config_data, agg_data, in) :
+           fread(agg_data, agg_inst->agg->data_size, 1, in) != 1)
+            spill_file_truncated(in);
+        agg_data += agg_inst->agg->data_size;
+    }
+
+    return true;
+}
+
+/* which of the SPILL_PARTITIONS files a key goes in, at a level of splitting.
+ * the table uses the low bits of the hash, so start with the high ones. */
+static inline int spill_partition(hash_val_t hkey, int level)
+{
+    return ((uint32_t)hkey >> (32 - SPILL_PARTITION_BITS * (level + 1))) % SPILL_PARTITIONS;
+}
+
+FILE **create_spill_files(void)
+{
+    FILE **files = malloc(sizeof(*files) * SPILL_PARTITIONS);
+    for(int i = 0; i < SPILL_PARTITIONS; i++)
+    {
+        files[i] = tmpfile();
+        if(files[i] == NULL)
+        {
+            fprintf(stderr, "recs-collate: couldn't create spill file: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    return files;
+}
+
+/*
+ * Write every clump out to files (split at level) and empty the table.
+ */
+void spill_table(struct collate_state *state, FILE **files, int level)
+{
+    if(state->small_table)
+        promote_small_table(state);
+
+    hscan_t scan;
+    hash_scan_begin(&scan, state->clump_table);
+    hnode_t *node;
+    while((node = hash_scan_next(&scan)))
+    {
+        struct clump *clump = (struct clump*)node;
+        write_spilled_clump(state, clump, files[spill_partition(clump->hash_node.hash_hkey, level)]);
+
+        hash_scan_delete(state->clump_table, node);
+        release_clump(state, clump);
+        state->stats.spilled_clumps++;
+    }
+
+    if(state->hot_cache)
+        memset(state->hot_cache, 0, sizeof(*state->hot_cache) * (state->hot_cache_mask + 1));
+    state->stats.spills++;
+}
+
+void spill_clumps(struct collate_state *state)
+{
+    if(state->spill_files == NULL)
+        state->spill_files = create_spill_files();
+
+    spill_table(state, state->spill_files, 0);
+
+    state->stats.spilled_bytes = 0;
+    for(int i = 0; i < SPILL_PARTITIONS; i++)
+    {
+        check_spill_file(state->spill_files[i]);
+        state->stats.spilled_bytes += ftell(state->spill_files[i]);
+    }
+}
+
+/* merge another clump's aggregator data into a clump */
+void merge_agg_data(struct collate_state *state, struct clump *clump, char *other_agg_data)
+{
+    flush_runs(state);
+
+    char *agg_data = (char*)&clump->aggregator_data[0];
+    for(int i = 0; i < state->num_agg_instances; i++)
+    {
+        struct agg_instance *agg_inst = &state->agg_instances[i];
+        if(agg_inst->shares >= 0)
+            continue;
+        long before = agg_inst->agg->memory_func ?
+                      agg_inst->agg->memory_func(agg_inst->config_data, agg_data) : 0;
+        agg_inst->agg->merge_func(agg_inst->config_data, agg_data, other_agg_data);
+        if(agg_inst->agg->memory_func)
+            count_bytes(state, agg_kind(agg_inst),
+                        agg_inst->agg->memory_func(agg_inst->config_data, agg_data) - before);
+        agg_data += agg_inst->agg->data_size;
+        other_agg_data += agg_inst->agg->data_size;
+    }
+}
+
+void free_agg_data(struct collate_state *state, char *agg_data)
+{
+    for(int j = 0; j < state->num_agg_instances; j++)
+    {
+        struct agg_instance *agg_inst = &state->agg_instances[j];
+        if(agg_inst->shares >= 0)
+            continue;
+        if(agg_inst->agg->free_func)
+            agg_inst->agg->free_func(agg_inst->config_data, agg_data);
+        agg_data += agg_inst->agg->data_size;
+    }
+}
+
+/*
+ * Read a spill file (that was split at level) back, merging each key's
+ * partial clumps (in the order they were spilled, which is the order their
+ * records came in) and dumping the results.  If the merged clumps outgrow
+ * --memory-limit, they and the rest of the file are split between
+ * SPILL_PARTITIONS more files on the next bits of their hashes, and those
+ * are merged one at a time instead.  Closes f.
+ */
+void merge_spill_file(struct collate_state *state, FILE *f, int level,
+                      char **strs, int *strs_size, char *spilled_agg_data)
+{
+    FILE **split = NULL;
+    rewind(f);
+
+    hash_val_t hkey;
+    while(read_spilled_clump(state, f, &hkey, strs, strs_size, spilled_agg_data))
+    {
+        if(split)
+        {
+            write_spilled(state, hkey, state->tmp_key, spilled_agg_data,
+                          split[spill_partition(hkey, level + 1)]);
+            state->stats.spilled_clumps++;
+        }
+        else
+        {
+            struct clump *clump = find_or_create_clump(state, state->tmp_key, hkey);
+            merge_agg_data(state, clump, spilled_agg_data);
+
+            /* one key on its own can't be split up any further */
+            if(state->clump_bytes > state->memory_limit && level + 1 < SPILL_LEVELS &&
+               clump_count(state) > 1)
+            {
+                split = create_spill_files();
+                spill_table(state, split, level + 1);
+            }
+        }
+        free_agg_data(state, spilled_agg_data);
+    }
+    check_spill_file(f);
+    fclose(f);
+
+    if(split)
+    {
+        for(int i = 0; i < SPILL_PARTITIONS; i++)
+        {
+            check_spill_file(split[i]);
+            merge_spill_file(state, split[i], level + 1, strs, strs_size, spilled_agg_data);
+        }
+        free(split);
+        return;
+    }
+
+    if(state->small_table)
+        promote_small_table(state);
+
+    hscan_t scan;
+    hash_scan_begin(&scan, state->clump_table);
+    hnode_t *node;
+    while((node = hash_scan_next(&scan)))
+    {
+        dump_clump((struct clump*)node, state);
+        hash_scan_delete(state->clump_table, node);
+        release_clump(state, (struct clump*)node);
+    }
+
+    if(state->hot_cache)
+        memset(state->hot_cache, 0, sizeof(*state->hot_cache) * (state->hot_cache_mask + 1));
+}
+
+/* read the spill files back one at a time */
+void merge_spills(struct collate_state *state)
+{
+    int strs_size = 256;
+    char *strs = malloc(strs_size);
+    char *spilled_agg_data = malloc(state->agg_data_size);
+
+    state->merging = true;
+    for(int i = 0; i < SPILL_PARTITIONS; i++)
+        merge_spill_file(state, state->spill_files[i], 0, &strs, &strs_size, spilled_agg_data);
+
+    free(state->spill_files);
+    state->spill_files = NULL;
+    free(spilled_agg_data);
+    free(strs);
+}
+
+/*
+ * With --perfect, the scan only built the finest grouping, so build the
+ * rest from it.  Each grouping is rolled up from whichever finer grouping
+ * we already have (the finest one, or one of the rollups before it) has
+ * the fewest clumps, by merging each of that grouping's clumps into the
+ * clump for its key with the extra fields rolled up.
+ */
+void rollup_groupings(struct collate_state *state)
+{
+    if(state->small_table)
+        promote_small_table(state);
+
+    /* built[0] is the finest grouping, and built[i + 1] is rollups[i] */
+    int num_built = state->num_rollups + 1;
+    struct clump ***built = calloc(num_built, sizeof(*built));
+    long *lens = calloc(num_built, sizeof(*lens));
+
+    built[0] = malloc(sizeof(**built) * (hash_count(state->clump_table) + 1));
+    hscan_t scan;
+    hash_scan_begin(&scan, state->clump_table);
+    hnode_t *node;
+    while((node = hash_scan_next(&scan)))
+        built[0][lens[0]++] = (struct clump*)node;
+
+    for(int i = 1; i < num_built; i++)
+    {
+        uint32_t grouping = state->rollups[i - 1];
+        int parent = 0;
+        for(int j = 1; j < i; j++)
+            if((state->rollups[j - 1] & ~grouping) == 0 && lens[j] < lens[parent])
+                parent = j;
+        uint32_t parent_grouping = parent ? state->rollups[parent - 1] : state->groupings[0];
+        uint32_t rolled = grouping & ~parent_grouping;
+
+        built[i] = malloc(sizeof(**built) * (lens[parent] + 1));
+        for(long k = 0; k < lens[parent]; k++)
+        {
+            struct clump *from = built[parent][k];
+            struct clump_key *key = state->tmp_key;
+            memcpy(key, from->key, state->key_size);
+            key->grouping = grouping;
+            key->int_mask &= ~rolled;
+            for(int j = 0; j < state->num_key_fields; j++)
+                if(rolled & (1u << j))
+                    key->vals[j].s = NULL;
+
+            uint64_t created = state->stats.clumps_created;
+            struct clump *clump = find_or_create_clump(state, key, hash_func(key));
+            if(state->stats.clumps_created != created)
+                built[i][lens[i]++] = clump;
+
+            merge_agg_data(state, clump, (char*)&from->aggregator_data[0]);
+        }
+    }
+
+    if(!state->keep_base)
+    {
+        for(long k = 0; k < lens[0]; k++)
+        {
+            remove_clump(state, built[0][k]);
+            release_clump(state, built[0][k]);
+        }
+    }
+
+    for(int i = 0; i < num_built; i++)
+        free(built[i]);
+    free(built);
+    free(lens);
+}
+
+
+/*
+ * The values a record has in one of its groupings.  A key field whose bit is
+ * set in the grouping's mask is rolled up, and gets the cube default instead
+ * of its real value.  With --cube, the groupings are the numbers 0 --
+ * cube_max as a power set; if we're not grouping, cube_max is 1 and we only
+ * use grouping 0, for which all real values are used.
+ */
+void cube_vals(struct collate_state *state, int cube_index,
+               char *vals[], double dbl_vals[],
+               char *clump_vals[], double dbl_clump_vals[])
+{
+    uint32_t grouping = state->groupings[cube_index];
+    for(int j = 0; j < state->num_interesting_fields; j++)
+    {
+        if(j < state->num_key_fields && (grouping & (1u << j)))
+        {
+            clump_vals[j] = state->cube_default;
+            dbl_clump_vals[j] = NAN;
+        }
+        else
+        {
+            clump_vals[j] = vals[j];
+            dbl_clump_vals[j] = dbl_vals[j];
+        }
+    }
+}
+
+static inline struct clump **clump_tumble_next(struct collate_state *state, struct clump *clump)
+{
+    return (struct clump**)((char*)clump->aggregator_data + state->tumble_data_offset);
+}
+
+/*
+ * --tumble: work out which window a record falls in, and fill in its
+ * window_start key.  Returns false if the record should be dropped, because
+ * it has no time or its window has already been closed.
+ */
+bool assign_window(struct collate_state *state, char *vals[], double dbl_vals[])
+{
+    double time = dbl_vals[state->tumble_field];
+    if(isnan(time))
+    {
+        state->stats.untimed_records++;
+        return false;
+    }
+
+    double start = floor(time / state->tumble_size) * state->tumble_size;
+    if(start + state->tumble_size <= state->watermark)
+    {
+        state->stats.late_records++;
+        return false;
+    }
+
+    if(start == (double)(long long)start)
+        snprintf(state->window_key_buf, sizeof(state->window_key_buf), "%lld", (long long)start);
+    else
+        snprintf(state->window_key_buf, sizeof(state->window_key_buf), "%.17g", start);
+
+    int k = state->window_key_field;
+    vals[k] = state->window_key_buf;
+    dbl_vals[k] = start;
+    state->interesting_fields[k].is_set = true;
+    state->interesting_fields[k].len = strlen(state->window_key_buf);
+    return true;
+}
+
+/* add a new clump to the list for its window, opening the window if need be */
+void tumble_track(struct collate_state *state, struct clump *clump)
+{
+    int k = state->window_key_field;
+    double start = (clump->key->int_mask & (1u << k)) ?
+                   (double)clump->key->vals[k].i : strtod(clump->key->vals[k].s, NULL);
+
+    /* new windows are almost always the latest one */
+    int i = state->open_windows_len;
+    while(i > 0 && state->open_windows[i-1].start > start)
+        i--;
+
+    struct open_window *window;
+    if(i > 0 && state->open_windows[i-1].start == start)
+    {
+        window = &state->open_windows[i-1];
+    }
+    else
+    {
+        RESIZE_ARRAY_IF_NECESSARY(state->open_windows, state->open_windows_size,
+                                  state->open_windows_len+1);
+        window = &state->open_windows[i];
+        memmove(window + 1, window, sizeof(*window) * (state->open_windows_len - i));
+        state->open_windows_len++;
+        window->start = start;
+        window->head = window->tail = NULL;
+    }
+
+    *clump_tumble_next(state, clump) = NULL;
+    if(window->tail)
+        *clump_tumble_next(state, window->tail) = clump;
+    else
+        window->head = clump;
+    window->tail = clump;
+}
+
+/* output all the clumps of the oldest open window, and close it */
+void close_oldest_window(struct collate_state *state)
+{
+    struct clump *clump = state->open_windows[0].head;
+    while(clump)
+    {
+        struct clump *next = *clump_tumble_next(state, clump);
+        if(dump_on_flush(state))
+            dump_clump(clump, state);
+        remove_clump(state, clump);
+        release_clump(state, clump);
+        clump = next;
+    }
+
+    state->open_windows_len--;
+    memmove(&state->open_windows[0], &state->open_windows[1],
+            sizeof(*state->open_windows) * state->open_windows_len);
+    state->stats.windows_closed++;
+}
+
+static inline struct session_data *clump_session(struct collate_state *state, struct clump *clump)
+{
+    return (struct session_data*)((char*)clump->aggregator_data + state->session_data_offset);
+}
+
+/* set a session's timer for the tick its gap runs out in.  the current
+ * tick's slot is run again every time we see a later time, so a session
+ * closes on the first record that's past its gap. */
+void wheel_insert(struct collate_state *state, struct clump *clump)
+{
+    struct session_data *session = clump_session(state, clump);
+    int64_t expire = (int64_t)floor((session->last_time + state->session_gap) / state->session_tick);
+    if(expire < state->wheel_tick)
+        expire = state->wheel_tick;
+
+    int64_t delta = expire - state->wheel_tick;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= ((int64_t)1 << (WHEEL_BITS * (level + 1))))
+        level++;
+
+    /* the top level just has to wrap around until the timer gets close */
+    int64_t max_delta = ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if(delta > max_delta)
+        expire = state->wheel_tick + max_delta;
+
+    struct clump **slot = &state->wheel[level][(expire >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    session->next = *slot;
+    *slot = clump;
+    state->wheel_len++;
+}
+
+/* a new clump is a new session */
+void session_track(struct collate_state *state, struct clump *clump)
+{
+    clump_session(state, clump)->last_time = state->record_time;
+    wheel_insert(state, clump);
+}
+
+/* a record was added to a session */
+static inline void session_touch(struct collate_state *state, struct clump *clump)
+{
+    struct session_data *session = clump_session(state, clump);
+    if(state->record_time > session->last_time)
+        session->last_time = state->record_time;
+}
+
+/* take the timers out of a slot, and close their sessions or set them again */
+void wheel_run_slot(struct collate_state *state, int level, int index, bool fire)
+{
+    struct clump *clump = state->wheel[level][index];
+    state->wheel[level][index] = NULL;
+
+    while(clump)
+    {
+        struct clump *next = clump_session(state, clump)->next;
+        state->wheel_len--;
+
+        if(fire && state->session_now - clump_session(state, clump)->last_time > state->session_gap)
+        {
+            if(dump_on_flush(state))
+                dump_clump(clump, state);
+            remove_clump(state, clump);
+            release_clump(state, clump);
+            state->stats.sessions_closed++;
+        }
+        else
+        {
+            wheel_insert(state, clump);
+        }
+
+        clump = next;
+    }
+}
+
+/*
+ * We've seen a record from <time>: move the wheel up to it, closing the
+ * sessions that have gone more than the gap without a record.
+ */
+void advance_sessions(struct collate_state *state, double time)
+{
+    if(time <= state->session_now)
+        return;
+    state->session_now = time;
+
+    int64_t target = (int64_t)floor(time / state->session_tick);
+    if(state->wheel_len == 0 || state->wheel_tick == INT64_MIN)
+    {
+        state->wheel_tick = target;
+        return;
+    }
+
+    while(true)
+    {
+        wheel_run_slot(state, 0, state->wheel_tick & (WHEEL_SLOTS - 1), true);
+        if(state->wheel_tick == target)
+            break;
+
+        if(state->wheel_len == 0)
+        {
+            state->wheel_tick = target;
+            break;
+        }
+
+        int64_t tick = ++state->wheel_tick;
+
+        /* when a level wraps around, spread the next slot of the level
+         * above it back out over the levels below */
+        for(int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            if((tick & (((int64_t)1 << (WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            wheel_run_slot(state, level, (tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1), false);
+        }
+    }
+}
+
+void flush_batch(struct collate_state *state);
+
+/* we've seen a record from <time>: close any windows that are now complete */
+void advance_watermark(struct collate_state *state, double time)
+{
+    if(time - state->allowed_lateness <= state->watermark)
+        return;
+    state->watermark = time - state->allowed_lateness;
+
+    while(state->open_windows_len > 0 &&
+          state->open_windows[0].start + state->tumble_size <= state->watermark)
+    {
+        /* batched records may belong in this window */
+        if(state->batch_len > 0)
+            flush_batch(state);
+        close_oldest_window(state);
+    }
+}
+
+/*
+ * Add one record to the clump it belongs in for cube index i, and remember
+ * that clump in the memo.  If the caller has already hashed the keys, it
+ * passes them in hkeys (one per cube index).
+ */
+void add_record_at(struct collate_state *state, int i, char *vals[], double dbl_vals[],
+                   hash_val_t *hkeys)
+{
+    char *clump_vals[state->num_interesting_fields];
+    double dbl_clump_vals[state->num_interesting_fields];
+
+    cube_vals(state, i, vals, dbl_vals, clump_vals, dbl_clump_vals);
+
+    if(state->sample_hll)
+        sample_key(state, clump_vals);
+
+    make_key(state, clump_vals, state->groupings[i], state->tmp_key);
+    hash_val_t hkey = hkeys ? hkeys[i] : hash_func(state->tmp_key);
+
+    /* it goes in the memo before it's added to, since adding to it can put
+     * us over --max-memory and evict it, and then release_clump takes it
+     * back out */
+    state->memo_clumps[i] = find_or_create_clump(state, state->tmp_key, hkey);
+    add_to_clump(state, state->memo_clumps[i], clump_vals, dbl_clump_vals);
+}
+
+/* add one record to all the clumps it belongs in */
+void add_record(struct collate_state *state, char *vals[], double dbl_vals[],
+                hash_val_t *hkeys)
+{
+    for(int i = 0; i < state->cube_max; i++)
+        add_record_at(state, i, vals, dbl_vals, hkeys);
+}
+
+/*
+ * Returns the index of the first key field whose text differs from the last
+ * record's (which starts at *memo_offset in memo_strs), or num_key_fields if
+ * the key text is all the same.  The record's values are still in the
+ * parser's buffer, so the spans tell us their lengths.
+ */
+int memo_key_change(struct collate_state *state, char *vals[], int *memo_offset)
+{
+    int offset = 0;
+    int i;
+    for(i = 0; i < state->num_key_fields; i++)
+    {
+        struct str_ref *field = &state->interesting_fields[i];
+        int len = field->is_set ? field->len : -1;
+        if(len != state->memo_lens[i])
+            break;
+        if(len > 0 && memcmp(vals[i], state->memo_strs + offset, len) != 0)
+            break;
+        if(len >= 0)
+            offset += len + 1;
+    }
+
+    *memo_offset = offset;
+    return i;
+}
+
+/* remember this record's key text (NUL-terminated) in the memo */
+void remember_key(struct collate_state *state, char *vals[])
+{
+    int offset = 0;
+    for(int i = 0; i < state->num_key_fields; i++)
+    {
+        struct str_ref *field = &state->interesting_fields[i];
+        state->memo_lens[i] = field->is_set ? field->len : -1;
+        if(field->is_set)
+        {
+            RESIZE_ARRAY_IF_NECESSARY(state->memo_strs, state->memo_strs_size,
+                                      offset + field->len + 1);
+            memcpy(state->memo_strs + offset, vals[i], field->len);
+            offset += field->len;
+            state->memo_strs[offset++] = '\0';
+        }
+    }
+    state->memo_have_key = true;
+}
+
+/*
+ * Does this record have exactly the same key text as the last one?  If not,
+ * remember its key.
+ */
+bool same_key_as_memo(struct collate_state *state, char *vals[])
+{
+    int offset;
+    if(state->memo_have_key && memo_key_change(state, vals, &offset) == state->num_key_fields)
+        return true;
+
+    remember_key(state, vals);
+    return false;
+}
+
+/*
+ * Input is often sorted or clustered (eg. logs in time order for each host),
+ * so a record very often has the same key as the one before it.  When it
+ * does, we can skip making and hashing the keys and looking them up.
+ */
+void add_record_memo(struct collate_state *state, char *vals[], double dbl_vals[])
+{
+    bool hit = same_key_as_memo(state, vals);
+    for(int i = 0; hit && i < state->cube_max; i++)
+        if(state->memo_clumps[i] == NULL)
+            hit = false;
+
+    if(!hit)
+    {
+        add_record(state, vals, dbl_vals, NULL);
+        return;
+    }
+
+    state->stats.memo_hits++;
+    for(int i = 0; i < state->cube_max; i++)
+    {
+        char *clump_vals[state->num_interesting_fields];
+        double dbl_clump_vals[state->num_interesting_fields];
+
+        /* adding to one clump can evict another (with --max-memory), and
+         * then this record has to go in it the usual way */
+        struct clump *clump = state->memo_clumps[i];
+        if(clump == NULL)
+        {
+            add_record_at(state, i, vals, dbl_vals, NULL);
+            continue;
+        }
+
+        cube_vals(state, i, vals, dbl_vals, clump_vals, dbl_clump_vals);
+        if(state->sketch)
+            cm_add(state->sketch, clump->hash_node.hash_hkey);
+        touch_clump(state, clump);
+        add_to_clump(state, clump, clump_vals, dbl_clump_vals);
+    }
+}
+
+/*
+ * --adjacent: there's only ever one clump, and a record either goes in it or
+ * replaces it, so we don't need a table at all.
+ */
+void add_record_adjacent(struct collate_state *state, char *vals[], double dbl_vals[])
+{
+    struct clump *clump = state->adjacent_clump;
+    if(clump && same_key_as_memo(state, vals))
+    {
+        state->stats.memo_hits++;
+    }
+    else
+    {
+        if(clump)
+        {
+            if(dump_on_flush(state))
+                dump_clump(clump, state);
+            state->stats.evictions++;
+            release_clump(state, clump);
+        }
+        else
+        {
+            same_key_as_memo(state, vals);
+        }
+
+        make_key(state, vals, 0, state->tmp_key);
+        clump = state->adjacent_clump = new_clump(state);
+        init_clump(state, clump, state->tmp_key);
+    }
+
+    add_to_clump(state, clump, vals, dbl_vals);
+}
+
+/*
+ * How --verify-sorted expects key values to be ordered: missing values
+ * first, then byte by byte as strings, the way recs-sort sorts by default.
+ * (Comparing numbers by value when both values are numbers wouldn't be a
+ * consistent order: "10" < "9" < "9a" < "10".)
+ */
+static int compare_key_text(const char *a, const char *b)
+{
+    if(a == NULL || b == NULL)
+        return (a != NULL) - (b != NULL);
+
+    return strcmp(a, b);
+}
+
+/*
+ * The rollup level of a grouping: how many key fields it keeps, if they're
+ * the first ones, or -1 if they aren't.
+ */
+static inline int sorted_level(struct collate_state *state, uint32_t grouping)
+{
+    uint32_t all = state->num_key_fields < 32 ? (1u << state->num_key_fields) - 1 : UINT32_MAX;
+    uint32_t kept = all & ~grouping;
+    if((kept & (kept + 1)) != 0)
+        return -1;
+    return __builtin_popcount(kept);
+}
+
+/* dump the running clumps of every rollup level finer than <level> */
+void close_sorted_levels(struct collate_state *state, int level)
+{
+    for(int i = state->num_key_fields; i > level; i--)
+    {
+        struct clump *clump = state->sorted_clumps[i];
+        if(clump == NULL)
+            continue;
+
+        if(dump_on_flush(state))
+            dump_clump(clump, state);
+        release_clump(state, clump);
+        state->sorted_clumps[i] = NULL;
+    }
+}
+
+/*
+ * --assume-sorted: the input is sorted by the key fields, so a group is done
+ * as soon as the key changes, and there's exactly one running clump.  With
+ * groupings, each rollup level (the key fields up to some point, with the
+ * rest rolled up) also has one running clump, which is done when one of the
+ * fields it keeps changes.  The other groupings aren't contiguous in sorted
+ * input, so they go through the clump table as usual.
+ */
+void add_record_sorted(struct collate_state *state, char *vals[], double dbl_vals[])
+{
+    int n = state->num_key_fields;
+    int memo_offset;
+    int changed = state->memo_have_key ? memo_key_change(state, vals, &memo_offset) : 0;
+
+    if(changed < n)
+    {
+        if(state->verify_sorted && state->memo_have_key &&
+           compare_key_text(vals[changed], state->memo_lens[changed] < 0 ? NULL :
+                            state->memo_strs + memo_offset) < 0)
+        {
+            fprintf(stderr, "recs-collate: input isn't sorted by '%s': record %llu "
+                    "comes after a record with a greater key\n",
+                    state->interesting_field_names[changed],
+                    (unsigned long long)state->stats.records + 1);
+            exit(1);
+        }
+
+        close_sorted_levels(state, changed);
+        remember_key(state, vals);
+    }
+
+    char *clump_vals[state->num_interesting_fields];
+    double dbl_clump_vals[state->num_interesting_fields];
+
+    for(int i = 0; i < state->cube_max; i++)
+    {
+        uint32_t grouping = state->groupings[i];
+        cube_vals(state, i, vals, dbl_vals, clump_vals, dbl_clump_vals);
+        make_key(state, clump_vals, grouping, state->tmp_key);
+
+        int level = sorted_level(state, grouping);
+        if(level < 0)
+        {
+            find_and_add_to_clump(state, state->tmp_key, clump_vals, dbl_clump_vals,
+                                  hash_func(state->tmp_key));
+            continue;
+        }
+
+        struct clump *clump = state->sorted_clumps[level];
+        if(clump == NULL)
+        {
+            clump = state->sorted_clumps[level] = new_clump(state);
+            init_clump(state, clump, state->tmp_key);
+        }
+        add_to_clump(state, clump, clump_vals, dbl_clump_vals);
+    }
+}
+
+/*
+ * Run the batched records through the clumps.  By the time we get here every
+ * record's key has been hashed and its table slot prefetched, so first we
+ * prefetch the clumps that those slots point to (and the aggregator data that
+ * follows the clump header), and only then do we do the updates, in the same
+ * order as the records came in.  The prefetches are just hints: an earlier
+ * record in the batch may evict or create the clump a later one wants, and
+ * the lookup in add_record() sorts that out as usual.
+ */
+void flush_batch(struct collate_state *state)
+{
+    int n = state->num_interesting_fields;
+
+    for(int i = 0; i < state->batch_len * state->cube_max; i++)
+    {
+        hnode_t *node = hash_chain_head(state->clump_table, state->batch_hkeys[i]);
+        if(node)
+        {
+            __builtin_prefetch(node);
+            __builtin_prefetch(((struct clump*)node)->aggregator_data);
+        }
+    }
+
+    for(int i = 0; i < state->batch_len; i++)
+    {
+        state->run_slot = 0;
+        char *vals[n+1];
+        for(int j = 0; j < n; j++)
         {
-            struct str_ref *field = &state->interesting_fields[i];
-            if(field->is_set)
-                buf[field->offset+field->len] = '\0';
+            int offset = state->batch_offsets[i * n + j];
+            vals[j] = offset == -1 ? NULL : state->batch_strs + offset;
         }
+        vals[n] = NULL;
 
-        /* first pack the interesting values into a table of char** */
+        add_record(state, vals, &state->batch_dbl_vals[i * n],
+                   &state->batch_hkeys[i * state->cube_max]);
+    }
 
-        char *vals[state->num_interesting_fields+1];
+    state->batch_len = 0;
+    state->batch_strs_len = 0;
+}
 
-        for(int i = 0; i < state->num_interesting_fields; i++)
+/*
+ * Copy a record into the batch (its values live in the parser's buffer, which
+ * won't survive until the batch is flushed), hash its keys and start pulling
+ * in the table slots they hash to.
+ */
+void batch_record(struct collate_state *state, char *vals[], double dbl_vals[])
+{
+    int n = state->num_interesting_fields;
+    int *offsets = &state->batch_offsets[state->batch_len * n];
+
+    for(int j = 0; j < n; j++)
+    {
+        if(vals[j])
         {
-            struct str_ref *field = &state->interesting_fields[i];
-            if(field->is_set)
-                vals[i] = buf + field->offset;
-            else
-                vals[i] = NULL;
+            int len = strlen(vals[j]) + 1;
+            RESIZE_ARRAY_IF_NECESSARY(state->batch_strs, state->batch_strs_size,
+                                      state->batch_strs_len + len);
+            memcpy(state->batch_strs + state->batch_strs_len, vals[j], len);
+            offsets[j] = state->batch_strs_len;
+            state->batch_strs_len += len;
+        }
+        else
+        {
+            offsets[j] = -1;
         }
-        vals[state->num_interesting_fields] = NULL;
+    }
+    memcpy(&state->batch_dbl_vals[state->batch_len * n], dbl_vals, sizeof(*dbl_vals) * n);
 
-        /* now try to convert each value into a double, for aggregators that want that.
-         * values that have no numeric data are represented as NAN */
+    hash_val_t *hkeys = &state->batch_hkeys[state->batch_len * state->cube_max];
+    for(int i = 0; i < state->cube_max; i++)
+    {
+        char *clump_vals[n];
+        double dbl_clump_vals[n];
 
-        double dbl_vals[state->num_interesting_fields];
+        cube_vals(state, i, vals, dbl_vals, clump_vals, dbl_clump_vals);
+        make_key(state, clump_vals, state->groupings[i], state->tmp_key);
+        hkeys[i] = hash_func(state->tmp_key);
+        __builtin_prefetch(&hash_chain_head(state->clump_table, hkeys[i]));
+    }
 
-        for(int i = 0; i < state->num_interesting_fields; i++)
+    if(++state->batch_len == state->batch_size)
+        flush_batch(state);
+}
+
+/*
+ * Find or create the bucket for a record whose values have been
+ * NULL-terminated in buf, and let each aggregator instance aggregate.
+ */
+static void collate_record(struct collate_state *state, struct parse_state *parse_state, char *buf)
+{
+    /* first pack the interesting values into a table of char** */
+
+    char *vals[state->num_interesting_fields+1];
+
+    state->any_literals = false;
+    for(int i = 0; i < state->num_interesting_fields; i++)
+    {
+        struct str_ref *field = &state->interesting_fields[i];
+        if(field->is_set)
+            vals[i] = buf + field->offset;
+        else
+            vals[i] = NULL;
+
+        /* true, false, null, objects and arrays are only there (as their
+         * JSON text) for the aggregators that want them; a key that's one
+         * of those is missing, as it always was */
+        state->literal_vals[i] = false;
+        if(records_wanted && vals[i] && strchr("tfn{[", vals[i][0]) && vals[i][-1] != '"')
         {
-            if(vals[i])
+            if(i < state->num_key_fields)
             {
-                char *endp;
-                dbl_vals[i] = strtod(vals[i], &endp);
-                if(vals[i] == endp)
-                    dbl_vals[i] = NAN;
+                vals[i] = NULL;
+                field->is_set = false;
             }
             else
+            {
+                state->literal_vals[i] = true;
+                state->any_literals = true;
+            }
+        }
+    }
+    vals[state->num_interesting_fields] = NULL;
+
+    /* now try to convert each value into a double, for aggregators that want that.
+     * values that have no numeric data are represented as NAN */
+
+    double dbl_vals[state->num_interesting_fields];
+
+    for(int i = 0; i < state->num_interesting_fields; i++)
+    {
+        if(vals[i])
+        {
+            char *endp;
+            dbl_vals[i] = strtod(vals[i], &endp);
+            if(vals[i] == endp)
                 dbl_vals[i] = NAN;
         }
+        else
+            dbl_vals[i] = NAN;
+    }
+
+    if(state->tumble_size > 0 && !assign_window(state, vals, dbl_vals))
+    {
+        state->stats.records++;
+        return;
+    }
+
+    if(state->session_gap > 0)
+    {
+        state->record_time = dbl_vals[state->session_field];
+        if(isnan(state->record_time))
+        {
+            state->stats.untimed_records++;
+            state->stats.records++;
+            return;
+        }
+        advance_sessions(state, state->record_time);
+    }
 
-        /* to support cubing, we use the binary representation of the numbers 0 -- cube_max
-         * as a power set.  if a bit is 0, then the real value is used.  if a bit is 1,
-         * the cube default is used.  if we're not cubing, cube_max is 1 and we only use
-         * 0: the value for which all real values are used. */
-        for(int i = 0; i < state->cube_max; i++)
+    state->run_slot = 0;
+    if(state->assume_sorted)
+        add_record_sorted(state, vals, dbl_vals);
+    else if(state->max_clumps == 1 && state->cube_max == 1)
+        add_record_adjacent(state, vals, dbl_vals);
+    else if(state->batch_size > 1)
+        batch_record(state, vals, dbl_vals);
+    else
+        add_record_memo(state, vals, dbl_vals);
+
+    state->stats.records++;
+
+    if(state->tumble_size > 0)
+        advance_watermark(state, dbl_vals[state->tumble_field]);
+
+    if(state->stats.records == KEY_TYPE_SAMPLE_RECORDS)
+        settle_key_types(state);
+
+    if(state->sample_hll)
+    {
+        long bytes = state->input_bytes + parse_state->offset;
+        if(state->sample_half_bytes == 0 && bytes >= GROUP_SAMPLE_BYTES / 2)
+        {
+            state->sample_half_bytes = bytes;
+            state->sample_half_estimate = hll_estimate(state->sample_hll);
+        }
+        else if(bytes >= GROUP_SAMPLE_BYTES)
         {
-            char *clump_vals[state->num_interesting_fields];
-            double dbl_clump_vals[state->num_interesting_fields];
+            finish_sampling(state, bytes, false);
+        }
+    }
+}
 
-            for(int j = 0; j < state->num_interesting_fields; j++)
+/*
+ * This callback is called at the end of each object.  If the object that's ending
+ * is the top-level object, this is where we do the work of finding or creating
+ * the bucket for this record and letting each aggregator instance aggregate.
+ */
+void object_callback(struct parse_state *parse_state, void *_state)
+{
+    struct collate_state *state = _state;
+    if(parse_state->parse_stack_length == 1) // object
+    {
+        /* NULL-terminate all values, keeping what the NULLs overwrite so that
+         * the record's text can be put back together (for the aggregators
+         * that keep it, and for the next --query to see) */
+        char *buf = (char*)parse_state->buffer->buf - parse_state->buffer->base_offset;
+        int cuts[state->num_interesting_fields];
+        char cut_chars[state->num_interesting_fields];
+        int num_cuts = 0;
+        int start = parse_state->parse_stack[0].start_offset;
+        for(int i = 0; i < state->num_interesting_fields; i++)
+        {
+            struct str_ref *field = &state->interesting_fields[i];
+            if(field->is_set)
             {
-                if((1 << j) & i)
-                {
-                    clump_vals[j] = state->cube_default;
-                    dbl_clump_vals[j] = NAN;
-                }
-                else
-                {
-                    clump_vals[j] = vals[j];
-                    dbl_clump_vals[j] = dbl_vals[j];
-                }
+                cuts[num_cuts] = field->offset + field->len - start;
+                cut_chars[num_cuts++] = buf[field->offset+field->len];
+                buf[field->offset+field->len] = '\0';
             }
+        }
+
+        if(records_wanted)
+        {
+            current_record.number = state->stats.records;
+            current_record.text = buf + start;
+            current_record.len = parse_state->offset - start;
+            current_record.num_cuts = num_cuts;
+            current_record.cuts = cuts;
+            current_record.cut_chars = cut_chars;
+        }
+
+        collate_record(state, parse_state, buf);
+
+        for(int i = 0; i < num_cuts; i++)
+            buf[start + cuts[i]] = cut_chars[i];
+    }
+}
+
+void print_stats(struct collate_state *state)
+{
+    struct collate_stats *stats = &state->stats;
+    fprintf(stderr, "recs-collate: records:           %llu\n", (unsigned long long)stats->records);
+    fprintf(stderr, "recs-collate: clumps created:    %llu\n", (unsigned long long)stats->clumps_created);
+    fprintf(stderr, "recs-collate: clumps evicted:    %llu\n", (unsigned long long)stats->evictions);
+    if(stats->memo_hits > 0)
+        fprintf(stderr, "recs-collate: same key as last:  %llu records\n",
+                (unsigned long long)stats->memo_hits);
+    if(stats->windows_closed > 0)
+        fprintf(stderr, "recs-collate: windows closed:    %llu\n",
+                (unsigned long long)stats->windows_closed);
+    if(stats->sessions_closed > 0)
+        fprintf(stderr, "recs-collate: sessions closed:   %llu\n",
+                (unsigned long long)stats->sessions_closed);
+    if(stats->late_records + stats->untimed_records > 0)
+        fprintf(stderr, "recs-collate: records dropped:   %llu late, %llu with no time\n",
+                (unsigned long long)stats->late_records,
+                (unsigned long long)stats->untimed_records);
+    if(stats->tinylfu_admitted + stats->tinylfu_rejected > 0)
+        fprintf(stderr, "recs-collate: tinylfu admitted:  %llu (rejected %llu)\n",
+                (unsigned long long)stats->tinylfu_admitted,
+                (unsigned long long)stats->tinylfu_rejected);
+    if(stats->hot_cache_lookups > 0)
+        fprintf(stderr, "recs-collate: hot cache hits:    %llu of %llu (%.1f%%)\n",
+                (unsigned long long)stats->hot_cache_hits,
+                (unsigned long long)stats->hot_cache_lookups,
+                100.0 * stats->hot_cache_hits / stats->hot_cache_lookups);
+    fprintf(stderr, "recs-collate: memory:            %ld bytes (peak %ld)\n",
+            state->clump_bytes, state->peak_clump_bytes);
+    for(int i = 0; i <= state->num_aggregator_types; i++)
+    {
+        if(state->peak_mem_bytes[i] == 0)
+            continue;
+
+        char label[32];
+        snprintf(label, sizeof(label), "%s:",
+                 i < state->num_aggregator_types ? aggregators[i].shortname : "clumps");
+        fprintf(stderr, "recs-collate:   %-17s%ld bytes (peak %ld)\n",
+                label, state->mem_bytes[i], state->peak_mem_bytes[i]);
+    }
+    if(state->auto_size)
+    {
+        fprintf(stderr, "recs-collate: auto size:         %d clumps (grew %llu times, shrank %llu times)\n",
+                state->max_clumps, (unsigned long long)stats->size_grows,
+                (unsigned long long)stats->size_shrinks);
+        fprintf(stderr, "recs-collate: keys re-created:   %llu of %llu evicted\n",
+                (unsigned long long)stats->recreated, (unsigned long long)stats->evictions);
 
-            find_and_add_to_clump(state, clump_vals, dbl_clump_vals);
+        uint64_t changes = stats->size_grows + stats->size_shrinks;
+        uint64_t first = changes > AUTO_SIZE_LOG_LEN ? changes - AUTO_SIZE_LOG_LEN : 0;
+        for(uint64_t i = first; i < changes; i++)
+        {
+            struct size_change *change = &state->size_log[i % AUTO_SIZE_LOG_LEN];
+            fprintf(stderr, "recs-collate:   record %llu: %d -> %d clumps (%.1f%% re-created)\n",
+                    (unsigned long long)change->records, change->from, change->to,
+                    100.0 * change->recreate_rate);
         }
     }
+    if(stats->spills > 0)
+        fprintf(stderr, "recs-collate: spills:            %llu (%llu clumps, %ld bytes)\n",
+                (unsigned long long)stats->spills,
+                (unsigned long long)stats->spilled_clumps, stats->spilled_bytes);
+    if(stats->estimated_groups > 0)
+    {
+        if(stats->sampled_bytes > 0)
+            fprintf(stderr, "recs-collate: expected groups:   %.0f (estimated from the first %ld bytes)\n",
+                    stats->estimated_groups, stats->sampled_bytes);
+        else
+            fprintf(stderr, "recs-collate: expected groups:   %.0f (from --expected-groups)\n",
+                    stats->estimated_groups);
+    }
 }
 
 void init_parser(struct parse_state *state, struct grammar **g, FILE *input)
@@ -438,16 +2951,77 @@ char usage[] =
 "   Collate records of input (or records from <files>) into output records.\n"
 "\n"
 "Arguments:\n"
-"   --key|-k <keys>               Comma separated list of key fields.\n"
+"   --key|-k <keys>               Comma separated list of key fields.  A key field\n"
+"                                 written as <field>:int or <field>:str is stored as\n"
+"                                 an integer or a string; by default, fields whose\n"
+"                                 values look like integers are stored as integers.\n"
+"                                 There can be up to 32 key fields.\n"
 "   --aggregator|-a <aggregators> Colon separated list of aggregate field specifiers.\n"
 "                                 See \"Aggregates\" section below.\n"
 "   --size|--sz|-n <number>       Number of running clumps to keep (default is 1).\n"
+"   --size auto[:<max-memory>]    Start with 1024 running clumps, and keep adjusting\n"
+"                                 that as we go: more when keys that were purged\n"
+"                                 keep coming back, fewer when they don't, without\n"
+"                                 going over <max-memory> (or --max-memory, or 75%\n"
+"                                 of our cgroup's memory limit, or 256M).\n"
 "   --adjacent|-a|-1              Keep exactly one running clump.\n"
 "   --perfect                     Never purge clumps until the end.\n"
+"   --assume-sorted               The input is sorted by the key fields, so output\n"
+"                                 each group as soon as the key changes, and keep\n"
+"                                 just one running clump (one per rollup level with\n"
+"                                 --cube; the rest of the cube is kept until the end).\n"
+"   --verify-sorted               Like --assume-sorted, but fail if the keys aren't\n"
+"                                 in order as strings (recs-sort's default order).\n"
+"   --max-memory <size>|auto      Purge clumps when they take up more than <size>\n"
+"                                 bytes (a suffix of K, M or G is ok) rather than\n"
+"                                 when there are too many of them.  With \"auto\",\n"
+"                                 use 75% of our cgroup's memory limit.\n"
+"   --memory-limit <size>         With --perfect, when the clumps take up more than\n"
+"                                 about <size> bytes (a suffix of K, M or G is ok),\n"
+"                                 write them out to temporary files and merge them\n"
+"                                 back together at the end.\n"
+"   --eviction lru|clock|tinylfu  How to pick the clump to purge when we run out of\n"
+"                                 room.  lru (the default) purges the least recently\n"
+"                                 used one.  clock approximates that more cheaply,\n"
+"                                 and purges a batch of clumps at a time.  tinylfu\n"
+"                                 keeps new keys in a small window, and only lets them\n"
+"                                 push out an older clump if they're seen more often.\n"
 "   --cube                        See \"Cubing\" section below.\n"
 "   --cube-default                See \"Cubing\" section below.\n"
+"   --rollup <keys>               See \"Cubing\" section below.\n"
+"   --grouping-sets <sets>        See \"Cubing\" section below.\n"
+"   --window <n>                  Output a record every time an input record is added\n"
+"                                 to a clump that has seen at least <n> records, with\n"
+"                                 the aggregates of just the last <n> of them.\n"
+"   --window-field <field>        The field holding each record's time, in seconds.\n"
+"   --tumble <duration>           Also group records by which <duration> long window\n"
+"                                 (like 60s, 5m or 1h) of --window-field they're in,\n"
+"                                 as the window_start field (so no key, input field\n"
+"                                 or aggregator can be called that).  All of a window's\n"
+"                                 records are output once it's complete: when we've\n"
+"                                 seen a time later than its end plus the allowed\n"
+"                                 lateness.  Records for complete windows are dropped.\n"
+"   --allowed-lateness <duration> How far out of order times can be (default 0).\n"
+"   --session-field <field>       The field holding each record's time, in seconds.\n"
+"   --session-gap <duration>      Each key's clump is a session, which is output once\n"
+"                                 we see a time more than <duration> after its last\n"
+"                                 record.  A later record with that key starts a new\n"
+"                                 session.\n"
 "   --incremental                 Output a record every time an input record is added\n"
 "                                 to a clump (instead of every time a clump is flushed).\n"
+"   --expected-groups <n>|auto    Size the clump table for about <n> groups up front.\n"
+"                                 With \"auto\", guess <n> from the first few MB of input.\n"
+"   --hot-cache <n>               Number of entries in the cache of recently used clumps\n"
+"                                 (a power of two, default 256; 0 turns it off).\n"
+"   --batch <n>                   Hash the keys of <n> records at a time and prefetch\n"
+"                                 their clumps before adding them.  Helps with big tables.\n"
+"   --stats                       Print statistics about the run to stderr at the end.\n"
+"   --output <file>               Write the output records to <file> instead of stdout.\n"
+"   --query '<args>'              Run several collations over one pass of the input:\n"
+"                                 each --query is a quoted set of the arguments\n"
+"                                 above, with its own keys, aggregators and clumps,\n"
+"                                 and the --output right after it (if any) is where\n"
+"                                 its records go.  Input files go outside --query.\n"
 "\n"
 "Help / Usage Options:\n"
 "   --help                         Bail and output this help screen.\n"
@@ -459,6 +3033,14 @@ char usage[] =
 "   default field name is aggregator and arguments joined by underscores.  See\n"
 "   --list-aggregators for a list of available aggregators.\n"
 "\n"
+"   Values that are true, false, null, objects or arrays are treated as missing,\n"
+"   except by first, last, array and valuestokeys, which keep them as they were\n"
+"   written, and countby, uarray and uconcatenate, which read them (and numbers)\n"
+"   as JavaScript's String() would write them, as recs-collate's JavaScript\n"
+"   aggregators do.  (So 1 and 1.0 are the same value to those, an object is\n"
+"   [object Object], and null is still missing for all of them but last and\n"
+"   array.)  None of these can be used with --batch.\n"
+"\n"
 "Cubing:\n"
 "   Instead of added one entry for each input record, we add 2 ** (number of key\n"
 "   fields), with every possible combination of fields replaced with the default\n"
@@ -467,6 +3049,17 @@ char usage[] =
 "   then we'd get output records for {x = 1, y = 2}, {x = 1, y = ALL}, {x = ALL,\n"
 "   y = 2} and {x = ALL, y = ALL}.\n"
 "\n"
+"   --rollup and --grouping-sets ask for just some of those combinations, and\n"
+"   their fields are added to the key fields.  --rollup x,y,z gives subtotals\n"
+"   for each level: {x, y, z}, {x, y}, {x} and {}.  --grouping-sets 'x,y;x;()'\n"
+"   gives exactly the sets listed, separated by semicolons.  Key fields given\n"
+"   with --key are kept in every grouping.\n"
+"\n"
+"   With --perfect, records only go into the finest grouping, and the rest are\n"
+"   built from it at the end by merging their aggregates (unless there's an\n"
+"   aggregator whose result depends on the order of its values, like concatenate,\n"
+"   array, records, countby or valuestokeys).\n"
+"\n"
 "Examples:\n"
 "   Count clumps of adjacent lines with matching x fields.\n"
 "      recs-collate --adjacent --key x --aggregator count\n"
@@ -479,6 +3072,78 @@ char usage[] =
 "   Produce record count for each date, hour pair\n"
 "      recs-collate --key date,hour --perfect --aggregator count\n";
 
+/* parse a number of bytes like "512M", returning -1 if it isn't one */
+long parse_size(char *str)
+{
+    char *endp;
+    double size = strtod(str, &endp);
+    if(endp == str || size < 0)
+        return -1;
+
+    switch(*endp)
+    {
+        case 'k': case 'K': size *= 1024; endp++; break;
+        case 'm': case 'M': size *= 1024 * 1024; endp++; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024; endp++; break;
+        case 't': case 'T': size *= 1024.0 * 1024 * 1024 * 1024; endp++; break;
+    }
+
+    if(*endp == 'b' || *endp == 'B') endp++;
+    return *endp ? -1 : (long)size;
+}
+
+/* the memory limit of the cgroup we're in, or -1 if there isn't one */
+long cgroup_memory_limit(void)
+{
+    const char *paths[] = {
+        "/sys/fs/cgroup/memory.max",                    /* cgroup v2 */
+        "/sys/fs/cgroup/memory/memory.limit_in_bytes",  /* cgroup v1 */
+        NULL
+    };
+
+    for(int i = 0; paths[i]; i++)
+    {
+        FILE *f = fopen(paths[i], "r");
+        if(f == NULL)
+            continue;
+
+        char buf[64];
+        long long limit = -1;
+        if(fgets(buf, sizeof(buf), f))
+        {
+            /* "max" (v2) or a huge number (v1) means no limit */
+            char *endp;
+            limit = strtoll(buf, &endp, 10);
+            if(endp == buf || limit >= (1LL << 60))
+                limit = -1;
+        }
+        fclose(f);
+
+        if(limit > 0)
+            return limit;
+    }
+
+    return -1;
+}
+
+/* parse a duration like "90s", "5m", "1.5h" or "2d" into seconds (a plain
+ * number is seconds), returning -1 if it isn't one */
+double parse_duration(char *str)
+{
+    char *endp;
+    double secs = strtod(str, &endp);
+    if(endp == str || secs < 0)
+        return -1;
+
+    if(strcmp(endp, "ms") == 0)     secs /= 1000;
+    else if(strcmp(endp, "m") == 0) secs *= 60;
+    else if(strcmp(endp, "h") == 0) secs *= 60 * 60;
+    else if(strcmp(endp, "d") == 0) secs *= 60 * 60 * 24;
+    else if(strcmp(endp, "s") != 0 && *endp != '\0') return -1;
+
+    return secs;
+}
+
 void usage_err(char *fmt, ...)
 {
     va_list args;
@@ -489,7 +3154,7 @@ void usage_err(char *fmt, ...)
     va_end(args);
 
     fprintf(stderr, "\n");
-    fprintf(stderr, usage);
+    fputs(usage, stderr);
     exit(1);
 }
 
@@ -497,6 +3162,7 @@ struct interesting_field
 {
     char *name;
     bool is_key;
+    enum key_type key_type;
 } *fields;
 
 int fields_len = 0, fields_size = 6;
@@ -515,9 +3181,45 @@ int add_interesting_field(char *str, bool is_key)
     struct interesting_field *new_field = &fields[fields_len++];
     new_field->name = strdup(str);
     new_field->is_key = is_key;
+    new_field->key_type = KEY_AUTO;
     return fields_len-1;
 }
 
+/* field names in --rollup and --grouping-sets are separated by these */
+#define GROUPING_DELIMS ",;() \t"
+
+/* make every field named in a --rollup or --grouping-sets list a key field */
+void add_grouping_fields(char *list)
+{
+    char *copy = strdup(list);
+    for(char *name = strtok(copy, GROUPING_DELIMS); name; name = strtok(NULL, GROUPING_DELIMS))
+        add_interesting_field(name, true);
+    free(copy);
+}
+
+/* the mask of the key fields named in a list */
+uint32_t key_fields_mask(struct collate_state *state, char *list)
+{
+    uint32_t mask = 0;
+    char *copy = strdup(list);
+    for(char *name = strtok(copy, GROUPING_DELIMS); name; name = strtok(NULL, GROUPING_DELIMS))
+        for(int i = 0; i < state->num_key_fields; i++)
+            if(strcmp(state->interesting_field_names[i], name) == 0)
+                mask |= 1u << i;
+    free(copy);
+    return mask;
+}
+
+void add_grouping(struct collate_state *state, int *groupings_size, uint32_t grouping)
+{
+    for(int i = 0; i < state->cube_max; i++)
+        if(state->groupings[i] == grouping)
+            return;
+
+    RESIZE_ARRAY_IF_NECESSARY(state->groupings, *groupings_size, state->cube_max + 1);
+    state->groupings[state->cube_max++] = grouping;
+}
+
 void init_agg_instance(struct agg_instance *agg_inst, char *agg_str)
 {
     /* agg_str is in format: [<fieldname>=]<aggregator>[,<arguments>] */
@@ -554,7 +3256,9 @@ void init_agg_instance(struct agg_instance *agg_inst, char *agg_str)
             int num_fields = 0;
             char *fields[MAX_INFIELDS_PER_AGGREGATOR];
             agg_inst->agg = aggregator;
-            agg_inst->agg->parse_args_func(&agg_inst->config_data, ch+1, &num_fields, fields);
+            agg_inst->shares = -1;
+            if(!agg_inst->agg->parse_args_func(&agg_inst->config_data, ch+1, &num_fields, fields))
+                usage_err("Bad arguments for aggregator '%s'", agg_str);
             agg_inst->num_input_fields = num_fields;
 
             /* are we already watching the fields the aggregator wants?
@@ -570,33 +3274,70 @@ void init_agg_instance(struct agg_instance *agg_inst, char *agg_str)
 }
 
 
-int main(int argc, char *argv[])
+/* the files we read the records from */
+struct input_files
+{
+    FILE **files;
+    int len, size;
+    long total_bytes;           /* -1 if we can't know, eg. reading a pipe */
+};
+
+void add_input_file(struct input_files *input, char *name)
+{
+    FILE *f = fopen(name, "r");
+    if(f == NULL)
+        usage_err("Couldn't open file '%s' for reading", name);
+
+    RESIZE_ARRAY_IF_NECESSARY(input->files, input->size, input->len+1);
+    input->files[input->len++] = f;
+
+    /* remember how much input there is, for --expected-groups auto */
+    struct stat st;
+    if(input->total_bytes >= 0 && stat(name, &st) == 0 && S_ISREG(st.st_mode))
+        input->total_bytes += st.st_size;
+    else
+        input->total_bytes = -1;
+}
+
+FILE *open_output(char *name)
+{
+    FILE *f = fopen(name, "w");
+    if(f == NULL)
+        usage_err("Couldn't open file '%s' for writing", name);
+    return f;
+}
+
+/*
+ * Parse one query's options (argv[1] on) into *query and get it ready to
+ * run.  Anything that isn't an option is an input file, and is added to
+ * input, unless it's NULL.
+ */
+void init_query(struct collate_state *query, int argc, char *argv[], struct input_files *input)
 {
-    struct parse_state state;
     int agg_instances_size = 6;
     int agg_instances_data_size = 0;
     bool cube = false;
+    char *rollup = NULL;
+    char *grouping_sets = NULL;
+    bool size_given = false;
+    char *window_field = NULL;
+    char *session_field = NULL;
+    long expected_groups = 0;
+    long hot_cache_size = DEFAULT_HOT_CACHE_SIZE;
     struct collate_state cs = {
          .max_clumps = 1,
          .incremental = false,
          .num_agg_instances = 0,
          .agg_instances = malloc(sizeof(*cs.agg_instances) * agg_instances_size),
          .clump_table = hash_create(HASHCOUNT_T_MAX, hash_comp_func, hash_func),
-         .clumps_head = NULL,
-         .clumps_tail = NULL,
+         .small_table = true,
+         .eviction_policy = EVICT_LRU,
          .cube_max = 1,
-         .cube_default = "ALL"
+         .cube_default = "ALL",
+         .out = stdout
     };
 
-    int files_len = 0, files_size = 5;
-    FILE **files = malloc(sizeof(*files) * files_size);
-
-    /* round up the size of each aggregator data to a multiple of sizeof(double) */
-    for(struct aggregator *agg = aggregators; agg->name; agg++)
-        agg->data_size = ceil((double)agg->data_size / sizeof(double)) * sizeof(double);
-
-    struct grammar *g = NULL;
-
+    fields_len = 0;
     fields = malloc(sizeof(*fields) * fields_size);
 
     /* parse command-line options */
@@ -612,57 +3353,259 @@ int main(int argc, char *argv[])
 
             char *str = strtok(keys, ",");
             do {
-                add_interesting_field(str, true);
+                enum key_type key_type = KEY_AUTO;
+                char *colon = strrchr(str, ':');
+                if(colon && strcmp(colon, ":int") == 0)
+                {
+                    key_type = KEY_INT;
+                    *colon = '\0';
+                }
+                else if(colon && strcmp(colon, ":str") == 0)
+                {
+                    key_type = KEY_STRING;
+                    *colon = '\0';
+                }
+
+                int field = add_interesting_field(str, true);
+                if(key_type != KEY_AUTO)
+                    fields[field].key_type = key_type;
             } while((str = strtok(NULL, ",")));
         }
-        else if(strcmp(arg, "--aggregator") == 0 || strcmp(arg, "-a") == 0)
+        else if(strcmp(arg, "--aggregator") == 0 || strcmp(arg, "-a") == 0)
+        {
+            char *aggs = argv[++i];
+            if(aggs == NULL)
+                usage_err("argument '%s' must be followed by a list of aggregators", arg);
+
+            char *agg = strtok(aggs, ":");
+            do {
+                RESIZE_ARRAY_IF_NECESSARY(cs.agg_instances, agg_instances_size,
+                                          cs.num_agg_instances+1);
+                struct agg_instance *agg_inst = &cs.agg_instances[cs.num_agg_instances++];
+                init_agg_instance(agg_inst, agg);
+                agg_instances_data_size += agg_inst->agg->data_size;
+            } while((agg = strtok(NULL, ":")));
+        }
+        else if(strcmp(arg, "--size") == 0 || strcmp(arg, "--sz") == 0 ||
+                strcmp(arg, "-n") == 0)
+        {
+            char *size_str = argv[++i];
+            if(size_str == NULL)
+                usage_err("argument '%s' must be followed by an integer", arg);
+
+            if(strncmp(size_str, "auto", 4) == 0 && (size_str[4] == '\0' || size_str[4] == ':'))
+            {
+                if(size_str[4] == ':')
+                {
+                    cs.max_memory = parse_size(size_str + 5);
+                    if(cs.max_memory <= 0)
+                        usage_err("parameter to '%s' must be auto or auto:<size>, like auto:512M", arg);
+                }
+                cs.auto_size = true;
+            }
+            else
+            {
+                long int size = strtol(size_str, NULL, 10);
+
+                if(errno == EINVAL)
+                    usage_err("parameter to '%s' argument was not a valid integer", arg);
+                if(size < 1)
+                    usage_err("the size must be greater than 0");
+
+                cs.max_clumps = size;
+                cs.auto_size = false;
+            }
+            size_given = true;
+        }
+        else if(strcmp(arg, "--adjacent") == 0 || strcmp(arg, "-a") == 0 ||
+                strcmp(arg, "-1") == 0)
+        {
+            cs.max_clumps = 1;
+            cs.auto_size = false;
+            size_given = true;
+        }
+        else if(strcmp(arg, "--perfect") == 0)
+        {
+            cs.max_clumps = MAX_CLUMPS_INFINITE;
+            cs.auto_size = false;
+        }
+        else if(strcmp(arg, "--assume-sorted") == 0)
+        {
+            cs.assume_sorted = true;
+        }
+        else if(strcmp(arg, "--verify-sorted") == 0)
+        {
+            cs.assume_sorted = true;
+            cs.verify_sorted = true;
+        }
+        else if(strcmp(arg, "--memory-limit") == 0)
+        {
+            char *size_str = argv[++i];
+            if(size_str == NULL)
+                usage_err("argument '%s' must be followed by a size", arg);
+
+            cs.memory_limit = parse_size(size_str);
+            if(cs.memory_limit <= 0)
+                usage_err("parameter to '%s' must be a size like 4096, 512M or 2G", arg);
+        }
+        else if(strcmp(arg, "--max-memory") == 0)
+        {
+            char *size_str = argv[++i];
+            if(size_str == NULL)
+                usage_err("argument '%s' must be followed by a size or 'auto'", arg);
+
+            if(strcmp(size_str, "auto") == 0)
+            {
+                long limit = cgroup_memory_limit();
+                if(limit < 0)
+                    usage_err("--max-memory auto: couldn't find a cgroup memory limit");
+                cs.max_memory = limit / 100 * CGROUP_MEMORY_PERCENT;
+            }
+            else
+            {
+                cs.max_memory = parse_size(size_str);
+                if(cs.max_memory <= 0)
+                    usage_err("parameter to '%s' must be a size like 512M or 'auto'", arg);
+            }
+        }
+        else if(strcmp(arg, "--eviction") == 0)
+        {
+            char *policy = argv[++i];
+            if(policy == NULL)
+                usage_err("argument '%s' must be followed by 'lru', 'clock' or 'tinylfu'", arg);
+
+            if(strcmp(policy, "lru") == 0)
+                cs.eviction_policy = EVICT_LRU;
+            else if(strcmp(policy, "clock") == 0)
+                cs.eviction_policy = EVICT_CLOCK;
+            else if(strcmp(policy, "tinylfu") == 0)
+                cs.eviction_policy = EVICT_TINYLFU;
+            else
+                usage_err("unknown eviction policy '%s'", policy);
+        }
+        else if(strcmp(arg, "--window") == 0)
+        {
+            char *size_str = argv[++i];
+            if(size_str == NULL)
+                usage_err("argument '%s' must be followed by an integer", arg);
+
+            char *endp;
+            cs.window_size = strtol(size_str, &endp, 10);
+            if(endp == size_str || *endp || cs.window_size < 1)
+                usage_err("parameter to '%s' must be a positive integer", arg);
+        }
+        else if(strcmp(arg, "--window-field") == 0)
+        {
+            window_field = argv[++i];
+            if(window_field == NULL)
+                usage_err("argument '%s' must be followed by a field name", arg);
+        }
+        else if(strcmp(arg, "--session-field") == 0)
+        {
+            session_field = argv[++i];
+            if(session_field == NULL)
+                usage_err("argument '%s' must be followed by a field name", arg);
+        }
+        else if(strcmp(arg, "--session-gap") == 0)
+        {
+            char *duration_str = argv[++i];
+            if(duration_str == NULL)
+                usage_err("argument '%s' must be followed by a duration", arg);
+
+            cs.session_gap = parse_duration(duration_str);
+            if(cs.session_gap <= 0)
+                usage_err("parameter to '%s' must be a duration like 30s, 5m or 1h", arg);
+        }
+        else if(strcmp(arg, "--tumble") == 0 || strcmp(arg, "--allowed-lateness") == 0)
+        {
+            char *duration_str = argv[++i];
+            if(duration_str == NULL)
+                usage_err("argument '%s' must be followed by a duration", arg);
+
+            double duration = parse_duration(duration_str);
+            if(duration < 0 || (duration == 0 && strcmp(arg, "--tumble") == 0))
+                usage_err("parameter to '%s' must be a duration like 30s, 5m or 1h", arg);
+
+            if(strcmp(arg, "--tumble") == 0)
+                cs.tumble_size = duration;
+            else
+                cs.allowed_lateness = duration;
+        }
+        else if(strcmp(arg, "--incremental") == 0)
+        {
+            cs.incremental = true;
+        }
+        else if(strcmp(arg, "--expected-groups") == 0)
         {
-            char *aggs = argv[++i];
-            if(aggs == NULL)
-                usage_err("argument '%s' must be followed by a list of aggregators", arg);
+            char *groups_str = argv[++i];
+            if(groups_str == NULL)
+                usage_err("argument '%s' must be followed by an integer or 'auto'", arg);
 
-            char *agg = strtok(aggs, ":");
-            do {
-                RESIZE_ARRAY_IF_NECESSARY(cs.agg_instances, agg_instances_size,
-                                          cs.num_agg_instances+1);
-                struct agg_instance *agg_inst = &cs.agg_instances[cs.num_agg_instances++];
-                init_agg_instance(agg_inst, agg);
-                agg_instances_data_size += agg_inst->agg->data_size;
-            } while((agg = strtok(NULL, ":")));
+            if(strcmp(groups_str, "auto") == 0)
+            {
+                expected_groups = -1;
+            }
+            else
+            {
+                char *endp;
+                expected_groups = strtol(groups_str, &endp, 10);
+                if(endp == groups_str || *endp || expected_groups < 1 || expected_groups > INT_MAX)
+                    usage_err("parameter to '%s' must be a positive integer (up to %d) or 'auto'", arg, INT_MAX);
+            }
         }
-        else if(strcmp(arg, "--size") == 0 || strcmp(arg, "--sz") == 0 ||
-                strcmp(arg, "-n") == 0)
+        else if(strcmp(arg, "--hot-cache") == 0)
         {
             char *size_str = argv[++i];
             if(size_str == NULL)
                 usage_err("argument '%s' must be followed by an integer", arg);
 
-            long int size = strtol(size_str, NULL, 10);
-
-            if(errno == EINVAL)
-                usage_err("parameter to '%s' argument was not a valid integer", arg);
-            if(size < 1)
-                usage_err("the size must be greater than 0");
-
-            cs.max_clumps = size;
+            char *endp;
+            hot_cache_size = strtol(size_str, &endp, 10);
+            if(endp == size_str || *endp || hot_cache_size < 0 ||
+               (hot_cache_size & (hot_cache_size - 1)) != 0)
+                usage_err("parameter to '%s' must be 0 or a power of two", arg);
         }
-        else if(strcmp(arg, "--adjacent") == 0 || strcmp(arg, "-a") == 0 ||
-                strcmp(arg, "-1") == 0)
+        else if(strcmp(arg, "--batch") == 0)
         {
-            cs.max_clumps = 1;
+            char *batch_str = argv[++i];
+            if(batch_str == NULL)
+                usage_err("argument '%s' must be followed by an integer", arg);
+
+            char *endp;
+            cs.batch_size = strtol(batch_str, &endp, 10);
+            if(endp == batch_str || *endp || cs.batch_size < 1)
+                usage_err("parameter to '%s' must be a positive integer", arg);
         }
-        else if(strcmp(arg, "--perfect") == 0)
+        else if(strcmp(arg, "--stats") == 0)
         {
-            cs.max_clumps = MAX_CLUMPS_INFINITE;
+            cs.show_stats = true;
         }
-        else if(strcmp(arg, "--incremental") == 0)
+        else if(strcmp(arg, "--output") == 0)
         {
-            cs.incremental = true;
+            char *file = argv[++i];
+            if(file == NULL)
+                usage_err("argument '%s' must be followed by a file name", arg);
+
+            cs.out = open_output(file);
         }
         else if(strcmp(arg, "--cube") == 0)
         {
             cube = true;
         }
+        else if(strcmp(arg, "--rollup") == 0)
+        {
+            rollup = argv[++i];
+            if(rollup == NULL)
+                usage_err("argument '%s' must be followed by a list of keys", arg);
+            add_grouping_fields(rollup);
+        }
+        else if(strcmp(arg, "--grouping-sets") == 0)
+        {
+            grouping_sets = argv[++i];
+            if(grouping_sets == NULL)
+                usage_err("argument '%s' must be followed by a list of grouping sets", arg);
+            add_grouping_fields(grouping_sets);
+        }
         else if(strcmp(arg, "--cube-default") == 0)
         {
             char *cube_default = argv[++i];
@@ -670,49 +3613,233 @@ int main(int argc, char *argv[])
                 usage_err("argument '--cube-default' must be followed by a string");
             cs.cube_default = strdup(cube_default);
         }
-        else
+        else if(input)
         {
             /* interpret the argument as a filename */
-            FILE *f = fopen(arg, "r");
-            if(f)
-            {
-                RESIZE_ARRAY_IF_NECESSARY(files, files_size, files_len+1);
-                files[files_len++] = f;
-            }
-            else
-            {
-                usage_err("Couldn't open file '%s' for reading", arg);
-            }
+            add_input_file(input, arg);
+        }
+        else
+        {
+            usage_err("unknown argument '%s' in --query (input files go outside --query)", arg);
         }
     }
 
-    if(files_len == 0)
-        files[files_len++] = stdin;
-
     if(fields_len == 0)
         usage_err("must specify --key or --aggregator");
 
+    /* tumbling windows only close when the watermark passes them, so nothing
+     * else should purge their clumps */
+    if(cs.tumble_size > 0)
+    {
+        if(window_field == NULL)
+            usage_err("--tumble needs --window-field");
+        if(size_given || cs.max_memory || cs.memory_limit || cs.assume_sorted || cs.window_size)
+            usage_err("--tumble can't be used with --size, --adjacent, --max-memory, "
+                      "--memory-limit, --assume-sorted or --window");
+
+        /* window_start is a key of our own making, so it can't be a field
+         * that's read from the input or written by an aggregator */
+        bool named = strcmp(window_field, "window_start") == 0;
+        for(int i = 0; i < fields_len; i++)
+            if(strcmp(fields[i].name, "window_start") == 0)
+                named = true;
+        if(named)
+            usage_err("--tumble adds a window_start field, so it can't be used "
+                      "with a key or input field named window_start");
+        for(int i = 0; i < cs.num_agg_instances; i++)
+            if(strcmp(cs.agg_instances[i].output_field_name, "window_start") == 0)
+                usage_err("--tumble adds a window_start field, so it can't be used "
+                          "with an aggregator named window_start");
+
+        cs.max_clumps = MAX_CLUMPS_INFINITE;
+        cs.watermark = -INFINITY;
+        add_interesting_field(window_field, false);
+        add_interesting_field("window_start", true);
+        cs.open_windows_size = 8;
+        cs.open_windows = malloc(sizeof(*cs.open_windows) * cs.open_windows_size);
+    }
+    else if(window_field)
+    {
+        usage_err("--window-field needs --tumble");
+    }
+
+    /* sessions only close when their gap is up */
+    if(cs.session_gap > 0)
+    {
+        if(session_field == NULL)
+            usage_err("--session-gap needs --session-field");
+        if(size_given || cs.max_memory || cs.memory_limit || cs.assume_sorted ||
+           cs.window_size || cs.tumble_size > 0 || cs.batch_size > 1)
+            usage_err("--session-gap can't be used with --size, --adjacent, --max-memory, "
+                      "--memory-limit, --assume-sorted, --window, --tumble or --batch");
+
+        cs.max_clumps = MAX_CLUMPS_INFINITE;
+        cs.session_tick = cs.session_gap / SESSION_TICKS_PER_GAP;
+        cs.session_now = -INFINITY;
+        cs.wheel_tick = INT64_MIN;
+        add_interesting_field(session_field, false);
+    }
+    else if(session_field)
+    {
+        usage_err("--session-field needs --session-gap");
+    }
+
+    /* sorted input never needs to purge anything: the only clumps in the
+     * table are the parts of the cube that have to wait for the end */
+    if(cs.assume_sorted)
+    {
+        if(size_given || cs.max_memory)
+            usage_err("--assume-sorted doesn't use --size, --adjacent or --max-memory");
+        cs.max_clumps = MAX_CLUMPS_INFINITE;
+    }
+
+    if(cs.memory_limit && cs.max_clumps != MAX_CLUMPS_INFINITE)
+        usage_err("--memory-limit only works with --perfect");
+    if(cs.memory_limit && (cs.incremental || cs.window_size))
+        usage_err("--memory-limit can't be used with --incremental or --window");
+
+    if(records_wanted && cs.batch_size > 1)
+        usage_err("--batch can't be used with aggregators that need the records' JSON text");
+    for(int i = 0; cs.window_size && i < cs.num_agg_instances; i++)
+        if(cs.agg_instances[i].agg->remove_func == NULL)
+            usage_err("the %s aggregator can't be used with --window",
+                      cs.agg_instances[i].agg->name);
+    if(cs.max_memory && cs.max_clumps == MAX_CLUMPS_INFINITE)
+        usage_err("--max-memory purges clumps, so it can't be used with --perfect "
+                  "(see --memory-limit)");
+
+    /* --size auto needs a memory cap to grow up to */
+    if(cs.auto_size)
+    {
+        if(cs.eviction_policy != EVICT_LRU)
+            usage_err("--size auto only works with --eviction lru");
+        if(!cs.max_memory)
+        {
+            long limit = cgroup_memory_limit();
+            cs.max_memory = limit > 0 ? limit / 100 * CGROUP_MEMORY_PERCENT : AUTO_SIZE_DEFAULT_MEMORY;
+        }
+    }
+
     cs.num_interesting_fields = fields_len;
     cs.num_key_fields = 0;
 
     cs.interesting_field_names = malloc(sizeof(*cs.interesting_field_names) *
                                         (cs.num_interesting_fields+1));
+    cs.key_types = malloc(sizeof(*cs.key_types) * fields_len);
+    cs.key_ints_seen = calloc(fields_len, sizeof(*cs.key_ints_seen));
     for(int i = 0; i < fields_len; i++)
+    {
         if(fields[i].is_key)
+        {
+            if(cs.num_key_fields == MAX_KEY_FIELDS)
+                usage_err("there can't be more than %d key fields", MAX_KEY_FIELDS);
+            cs.key_types[cs.num_key_fields] = fields[i].key_type;
             cs.interesting_field_names[cs.num_key_fields++] = fields[i].name;
+        }
+    }
 
     int nonkey_field_num = 0;
     for(int i = 0; i < fields_len; i++)
         if(!fields[i].is_key)
             cs.interesting_field_names[cs.num_key_fields + nonkey_field_num++] = fields[i].name;
+    cs.interesting_field_names[cs.num_interesting_fields] = NULL;
 
     num_key_fields = cs.num_key_fields;
 
+    /* work out the groupings.  window_start is the last key field, and isn't
+     * part of the cube. */
+    int groupings_size = 1;
+    cs.groupings = calloc(groupings_size, sizeof(*cs.groupings));
+    if(cube + (rollup != NULL) + (grouping_sets != NULL) > 1)
+        usage_err("only one of --cube, --rollup and --grouping-sets can be used");
+    if((cube || rollup || grouping_sets) && cs.num_key_fields > 31)
+        usage_err("--cube, --rollup and --grouping-sets only work with up to 31 key fields");
+
     if(cube)
     {
-        cs.cube_max = 1 << cs.num_key_fields;
-        if(cs.max_clumps != MAX_CLUMPS_INFINITE && cs.max_clumps < cs.cube_max)
-            usage_err("when cubing, you must have at least 2 ** num_key_fields clumps");
+        cs.cube_max = 0;
+        int cube_fields = cs.tumble_size > 0 ? cs.num_key_fields - 1 : cs.num_key_fields;
+        for(uint32_t grouping = 0; grouping < (1u << cube_fields); grouping++)
+            add_grouping(&cs, &groupings_size, grouping);
+    }
+    else if(rollup)
+    {
+        /* a,b,c is the groupings a,b,c then a,b then a then nothing */
+        uint32_t levels[32];
+        int num_levels = 0;
+        char *copy = strdup(rollup);
+        for(char *name = strtok(copy, GROUPING_DELIMS); name; name = strtok(NULL, GROUPING_DELIMS))
+            for(int j = 0; j < cs.num_key_fields; j++)
+                if(strcmp(cs.interesting_field_names[j], name) == 0 && num_levels < 32)
+                    levels[num_levels++] = 1u << j;
+        free(copy);
+
+        uint32_t rolled = 0;
+        for(int level = num_levels - 1; level >= 0; level--)
+        {
+            rolled |= levels[level];
+            add_grouping(&cs, &groupings_size, rolled);
+        }
+    }
+    else if(grouping_sets)
+    {
+        /* each set is the fields it keeps; the rest of the fields named in
+         * any set are rolled up */
+        cs.cube_max = 0;
+        uint32_t named = key_fields_mask(&cs, grouping_sets);
+        char *copy = strdup(grouping_sets);
+        for(char *set = copy; set; )
+        {
+            char *end = strchr(set, ';');
+            if(end)
+                *end = '\0';
+            if(set[strspn(set, " \t")] == '\0')
+                usage_err("--grouping-sets has an empty set (the grand total is written ())");
+            add_grouping(&cs, &groupings_size, named & ~key_fields_mask(&cs, set));
+            set = end ? end + 1 : NULL;
+        }
+        free(copy);
+    }
+
+    /* when every clump lasts until the end anyway, only the finest grouping
+     * is built as we go, and the rest are rolled up from it at the end (unless
+     * an aggregator needs to see each grouping's values in the order they
+     * came in) */
+    bool order_sensitive = false;
+    for(int i = 0; i < cs.num_agg_instances; i++)
+        if(cs.agg_instances[i].agg->order_sensitive)
+            order_sensitive = true;
+
+    if(cs.cube_max > 1 && cs.max_clumps == MAX_CLUMPS_INFINITE && !cs.incremental &&
+       !cs.window_size && !cs.memory_limit && !cs.assume_sorted && cs.tumble_size == 0 &&
+       cs.session_gap == 0 && !order_sensitive)
+    {
+        uint32_t finest = ~0u;
+        for(int i = 0; i < cs.cube_max; i++)
+            finest &= cs.groupings[i];
+
+        cs.rollups = malloc(sizeof(*cs.rollups) * cs.cube_max);
+        for(int i = 0; i < cs.cube_max; i++)
+        {
+            uint32_t grouping = cs.groupings[i];
+            if(grouping == finest)
+            {
+                cs.keep_base = true;
+                continue;
+            }
+
+            /* finest first, so each one's finer groupings are done before it */
+            int j = cs.num_rollups++;
+            while(j > 0 && __builtin_popcount(cs.rollups[j - 1]) > __builtin_popcount(grouping))
+            {
+                cs.rollups[j] = cs.rollups[j - 1];
+                j--;
+            }
+            cs.rollups[j] = grouping;
+        }
+
+        cs.groupings[0] = finest;
+        cs.cube_max = 1;
     }
 
 
@@ -734,49 +3861,472 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* instances that can read an earlier one's clump data (on the same
+     * fields) don't need their own */
+    for(int i = 0; i < cs.num_agg_instances; i++)
+    {
+        struct agg_instance *agg_inst = &cs.agg_instances[i];
+        for(int j = 0; agg_inst->agg->share_func && j < i; j++)
+        {
+            struct agg_instance *other = &cs.agg_instances[j];
+            if(other->shares >= 0 || other->num_input_fields != agg_inst->num_input_fields ||
+               memcmp(other->input_fields, agg_inst->input_fields,
+                      sizeof(*other->input_fields) * other->num_input_fields) != 0)
+                continue;
+
+            if(agg_inst->agg->share_func(agg_inst->config_data, other->agg, other->config_data))
+            {
+                agg_inst->shares = j;
+                agg_instances_data_size -= agg_inst->agg->data_size;
+                break;
+            }
+        }
+    }
+
     cs.interesting_field_names[cs.num_interesting_fields] = NULL;
 
+    for(int i = 0; cs.session_gap > 0 && i < cs.num_interesting_fields; i++)
+        if(strcmp(cs.interesting_field_names[i], session_field) == 0)
+            cs.session_field = i;
+
+    for(int i = 0; cs.tumble_size > 0 && i < cs.num_interesting_fields; i++)
+    {
+        if(strcmp(cs.interesting_field_names[i], window_field) == 0)
+            cs.tumble_field = i;
+        if(strcmp(cs.interesting_field_names[i], "window_start") == 0)
+            cs.window_key_field = i;
+    }
+
     cs.interesting_field = -1;
     cs.interesting_fields = malloc(sizeof(*cs.interesting_fields) * cs.num_interesting_fields);
     cs.tmp_interesting_vals = malloc(sizeof(*cs.tmp_interesting_vals) * (cs.num_interesting_fields+1));
     cs.tmp_interesting_vals[cs.num_key_fields] = NULL;
     cs.tmp_double_vals = malloc(sizeof(*cs.tmp_double_vals) * cs.num_interesting_fields);
+    cs.literal_vals = calloc(cs.num_interesting_fields, sizeof(*cs.literal_vals));
+
+    cs.key_size = sizeof(struct clump_key) + sizeof(union key_val) * cs.num_key_fields;
+    cs.key_size = ceil((double)cs.key_size / sizeof(double)) * sizeof(double);
+    cs.tmp_key = malloc(cs.key_size);
+
+    if(cs.max_clumps == MAX_CLUMPS_INFINITE)
+        cs.eviction_policy = EVICT_NONE;
+
+    int evict_data_size = 0;
+    if(cs.eviction_policy == EVICT_LRU)
+        evict_data_size = sizeof(struct lru_links);
+    else if(cs.eviction_policy == EVICT_CLOCK)
+        evict_data_size = ceil((double)sizeof(struct clock_slot) / sizeof(double)) * sizeof(double);
+    else if(cs.eviction_policy == EVICT_TINYLFU)
+        evict_data_size = ceil((double)sizeof(struct tinylfu_links) / sizeof(double)) * sizeof(double);
+
+    cs.agg_data_size = agg_instances_data_size;
+    cs.evict_data_offset = cs.agg_data_size + cs.key_size;
+    cs.window_data_offset = cs.evict_data_offset + evict_data_size;
+    int window_data_size = 0;
+    if(cs.window_size)
+        window_data_size = ceil((double)sizeof(struct window_ring) / sizeof(double)) * sizeof(double);
+    cs.tumble_data_offset = cs.window_data_offset + window_data_size;
+    int tumble_data_size = 0;
+    if(cs.tumble_size > 0)
+        tumble_data_size = ceil((double)sizeof(struct clump*) / sizeof(double)) * sizeof(double);
+    cs.session_data_offset = cs.tumble_data_offset + tumble_data_size;
+    int session_data_size = 0;
+    if(cs.session_gap > 0)
+        session_data_size = ceil((double)sizeof(struct session_data) / sizeof(double)) * sizeof(double);
+    cs.clump_size = sizeof(struct clump) + cs.agg_data_size + cs.key_size +
+                    evict_data_size + window_data_size + tumble_data_size + session_data_size;
+
+    /* every clump takes at least clump_size bytes, which bounds how many
+     * clumps --max-memory can hold */
+    if(cs.max_memory)
+    {
+        long max_clumps = cs.max_memory / cs.clump_size;
+        if(max_clumps < 1) max_clumps = 1;
+        if(max_clumps > INT_MAX) max_clumps = INT_MAX;
+        if(!size_given || cs.auto_size || max_clumps < cs.max_clumps)
+            cs.max_clumps = max_clumps;
+    }
+
+    if(cs.auto_size)
+    {
+        cs.auto_size_max = cs.max_clumps;
+        cs.auto_size_min = cs.cube_max > AUTO_SIZE_MIN ? cs.cube_max : AUTO_SIZE_MIN;
+        if(cs.auto_size_min > cs.auto_size_max)
+            cs.auto_size_min = cs.auto_size_max;
+        cs.max_clumps = cs.auto_size_max < AUTO_SIZE_INITIAL ? cs.auto_size_max : AUTO_SIZE_INITIAL;
+        if(cs.max_clumps < cs.auto_size_min)
+            cs.max_clumps = cs.auto_size_min;
+
+        long ghosts = 1;
+        while(ghosts < cs.auto_size_max && ghosts < AUTO_SIZE_MAX_GHOSTS)
+            ghosts *= 2;
+        cs.ghosts = calloc(ghosts, sizeof(*cs.ghosts));
+        cs.ghost_mask = ghosts - 1;
+    }
+
+    if(cs.max_clumps != MAX_CLUMPS_INFINITE && cs.max_clumps < cs.cube_max)
+        usage_err("when grouping, you must have at least one clump per grouping (%d)", cs.cube_max);
+
+    if(cs.eviction_policy == EVICT_TINYLFU && cs.max_clumps > 0)
+    {
+        cs.window_max = (long)cs.max_clumps * TINYLFU_WINDOW_PERCENT / 100;
+        if(cs.window_max < 1) cs.window_max = 1;
+        cs.sketch = cm_create(cs.max_clumps);
+    }
+
+    if(cs.eviction_policy == EVICT_CLOCK && cs.max_clumps > 0)
+    {
+        cs.clock_bits = calloc(cs.max_clumps, sizeof(*cs.clock_bits));
+        cs.clock_clumps = malloc(sizeof(*cs.clock_clumps) * cs.max_clumps);
+        cs.clock_evict_batch = cs.max_clumps / CLOCK_EVICT_FRACTION;
+        if(cs.clock_evict_batch < 1) cs.clock_evict_batch = 1;
+        if(cs.clock_evict_batch > CLOCK_MAX_EVICT_BATCH) cs.clock_evict_batch = CLOCK_MAX_EVICT_BATCH;
+    }
 
-    cs.clump_size = sizeof(struct clump) + agg_instances_data_size;
     cs.total_available_clumps = 128;
     cs.available_clumps = malloc(cs.clump_size * cs.total_available_clumps);
     cs.next_clump = 0;
 
-    for(int i = 0; i < files_len; i++)
+    cs.memo_lens = malloc(sizeof(*cs.memo_lens) * cs.num_key_fields);
+    cs.memo_strs_size = 256;
+    cs.memo_strs = malloc(cs.memo_strs_size);
+    cs.memo_clumps = calloc(cs.cube_max, sizeof(*cs.memo_clumps));
+    cs.sorted_clumps = calloc(cs.num_key_fields + 1, sizeof(*cs.sorted_clumps));
+
+    for(struct aggregator *agg = aggregators; agg->name; agg++)
+        cs.num_aggregator_types++;
+    cs.mem_bytes = calloc(cs.num_aggregator_types + 1, sizeof(*cs.mem_bytes));
+    cs.peak_mem_bytes = calloc(cs.num_aggregator_types + 1, sizeof(*cs.peak_mem_bytes));
+
+    if(hot_cache_size > 0)
+    {
+        cs.hot_cache = calloc(hot_cache_size, sizeof(*cs.hot_cache));
+        cs.hot_cache_mask = hot_cache_size - 1;
+    }
+
+    if(cs.batch_size > 1)
+    {
+        cs.batch_offsets = malloc(sizeof(*cs.batch_offsets) * cs.batch_size * cs.num_interesting_fields);
+        cs.batch_dbl_vals = malloc(sizeof(*cs.batch_dbl_vals) * cs.batch_size * cs.num_interesting_fields);
+        cs.batch_hkeys = malloc(sizeof(*cs.batch_hkeys) * cs.batch_size * cs.cube_max);
+        cs.batch_strs_size = 4096;
+        cs.batch_strs = malloc(cs.batch_strs_size);
+    }
+
+    /* --window and --incremental need every record added as it comes */
+    for(int i = 0; !cs.window_size && !cs.incremental && i < cs.num_agg_instances; i++)
+        if(cs.agg_instances[i].shares < 0 && cs.agg_instances[i].agg->add_batch_func)
+            cs.run_batching = true;
+
+    if(cs.run_batching)
+    {
+        cs.runs = calloc(cs.cube_max, sizeof(*cs.runs));
+        cs.run_vals = malloc(sizeof(*cs.run_vals) * cs.cube_max * cs.num_interesting_fields * RUN_SIZE);
+        cs.run_fields = malloc(sizeof(*cs.run_fields) * cs.num_interesting_fields);
+        for(int field = 0; field < cs.num_interesting_fields; field++)
+        {
+            bool used = false;
+            for(int i = 0; i < cs.num_agg_instances; i++)
+            {
+                struct agg_instance *agg_inst = &cs.agg_instances[i];
+                if(agg_inst->shares >= 0 || !agg_inst->agg->add_batch_func)
+                    continue;
+                for(int j = 0; j < agg_inst->num_input_fields; j++)
+                    if(agg_inst->input_fields[j] == field)
+                        used = true;
+            }
+            if(used)
+                cs.run_fields[cs.num_run_fields++] = field;
+        }
+    }
+
+    if(expected_groups > 0)
+    {
+        cs.stats.estimated_groups = expected_groups;
+        presize_clumps(&cs, expected_groups);
+    }
+    else if(expected_groups < 0)
+    {
+        cs.sample_hll = hll_create(GROUP_SAMPLE_HLL_PRECISION);
+    }
+
+    /* the field names live on in interesting_field_names, but we're done
+     * with the list */
+    free(fields);
+    fields = NULL;
+
+    *query = cs;
+}
+
+/*
+ * --query '<args>': split the string up into arguments at whitespace, except
+ * inside single or double quotes.  argv[0] is just a placeholder, like the
+ * program name.  The arguments are copied into *strs, which the caller has
+ * to free (along with argv) when it's done with them.
+ */
+char **split_query(char *str, int *argc, char **strs)
+{
+    int argv_size = 8;
+    char **argv = malloc(sizeof(*argv) * argv_size);
+    argv[0] = "--query";
+    *argc = 1;
+
+    char *p = *strs = strdup(str);
+    while(*p)
+    {
+        while(*p && isspace((unsigned char)*p))
+            p++;
+        if(*p == '\0')
+            break;
+
+        /* copy the argument over itself without its quotes */
+        char *arg = p, *to = p;
+        char quote = '\0';
+        while(*p && (quote || !isspace((unsigned char)*p)))
+        {
+            if(quote && *p == quote)
+                quote = '\0';
+            else if(!quote && (*p == '\'' || *p == '"'))
+                quote = *p;
+            else
+                *to++ = *p;
+            p++;
+        }
+        if(*p)
+            p++;
+        *to = '\0';
+
+        RESIZE_ARRAY_IF_NECESSARY(argv, argv_size, *argc + 2);
+        argv[(*argc)++] = arg;
+    }
+    argv[*argc] = NULL;
+    return argv;
+}
+
+/*
+ * --query: give this record to every query.  The parser filled in the scan
+ * state's fields, so copy each query's fields out of those first.
+ */
+void multi_object_callback(struct parse_state *parse_state, void *_scan)
+{
+    struct collate_state *scan = _scan;
+    if(parse_state->parse_stack_length != 1)
+        return;
+
+    for(int q = 0; q < scan->num_queries; q++)
+    {
+        struct collate_state *state = scan->queries[q];
+        for(int i = 0; i < state->num_interesting_fields; i++)
+            state->interesting_fields[i] = scan->interesting_fields[state->scan_fields[i]];
+
+        num_key_fields = state->num_key_fields;
+        object_callback(parse_state, state);
+    }
+}
+
+/* the union of the queries' fields goes in the scan state */
+void init_scan(struct collate_state *scan, struct collate_state **queries, int num_queries)
+{
+    int total = 0;
+    for(int q = 0; q < num_queries; q++)
+        total += queries[q]->num_interesting_fields;
+
+    scan->queries = queries;
+    scan->num_queries = num_queries;
+    scan->interesting_field = -1;
+    scan->interesting_field_names = malloc(sizeof(*scan->interesting_field_names) * (total+1));
+    scan->interesting_fields = malloc(sizeof(*scan->interesting_fields) * (total+1));
+
+    for(int q = 0; q < num_queries; q++)
+    {
+        struct collate_state *query = queries[q];
+        query->scan_fields = malloc(sizeof(*query->scan_fields) * query->num_interesting_fields);
+        for(int i = 0; i < query->num_interesting_fields; i++)
+        {
+            int j;
+            for(j = 0; j < scan->num_interesting_fields; j++)
+                if(strcmp(scan->interesting_field_names[j], query->interesting_field_names[i]) == 0)
+                    break;
+            if(j == scan->num_interesting_fields)
+                scan->interesting_field_names[scan->num_interesting_fields++] =
+                    query->interesting_field_names[i];
+            query->scan_fields[i] = j;
+        }
+    }
+    scan->interesting_field_names[scan->num_interesting_fields] = NULL;
+}
+
+/* the input's done: output whatever the query is still holding on to */
+void finish_query(struct collate_state *cs)
+{
+    num_key_fields = cs->num_key_fields;
+
+    if(cs->batch_len > 0)
+        flush_batch(cs);
+
+    if(cs->sample_hll)
+        finish_sampling(cs, cs->input_bytes, true);
+
+    if(cs->adjacent_clump && dump_on_flush(cs))
+        dump_clump(cs->adjacent_clump, cs);
+
+    close_sorted_levels(cs, -1);
+
+    while(cs->open_windows_len > 0)
+        close_oldest_window(cs);
+
+    if(cs->spill_files)
+    {
+        /* some of the keys are on disk, so put the rest there too and merge */
+        spill_clumps(cs);
+        merge_spills(cs);
+    }
+    else
+    {
+        if(cs->num_rollups)
+            rollup_groupings(cs);
+
+        if(cs->small_table)
+            promote_small_table(cs);
+
+        hscan_t scan;
+        hash_scan_begin(&scan, cs->clump_table);
+        hnode_t *node;
+        while((node = hash_scan_next(&scan)))
+        {
+            if(dump_on_flush(cs))
+                dump_clump((struct clump*)node, cs);
+            hash_scan_delete(cs->clump_table, node);
+        }
+    }
+
+    if(cs->show_stats)
+        print_stats(cs);
+
+    if(cs->out != stdout && fclose(cs->out) != 0)
+    {
+        fprintf(stderr, "recs-collate: couldn't write output: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    free(cs->query_argv);
+    free(cs->query_strs);
+    cs->query_argv = NULL;
+    cs->query_strs = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct parse_state state;
+    struct grammar *g = NULL;
+
+    /* round up the size of each aggregator data to a multiple of sizeof(double) */
+    for(struct aggregator *agg = aggregators; agg->name; agg++)
+        agg->data_size = ceil((double)agg->data_size / sizeof(double)) * sizeof(double);
+
+    struct input_files input = {
+        .files = malloc(sizeof(*input.files) * 5),
+        .size = 5
+    };
+
+    bool multi = false;
+    for(int i = 1; i < argc; i++)
+        if(strcmp(argv[i], "--query") == 0)
+            multi = true;
+
+    int num_queries = 0, queries_size = 4;
+    struct collate_state **queries = malloc(sizeof(*queries) * queries_size);
+
+    if(!multi)
+    {
+        queries[num_queries] = malloc(sizeof(**queries));
+        init_query(queries[num_queries++], argc, argv, &input);
+    }
+
+    /* with --query, each one is a whole set of options, and everything
+     * else is --output (for the last query) or an input file */
+    for(int i = 1; multi && i < argc; i++)
+    {
+        char *arg = argv[i];
+        if(strcmp(arg, "--query") == 0)
+        {
+            char *query_str = argv[++i];
+            if(query_str == NULL)
+                usage_err("argument '%s' must be followed by a quoted list of options", arg);
+
+            int query_argc;
+            char *query_strs;
+            char **query_argv = split_query(query_str, &query_argc, &query_strs);
+            RESIZE_ARRAY_IF_NECESSARY(queries, queries_size, num_queries+1);
+            queries[num_queries] = malloc(sizeof(**queries));
+            init_query(queries[num_queries], query_argc, query_argv, NULL);
+            queries[num_queries]->query_argv = query_argv;
+            queries[num_queries++]->query_strs = query_strs;
+        }
+        else if(strcmp(arg, "--output") == 0)
+        {
+            char *file = argv[++i];
+            if(file == NULL)
+                usage_err("argument '%s' must be followed by a file name", arg);
+            if(num_queries == 0)
+                usage_err("--output has to come after the --query it's for");
+
+            queries[num_queries-1]->out = open_output(file);
+        }
+        else
+        {
+            add_input_file(&input, arg);
+        }
+    }
+
+    if(input.len == 0)
+    {
+        input.files[input.len++] = stdin;
+        input.total_bytes = -1;
+    }
+
+    for(int q = 0; q < num_queries; q++)
+        queries[q]->total_input_bytes = input.total_bytes;
+
+    /* one query is fed straight from the parser */
+    struct collate_state scan = { 0 };
+    struct collate_state *parsed = queries[0];
+    if(num_queries > 1)
+    {
+        init_scan(&scan, queries, num_queries);
+        parsed = &scan;
+    }
+
+    for(int i = 0; i < input.len; i++)
     {
-        init_parser(&state, &g, files[i]);
+        init_parser(&state, &g, input.files[i]);
 
-        register_callback(&state, "string", string_callback, &cs);
-        register_callback(&state, "value", value_callback, &cs);
-        register_callback(&state, "object", object_callback, &cs);
+        register_callback(&state, "string", string_callback, parsed);
+        register_callback(&state, "value", value_callback, parsed);
+        register_callback(&state, "object",
+                          num_queries > 1 ? multi_object_callback : object_callback, parsed);
 
         bool eof = false;
 
         while(!eof)
         {
-            for(int field = 0; field < cs.num_interesting_fields; field++)
-                cs.interesting_fields[field].is_set = false;
+            for(int field = 0; field < parsed->num_interesting_fields; field++)
+                parsed->interesting_fields[field].is_set = false;
 
             parse(&state, &eof);
             reinit_parse_state(&state);
         }
 
+        for(int q = 0; q < num_queries; q++)
+            queries[q]->input_bytes += state.offset;
         free_parse_state(&state);
     }
 
-    hscan_t scan;
-    hash_scan_begin(&scan, cs.clump_table);
-    hnode_t *node;
-    while((node = hash_scan_next(&scan)))
+    for(int q = 0; q < num_queries; q++)
     {
-        if(!cs.incremental)
-            dump_clump((struct clump*)node, &cs);
-        hash_scan_delete(cs.clump_table, node);
+        if(num_queries > 1 && queries[q]->show_stats)
+            fprintf(stderr, "recs-collate: query %d:\n", q + 1);
+        finish_query(queries[q]);
     }
 
     free_grammar(g);
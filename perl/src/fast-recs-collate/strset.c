@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "strset.h"
+#include "hll.h"
+
+void strset_init(struct strset *set)
+{
+    memset(set, 0, sizeof(*set));
+}
+
+static int strset_lookup(struct strset *set, const char *str, uint32_t hash)
+{
+    if(set->table_size == 0)
+    {
+        for(int i = 0; i < set->len; i++)
+            if(set->hashes[i] == hash && strcmp(strset_str(set, i), str) == 0)
+                return i;
+        return -1;
+    }
+
+    int mask = set->table_size - 1;
+    for(int slot = hash & mask; set->table[slot]; slot = (slot + 1) & mask)
+    {
+        int i = set->table[slot] - 1;
+        if(set->hashes[i] == hash && strcmp(strset_str(set, i), str) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* the index of str, or -1 if it isn't there */
+int strset_find(struct strset *set, const char *str)
+{
+    return strset_lookup(set, str, hash64(str, strlen(str), 0));
+}
+
+static void strset_table_insert(struct strset *set, int i)
+{
+    int mask = set->table_size - 1;
+    int slot = set->hashes[i] & mask;
+    while(set->table[slot])
+        slot = (slot + 1) & mask;
+    set->table[slot] = i + 1;
+}
+
+static void strset_rebuild_table(struct strset *set, struct arena *arena, int table_size)
+{
+    if(set->table)
+        arena_free(arena, set->table, sizeof(*set->table) * set->table_size);
+    set->table_size = table_size;
+    set->table = arena_alloc(arena, sizeof(*set->table) * table_size);
+    memset(set->table, 0, sizeof(*set->table) * table_size);
+    for(int i = 0; i < set->len; i++)
+        strset_table_insert(set, i);
+}
+
+/* put str in the set (if it isn't there already), and return its index */
+int strset_add(struct strset *set, struct arena *arena, const char *str)
+{
+    int len = strlen(str);
+    uint32_t hash = hash64(str, len, 0);
+    int i = strset_lookup(set, str, hash);
+    if(i >= 0)
+        return i;
+
+    if(set->len == set->size)
+    {
+        int size = set->size ? set->size * 2 : 4;
+        set->hashes = arena_realloc(arena, set->hashes, sizeof(*set->hashes) * set->size,
+                                    sizeof(*set->hashes) * size);
+        set->offsets = arena_realloc(arena, set->offsets, sizeof(*set->offsets) * set->size,
+                                     sizeof(*set->offsets) * size);
+        set->size = size;
+    }
+
+    if(set->strs_len + len + 1 > set->strs_size)
+    {
+        int size = set->strs_size ? set->strs_size * 2 : 64;
+        while(size < set->strs_len + len + 1)
+            size *= 2;
+        set->strs = arena_realloc(arena, set->strs, set->strs_size, size);
+        set->strs_size = size;
+    }
+
+    i = set->len++;
+    set->hashes[i] = hash;
+    set->offsets[i] = set->strs_len;
+    memcpy(set->strs + set->strs_len, str, len + 1);
+    set->strs_len += len + 1;
+
+    if(set->len > STRSET_SMALL && set->len * 2 > set->table_size)
+        strset_rebuild_table(set, arena, set->table_size ? set->table_size * 2 : 4 * STRSET_SMALL);
+    else if(set->table_size)
+        strset_table_insert(set, i);
+
+    return i;
+}
+
+size_t strset_memory(struct strset *set)
+{
+    size_t bytes = 0;
+    if(set->size)
+        bytes += arena_block_size(sizeof(*set->hashes) * set->size) +
+                 arena_block_size(sizeof(*set->offsets) * set->size);
+    if(set->table_size)
+        bytes += arena_block_size(sizeof(*set->table) * set->table_size);
+    if(set->strs_size)
+        bytes += arena_block_size(set->strs_size);
+    return bytes;
+}
+
+/* spill files are private to this process, so byte order doesn't matter */
+void strset_write(struct strset *set, FILE *out)
+{
+    fwrite(&set->strs_len, sizeof(set->strs_len), 1, out);
+    fwrite(set->strs, sizeof(char), set->strs_len, out);
+}
+
+/* into a set that's been through strset_init; false if in ends too soon */
+bool strset_read(struct strset *set, struct arena *arena, FILE *in)
+{
+    int len = 0;
+    if(fread(&len, sizeof(len), 1, in) != 1 || len < 0)
+        return false;
+    if(len == 0)
+        return true;
+
+    char *strs = malloc(len);
+    bool ok = fread(strs, sizeof(char), len, in) == (size_t)len && strs[len-1] == '\0';
+    if(ok)
+        for(char *str = strs; str < strs + len; str += strlen(str) + 1)
+            strset_add(set, arena, str);
+    free(strs);
+    return ok;
+}
+
+void strset_release(struct strset *set, struct arena *arena)
+{
+    if(set->size)
+    {
+        arena_free(arena, set->hashes, sizeof(*set->hashes) * set->size);
+        arena_free(arena, set->offsets, sizeof(*set->offsets) * set->size);
+    }
+    if(set->table_size)
+        arena_free(arena, set->table, sizeof(*set->table) * set->table_size);
+    if(set->strs_size)
+        arena_free(arena, set->strs, set->strs_size);
+    strset_init(set);
+}
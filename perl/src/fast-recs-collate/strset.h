@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STRSET_SMALL 8
+
+struct arena;
+
+/*
+ * A set of distinct strings, kept in an arena.  The strings themselves are
+ * packed one after another (NUL-terminated) in one block, and each has an
+ * index, in the order they were added.  Up to STRSET_SMALL of them are found
+ * by scanning their hashes; past that, a hash table of indexes (at most half
+ * full) takes over.
+ */
+struct strset
+{
+    int len;
+    int size;                   /* room in hashes and offsets */
+    uint32_t *hashes;
+    int *offsets;               /* of each string in strs */
+    int table_size;             /* 0 while there's no table */
+    int *table;                 /* index + 1, or 0 if the slot is empty */
+    int strs_len, strs_size;
+    char *strs;
+};
+
+static inline char *strset_str(struct strset *set, int i)
+{
+    return set->strs + set->offsets[i];
+}
+
+void strset_init(struct strset *set);
+int strset_find(struct strset *set, const char *str);
+int strset_add(struct strset *set, struct arena *arena, const char *str);
+size_t strset_memory(struct strset *set);
+void strset_write(struct strset *set, FILE *out);
+bool strset_read(struct strset *set, struct arena *arena, FILE *in);
+void strset_release(struct strset *set, struct arena *arena);
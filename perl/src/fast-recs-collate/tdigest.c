@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <math.h>
+#include "tdigest.h"
+
+#define TDIGEST_INITIAL_SIZE 16
+#define TDIGEST_PI 3.14159265358979323846
+
+/*
+ * Room for the merged centroids (never more than about compression / 2,
+ * with this scale function) and a buffer of values at least twice that, so
+ * that merges are rare enough to make adds O(1) amortized.
+ */
+void tdigest_init(struct tdigest *td, double compression)
+{
+    td->compression = compression;
+    td->len = 0;
+    td->merged_len = 0;
+    td->max_len = 6 * (int)ceil(compression) + 10;
+    td->size = TDIGEST_INITIAL_SIZE < td->max_len ? TDIGEST_INITIAL_SIZE : td->max_len;
+    td->centroids = malloc(sizeof(*td->centroids) * td->size);
+    td->total_weight = 0;
+    td->min = INFINITY;
+    td->max = -INFINITY;
+}
+
+static int cmp_centroid(const void *s1, const void *s2)
+{
+    const struct tdigest_centroid *c1 = s1, *c2 = s2;
+    if(c1->mean < c2->mean) return -1;
+    else if(c1->mean > c2->mean) return 1;
+    else return 0;
+}
+
+/* the k_1 scale function: a centroid may span at most 1 unit of k */
+static inline double tdigest_k(struct tdigest *td, double q)
+{
+    return td->compression / (2 * TDIGEST_PI) * asin(2 * q - 1);
+}
+
+/* merge the buffered values into the centroids */
+static void tdigest_compress(struct tdigest *td)
+{
+    if(td->len == td->merged_len)
+        return;
+
+    qsort(td->centroids, td->len, sizeof(*td->centroids), cmp_centroid);
+
+    struct tdigest_centroid *c = td->centroids;
+    struct tdigest_centroid cur = c[0];
+    double weight_so_far = 0;
+    int out = 0;
+    for(int i = 1; i < td->len; i++)
+    {
+        double proposed = cur.weight + c[i].weight;
+        double q0 = weight_so_far / td->total_weight;
+        double q2 = (weight_so_far + proposed) / td->total_weight;
+        if(tdigest_k(td, q2) - tdigest_k(td, q0) <= 1)
+        {
+            cur.mean += (c[i].mean - cur.mean) * c[i].weight / proposed;
+            cur.weight = proposed;
+        }
+        else
+        {
+            weight_so_far += cur.weight;
+            c[out++] = cur;
+            cur = c[i];
+        }
+    }
+    c[out++] = cur;
+
+    td->len = td->merged_len = out;
+}
+
+void tdigest_add(struct tdigest *td, double value, double weight)
+{
+    if(td->len == td->size)
+    {
+        if(td->size < td->max_len)
+        {
+            td->size = td->size * 2 < td->max_len ? td->size * 2 : td->max_len;
+            td->centroids = realloc(td->centroids, sizeof(*td->centroids) * td->size);
+        }
+        else
+        {
+            tdigest_compress(td);
+        }
+    }
+
+    td->centroids[td->len].mean = value;
+    td->centroids[td->len].weight = weight;
+    td->len++;
+    td->total_weight += weight;
+    if(value < td->min) td->min = value;
+    if(value > td->max) td->max = value;
+}
+
+void tdigest_merge(struct tdigest *td, struct tdigest *other)
+{
+    for(int i = 0; i < other->len; i++)
+        tdigest_add(td, other->centroids[i].mean, other->centroids[i].weight);
+
+    if(other->min < td->min) td->min = other->min;
+    if(other->max > td->max) td->max = other->max;
+}
+
+/*
+ * Interpolate between the centroids' means, taking each one to be centered
+ * on the middle of its weight (and the min and max to be at the ends).
+ */
+double tdigest_quantile(struct tdigest *td, double q)
+{
+    if(td->total_weight == 0)
+        return NAN;
+
+    tdigest_compress(td);
+
+    struct tdigest_centroid *c = td->centroids;
+    int n = td->len;
+    if(n == 1)
+        return c[0].mean;
+
+    double index = q * td->total_weight;
+    if(index < c[0].weight / 2)
+        return td->min + (c[0].mean - td->min) * index / (c[0].weight / 2);
+
+    double center = c[0].weight / 2;
+    for(int i = 0; i < n - 1; i++)
+    {
+        double next_center = center + (c[i].weight + c[i+1].weight) / 2;
+        if(index < next_center)
+            return c[i].mean + (c[i+1].mean - c[i].mean) *
+                   (index - center) / (next_center - center);
+        center = next_center;
+    }
+
+    double rest = td->total_weight - center;
+    if(index >= td->total_weight || rest <= 0)
+        return td->max;
+    return c[n-1].mean + (td->max - c[n-1].mean) * (index - center) / rest;
+}
+
+size_t tdigest_memory(struct tdigest *td)
+{
+    return sizeof(*td->centroids) * td->size;
+}
+
+/* spill files are private to this process, so byte order doesn't matter */
+void tdigest_write(struct tdigest *td, FILE *out)
+{
+    tdigest_compress(td);
+    fwrite(&td->len, sizeof(td->len), 1, out);
+    fwrite(td->centroids, sizeof(*td->centroids), td->len, out);
+    fwrite(&td->total_weight, sizeof(td->total_weight), 1, out);
+    fwrite(&td->min, sizeof(td->min), 1, out);
+    fwrite(&td->max, sizeof(td->max), 1, out);
+}
+
+/* into a td that's been through tdigest_init; false if in ends too soon */
+bool tdigest_read(struct tdigest *td, FILE *in)
+{
+    int len = 0;
+    if(fread(&len, sizeof(len), 1, in) != 1 || len < 0 || len > td->max_len)
+        return false;
+
+    if(len > td->size)
+    {
+        td->size = td->max_len;
+        td->centroids = realloc(td->centroids, sizeof(*td->centroids) * td->size);
+    }
+
+    td->len = td->merged_len = fread(td->centroids, sizeof(*td->centroids), len, in);
+    return td->len == len &&
+           fread(&td->total_weight, sizeof(td->total_weight), 1, in) == 1 &&
+           fread(&td->min, sizeof(td->min), 1, in) == 1 &&
+           fread(&td->max, sizeof(td->max), 1, in) == 1;
+}
+
+void tdigest_free(struct tdigest *td)
+{
+    free(td->centroids);
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * A merging t-digest (Dunning & Ertl), for estimating quantiles of a stream
+ * in bounded memory.  Values are buffered and then merged into at most about
+ * compression centroids, which are kept small near the tails: the error in
+ * rank at quantile q is about q * (1 - q) * 8 / compression, so the extreme
+ * quantiles are the most accurate.
+ */
+struct tdigest_centroid
+{
+    double mean;
+    double weight;
+};
+
+struct tdigest
+{
+    double compression;
+    int len;                    /* centroids, then unmerged values */
+    int merged_len;
+    int size;                   /* of centroids, up to max_len */
+    int max_len;
+    struct tdigest_centroid *centroids;
+    double total_weight;
+    double min, max;
+};
+
+void tdigest_init(struct tdigest *td, double compression);
+void tdigest_add(struct tdigest *td, double value, double weight);
+void tdigest_merge(struct tdigest *td, struct tdigest *other);
+double tdigest_quantile(struct tdigest *td, double q);
+size_t tdigest_memory(struct tdigest *td);
+void tdigest_write(struct tdigest *td, FILE *out);
+bool tdigest_read(struct tdigest *td, FILE *in);
+void tdigest_free(struct tdigest *td);
@@ -0,0 +1,286 @@
+import { describe, test, expect } from "bun:test";
+import type { JsonObject } from "../../src/types/json.ts";
+import { collate, collateBuilt, groupBy, makeRecords, sameValue, tsAggregate } from "./testHelper.ts";
+
+/**
+ * Run recs-collate with the aggregators (named by their specs) keyed by
+ * host, and check each group's values against the TypeScript aggregators'.
+ */
+function expectSameAsTs(specs: string[], records: JsonObject[], extraArgs: string[] = []): void {
+  const args = ["-k", "host", ...specs.flatMap((spec) => ["-a", `${spec}=${spec}`]), ...extraArgs];
+  const result = collate([...args, "--perfect"], records);
+  expect(result.exitCode).toBe(0);
+
+  const groups = groupBy(records, "host");
+  expect(result.records).toHaveLength(groups.size);
+  for (const r of result.records) {
+    const group = groups.get(String(r["host"]))!;
+    for (const spec of specs) {
+      const want = tsAggregate(spec, group);
+      if (!sameValue(r[spec]!, want)) {
+        expect({ [spec]: r[spec] }).toEqual({ [spec]: want });
+      }
+    }
+  }
+}
+
+describe.skipIf(!collateBuilt)("recs-collate percentiles", () => {
+  const records = makeRecords(20000);
+
+  test("perc and percmap match the TypeScript aggregators", () => {
+    expectSameAsTs(
+      ["perc,0,lat", "perc,50,lat", "perc,90,lat", "perc,100,lat", "perc,99.9,sz", "percmap,1 25 50 99,lat"],
+      records
+    );
+  });
+
+  test("percentiles of one field share their values and still match", () => {
+    // the first of these keeps the values and the rest read them
+    const specs = ["perc,10,sz", "perc,50,sz", "percmap,5 95,sz", "perc,75,sz"];
+    expectSameAsTs(specs, records);
+    expectSameAsTs(specs, records.slice(0, 50));
+  });
+
+  test("values that aren't numbers are skipped", () => {
+    const args = ["-k", "host", "-a", "perc,50,lat", "-a", "percmap,10 90,lat", "--perfect"];
+    const input = records.slice(0, 200).map((r, i) => (i % 3 ? r : { ...r, lat: "n/a" }));
+    const numbers = input.filter((r) => typeof r["lat"] === "number");
+
+    expect(collate(args, input).records).toEqual(collate(args, numbers).records);
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate percentile sketches", () => {
+  const records = makeRecords(20000);
+  const groups = groupBy(records, "host");
+  const quantiles = [1, 10, 50, 90, 99];
+
+  /** how far the value's rank in values is from q (both from 0 to 1) */
+  function rankError(values: number[], value: number, q: number): number {
+    const below = values.filter((v) => v < value).length / values.length;
+    const upTo = values.filter((v) => v <= value).length / values.length;
+    return q < below ? below - q : q > upTo ? q - upTo : 0;
+  }
+
+  function sketch(spec: string): JsonObject[] {
+    const result = collate(["-k", "host", "-a", `s=${spec}`, "--perfect"], records);
+    expect(result.exitCode).toBe(0);
+    expect(result.records).toHaveLength(groups.size);
+    return result.records;
+  }
+
+  test("tdigest is within its rank error", () => {
+    for (const r of sketch(`tdigest,100,${quantiles.join(" ")},lat`)) {
+      const values = groups.get(String(r["host"]))!.map((g) => g["lat"] as number);
+      for (const q of quantiles) {
+        const value = (r["s"] as JsonObject)[String(q)] as number;
+        const p = q / 100;
+        expect(rankError(values, value, p)).toBeLessThanOrEqual((p * (1 - p) * 8) / 100 + 0.002);
+      }
+    }
+  });
+
+  test("kll is within its rank error", () => {
+    for (const r of sketch(`kll,200,${quantiles.join(" ")},lat`)) {
+      const values = groups.get(String(r["host"]))!.map((g) => g["lat"] as number);
+      for (const q of quantiles) {
+        const value = (r["s"] as JsonObject)[String(q)] as number;
+        expect(rankError(values, value, q / 100)).toBeLessThanOrEqual(1.65 / 200);
+      }
+    }
+  });
+
+  test("hdrhistogram is within its precision of the exact percentile", () => {
+    for (const digits of [1, 2, 3]) {
+      for (const r of sketch(`hdr,${digits},${quantiles.join(" ")},sz`)) {
+        const group = groups.get(String(r["host"]))!;
+        for (const q of quantiles) {
+          const value = (r["s"] as JsonObject)[String(q)] as number;
+          const exact = tsAggregate(`perc,${q},sz`, group) as number;
+          expect(Math.abs(value - exact)).toBeLessThanOrEqual(Math.max(exact / 10 ** digits, 1));
+        }
+      }
+    }
+  });
+
+  test("bad sketch sizes are refused", () => {
+    for (const spec of ["kll,200.5,lat", "kll,4,lat", "hdr,0,sz", "hdr,4,sz", "hdr,2.5,sz", "tdigest,5,lat"]) {
+      const result = collate(["-k", "host", "-a", spec], records.slice(0, 10));
+      expect(result.exitCode).not.toBe(0);
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate distinct counts", () => {
+  const records = makeRecords(20000);
+
+  test("dcount matches the TypeScript aggregator", () => {
+    expectSameAsTs(["dcount,q", "dcount,uid", "dcount,lat"], records);
+    expectSameAsTs(["dcount,q", "dcount,uid"], records.slice(0, 30));
+  });
+
+  test("dcount stays exact when groups are merged or spilled", () => {
+    const exact = tsAggregate("dcount,uid", records);
+    for (const extra of [["--cube"], ["--cube", "--memory-limit", "16k"]]) {
+      const result = collate(["-k", "host", "-a", "dcount,uid", "--perfect", ...extra], records);
+      expect(result.records).toContainEqual({ host: "ALL", dcount_uid: exact });
+    }
+  });
+
+  test("hll is within three standard errors", () => {
+    const groups = groupBy(records, "host");
+    for (const precision of [6, 10, 14]) {
+      const result = collate(["-k", "host", "-a", `h=hll,${precision},lat`, "--perfect"], records);
+      expect(result.records).toHaveLength(groups.size);
+      for (const r of result.records) {
+        const exact = tsAggregate("dcount,lat", groups.get(String(r["host"]))!) as number;
+        const error = Math.abs((r["h"] as number) - exact) / exact;
+        expect(error).toBeLessThanOrEqual(3 * 1.04 / Math.sqrt(2 ** precision));
+      }
+    }
+  });
+
+  test("hll's precision is range-checked", () => {
+    for (const spec of ["hll,3,uid", "hll,19,uid", "hll,x,uid"]) {
+      expect(collate(["-a", spec], records.slice(0, 10)).exitCode).not.toBe(0);
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate runs of records for one group", () => {
+  // clustered by host, so most records go to the same group as the last one
+  // and are added a run at a time
+  const records = makeRecords(5000).sort((a, b) => String(a["host"]).localeCompare(String(b["host"])));
+  const batched = ["count", "sum,lat", "avg,lat", "min,sz", "max,sz", "var,lat", "corr,lat,sz", "cov,lat,sz"];
+
+  test("aggregators added a run at a time match the TypeScript aggregators", () => {
+    expectSameAsTs(batched, records);
+  });
+
+  test("runs mixed with aggregators that take one record at a time", () => {
+    expectSameAsTs([...batched, "concat,-,q", "perc,50,lat", "last,q"], records);
+  });
+
+  test("runs give the same results with --cube, --batch and interleaved input", () => {
+    const args = ["-k", "host,q", ...batched.flatMap((spec) => ["-a", spec]), "--perfect", "--cube"];
+    const shuffled = makeRecords(5000);
+    const expected = collate(args, shuffled).records;
+    const byKey = (rs: JsonObject[]): Map<string, JsonObject> =>
+      new Map(rs.map((r) => [`${r["host"]},${r["q"]}`, r]));
+
+    for (const [input, extra] of [[records, []], [records, ["--batch", "16"]], [shuffled, ["--batch", "16"]]] as const) {
+      const result = byKey(collate([...args, ...extra], input).records);
+      expect(result.size).toBe(expected.length);
+      for (const r of expected) {
+        expect(sameValue(result.get(`${r["host"]},${r["q"]}`)!, r)).toBe(true);
+      }
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate moment aggregators", () => {
+  const records = makeRecords(5000);
+  const specs = ["stddev,lat", "linreg,lat,sz", "ord2uni,lat", "ord2biv,lat,sz"];
+
+  test("stddev, linreg, ord2uni and ord2biv match the TypeScript aggregators", () => {
+    expectSameAsTs(specs, records);
+  });
+
+  test("they match when they share moments with var, cov and corr on the same fields", () => {
+    expectSameAsTs([...specs, "var,lat", "ord2uni,sz", "stddev,sz", "cov,lat,sz", "corr,lat,sz"], records);
+  });
+
+  test("they match for groups of one and two records", () => {
+    for (const n of [1, 2]) {
+      const input = [{ host: "a", lat: 1, sz: 2 }, { host: "a", lat: 3, sz: 5 }].slice(0, n);
+      expectSameAsTs(specs, input);
+    }
+  });
+
+  test("they match after groups are merged or spilled", () => {
+    const args = specs.flatMap((spec) => ["-a", `${spec}=${spec}`]);
+    for (const extra of [["--cube"], ["--cube", "--memory-limit", "8k"]]) {
+      const result = collate(["-k", "host", ...args, "--perfect", ...extra], records);
+      const total = result.records.find((r) => r["host"] === "ALL")!;
+      for (const spec of specs) {
+        expect(sameValue(total[spec]!, tsAggregate(spec, records))).toBe(true);
+      }
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate aggregators that keep values or records", () => {
+  const records = makeRecords(5000);
+  const specs = ["first,q", "last,q", "firstrec", "lastrec", "recformax,lat", "recformin,lat", "records"];
+
+  // values of every kind, with 1.0 written the way JSON.stringify would
+  const literals: JsonObject[] = [
+    { host: "a", v: 1, n: 3 }, { host: "a", v: true, n: 9 }, { host: "a", v: null, n: 1 },
+    { host: "b", v: { x: [1, "y"] }, n: 2 }, { host: "b", v: [1, 2.5, null], n: 7 }, { host: "b", v: false, n: 4 },
+    { host: null, v: "s", n: 5 }, { host: "c", v: "z", n: 1 }, { host: "c", v: 1.0, n: 2 },
+  ];
+
+  test("they match the TypeScript aggregators", () => {
+    expectSameAsTs(specs, records.slice(0, 500));
+  });
+
+  test("they keep true, false, null, objects and arrays as they were", () => {
+    expectSameAsTs(
+      ["first,v", "last,v", "firstrec", "lastrec", "recformax,n", "recformin,n", "records"],
+      literals
+    );
+  });
+
+  test("a null key stays null", () => {
+    const result = collate(["-k", "host", "-a", "first,v", "--perfect"], literals);
+    expect(result.records).toContainEqual({ host: null, first_v: "s" });
+  });
+
+  test("first and last are refused with --batch", () => {
+    for (const spec of ["first,v", "last,v"]) {
+      const result = collate(["-k", "host", "-a", spec, "--batch", "4"], literals);
+      expect(result.exitCode).not.toBe(0);
+      expect(result.stderr).toContain("--batch");
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate aggregators of distinct values", () => {
+  const records = makeRecords(5000);
+  const literals: JsonObject[] = [
+    { host: "a", v: 1, k: "x" }, { host: "a", v: "1", k: "y" }, { host: "a", v: true, k: "x" }, { host: "a", v: null, k: 1 },
+    { host: "b", v: { x: 1 }, k: true }, { host: "b", v: [1, 2.5], k: "z" }, { host: "b", v: false, k: null },
+    { host: "b", v: 1.5, k: 2 }, { host: "b", k: 3 },
+  ];
+
+  test("countby, uarray, uconcat, array and valuestokeys match the TypeScript aggregators", () => {
+    expectSameAsTs(["countby,q", "uarray,q", "uconcat,-,uid", "array,sz", "vk,q,uid"], records);
+  });
+
+  test("they treat true, false, null, objects and arrays as String() would", () => {
+    expectSameAsTs(["countby,v", "uarray,v", "uconcat,;,v", "array,v", "vk,k,v"], literals);
+  });
+
+  test("numbers are the same value however they're written", () => {
+    const text = ['{"host":"a","v":1}', '{"host":"a","v":1.0}', '{"host":"a","v":1e0}', '{"host":"a","v":10e-1}']
+      .map((line) => line + "\n")
+      .join("");
+    const result = collate(["-k", "host", "-a", "countby,v", "-a", "uarray,v", "--perfect"], text);
+    expect(result.records).toEqual([{ host: "a", countby_v: { "1": 4 }, uarray_v: ["1"] }]);
+  });
+
+  test("a delimiter with a quote or backslash is written as valid JSON", () => {
+    const result = collate(["-k", "host", "-a", 'u=uconcat,"\\,v', "--perfect"], literals);
+    expect(result.exitCode).toBe(0);
+    for (const r of result.records) {
+      expect(r["u"]).toBe(tsAggregate('uconcat,"\\,v', groupBy(literals, "host").get(String(r["host"]))!));
+    }
+  });
+
+  test("they're refused with --batch", () => {
+    for (const spec of ["countby,v", "uarray,v", "uconcat,-,v"]) {
+      const result = collate(["-k", "host", "-a", spec, "--batch", "4"], literals);
+      expect(result.exitCode).not.toBe(0);
+    }
+  });
+});
@@ -0,0 +1,46 @@
+import { describe, test, expect } from "bun:test";
+import { collate, collateBuilt, makeRecords } from "./testHelper.ts";
+
+describe.skipIf(!collateBuilt)("recs-collate --batch", () => {
+  // not a multiple of any batch size below, so the last batch is partial
+  const records = makeRecords(3003);
+  const aggs = ["-a", "count", "-a", "sum,lat", "-a", "max,sz", "-a", "concat,-,q"];
+
+  /** check that --batch writes just what it would have without it, in the same order */
+  function expectSameAsUnbatched(args: string[]): void {
+    const unbatched = collate(args, records);
+    expect(unbatched.exitCode).toBe(0);
+    for (const size of ["1", "16", "64", "5000"]) {
+      expect(collate([...args, "--batch", size], records).records).toEqual(unbatched.records);
+    }
+  }
+
+  test("gives the same groups with --perfect", () => {
+    expectSameAsUnbatched(["-k", "uid", ...aggs, "--perfect"]);
+    expectSameAsUnbatched(["-k", "host,q", ...aggs, "--perfect", "--cube"]);
+  });
+
+  test("evicts the same clumps in the same order with a bounded --size", () => {
+    for (const size of ["1", "7", "50", "400"]) {
+      expectSameAsUnbatched(["-k", "uid", ...aggs, "-n", size]);
+    }
+  });
+
+  test("writes the same records with --incremental", () => {
+    expectSameAsUnbatched(["-k", "uid", ...aggs, "-n", "50", "--incremental"]);
+  });
+
+  test("adds a batch that's cut short by the end of the input", () => {
+    const args = ["-k", "host", "-a", "count", "--perfect"];
+    for (const n of [1, 15, 17]) {
+      const input = records.slice(0, n);
+      expect(collate([...args, "--batch", "16"], input).records).toEqual(collate(args, input).records);
+    }
+  });
+
+  test("a batch size that isn't a positive integer is refused", () => {
+    for (const size of ["0", "-1", "x"]) {
+      expect(collate(["-k", "host", "-a", "count", "--batch", size], records.slice(0, 10)).exitCode).not.toBe(0);
+    }
+  });
+});
@@ -0,0 +1,135 @@
+import { describe, test, expect } from "bun:test";
+import type { JsonObject } from "../../src/types/json.ts";
+import { collate, collateBuilt, makeRecords, sameValue, sorted, tsAggregate } from "./testHelper.ts";
+
+/**
+ * The records of each group of each grouping: a grouping is the fields it
+ * keeps, and the rest of fields are written as ALL.
+ */
+function groupings(records: JsonObject[], fields: string[], sets: string[][]): Map<string, JsonObject[]> {
+  const groups = new Map<string, JsonObject[]>();
+  for (const set of sets) {
+    for (const r of records) {
+      const key = fields.map((f) => (set.includes(f) ? String(r[f]) : "ALL")).join(",");
+      groups.set(key, [...(groups.get(key) ?? []), r]);
+    }
+  }
+  return groups;
+}
+
+/** every subset of fields */
+function powerSet(fields: string[]): string[][] {
+  return fields.reduce<string[][]>((sets, f) => [...sets, ...sets.map((s) => [...s, f])], [[]]);
+}
+
+function expectGroupings(
+  result: ReturnType<typeof collate>,
+  fields: string[],
+  expected: Map<string, JsonObject[]>,
+  specs: string[]
+): void {
+  expect(result.exitCode).toBe(0);
+  expect(result.records).toHaveLength(expected.size);
+  for (const r of result.records) {
+    const group = expected.get(fields.map((f) => String(r[f])).join(","));
+    expect(group).toBeDefined();
+    for (const spec of specs) {
+      const want = tsAggregate(spec, group!);
+      const got = r[spec.replace(/,/g, "_")]!;
+      if (!sameValue(got, want)) {
+        expect(got).toEqual(want);
+      }
+    }
+  }
+}
+
+describe.skipIf(!collateBuilt)("recs-collate --cube", () => {
+  const records = makeRecords(2000);
+  const specs = ["count", "sum,lat", "max,sz", "avg,lat"];
+  const aggs = specs.flatMap((spec) => ["-a", spec]);
+
+  test("gives every combination of key fields and ALL", () => {
+    const fields = ["host", "q"];
+    const result = collate(["-k", "host,q", ...aggs, "--perfect", "--cube"], records);
+    expectGroupings(result, fields, groupings(records, fields, powerSet(fields)), specs);
+  });
+
+  test("--perfect builds the same cube by merging as by adding to every grouping", () => {
+    const args = ["-k", "host,uid,q", ...aggs, "--cube"];
+    const merged = collate([...args, "--perfect"], records).records;
+    const added = collate([...args, "-n", "1000000"], records).records;
+
+    expect(merged).toHaveLength(added.length);
+    const byKey = new Map(added.map((r) => [`${r["host"]},${r["uid"]},${r["q"]}`, r]));
+    for (const r of merged) {
+      const other = byKey.get(`${r["host"]},${r["uid"]},${r["q"]}`);
+      expect(other).toBeDefined();
+      expect(sameValue(r, other!)).toBe(true);
+    }
+  });
+
+  test("order sensitive aggregators keep their order in every grouping", () => {
+    const args = ["-k", "host,q", "-a", "concat,-,sz", "-a", "array,uid", "-a", "countby,uid", "--cube"];
+    const perfect = sorted(collate([...args, "--perfect"], records).records);
+    expect(perfect).toEqual(sorted(collate([...args, "-n", "1000000"], records).records));
+
+    const fields = ["host", "q"];
+    expectGroupings(
+      { records: perfect, stderr: "", exitCode: 0 },
+      fields,
+      groupings(records, fields, powerSet(fields)),
+      ["concat,-,sz", "array,uid", "countby,uid"]
+    );
+  });
+
+  test("--cube-default names the rolled up values", () => {
+    const result = collate(["-k", "host", "-a", "count", "--perfect", "--cube", "--cube-default", "*"], records);
+    expect(result.records).toContainEqual({ host: "*", count: records.length });
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate --rollup and --grouping-sets", () => {
+  const records = makeRecords(2000);
+  const specs = ["count", "sum,lat", "min,sz"];
+  const aggs = specs.flatMap((spec) => ["-a", spec]);
+
+  test("--rollup gives a subtotal for each level", () => {
+    const fields = ["host", "q", "uid"];
+    const result = collate(["--rollup", "host,q,uid", ...aggs, "--perfect"], records);
+    const sets = [["host", "q", "uid"], ["host", "q"], ["host"], []];
+    expectGroupings(result, fields, groupings(records, fields, sets), specs);
+  });
+
+  test("--key fields are kept in every --rollup level", () => {
+    const fields = ["host", "q", "uid"];
+    const result = collate(["-k", "host", "--rollup", "q,uid", ...aggs, "--perfect"], records);
+    const sets = [["host", "q", "uid"], ["host", "q"], ["host"]];
+    expectGroupings(result, fields, groupings(records, fields, sets), specs);
+  });
+
+  test("--grouping-sets gives exactly the sets listed", () => {
+    const fields = ["host", "q", "uid"];
+    const result = collate(["--grouping-sets", "host,q;uid;()", ...aggs, "--perfect"], records);
+    const sets = [["host", "q"], ["uid"], []];
+    expectGroupings(result, fields, groupings(records, fields, sets), specs);
+  });
+
+  test("--perfect gives the same groupings as adding to each of them", () => {
+    const args = ["--grouping-sets", "host;q;()", ...aggs];
+    const perfect = sorted(collate([...args, "--perfect"], records).records);
+    const bounded = sorted(collate([...args, "-n", "100000"], records).records);
+
+    expect(perfect).toHaveLength(bounded.length);
+    perfect.forEach((r, i) => expect(sameValue(r, bounded[i]!)).toBe(true));
+    const total = perfect.find((r) => r["host"] === "ALL" && r["q"] === "ALL");
+    expect(total?.["count"]).toBe(records.length);
+  });
+
+  test("an empty set is refused", () => {
+    for (const sets of ["host;;q", "host; ;q", "host;"]) {
+      const result = collate(["--grouping-sets", sets, "-a", "count"], records.slice(0, 10));
+      expect(result.exitCode).not.toBe(0);
+      expect(result.stderr).toContain("empty set");
+    }
+  });
+});
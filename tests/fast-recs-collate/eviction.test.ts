@@ -0,0 +1,116 @@
+import { describe, test, expect } from "bun:test";
+import type { JsonObject } from "../../src/types/json.ts";
+import { collate, collateBuilt, groupBy, makeRecords } from "./testHelper.ts";
+
+const POLICIES = ["lru", "clock", "tinylfu"];
+
+/**
+ * The total of field over the partial groups written for each key (an
+ * evicted group is written out, and its key starts a new group if it comes
+ * back).
+ */
+function totals(records: JsonObject[], key: string, field: string): Map<string, number> {
+  const result = new Map<string, number>();
+  for (const r of records) {
+    const k = String(r[key]);
+    result.set(k, (result.get(k) ?? 0) + (r[field] as number));
+  }
+  return result;
+}
+
+describe.skipIf(!collateBuilt)("recs-collate --max-memory", () => {
+  const records = makeRecords(3000);
+  const groups = groupBy(records, "uid");
+
+  for (const policy of POLICIES) {
+    test(`--eviction ${policy} writes every record's values exactly once`, () => {
+      const result = collate(
+        ["-k", "uid", "-a", "count", "-a", "sum,sz", "--max-memory", "8k",
+         "--eviction", policy, "--stats"],
+        records
+      );
+      expect(result.exitCode).toBe(0);
+      expect(Number(/clumps evicted: *(\d+)/.exec(result.stderr)![1])).toBeGreaterThan(0);
+
+      const counts = totals(result.records, "uid", "count");
+      const sums = totals(result.records, "uid", "sum_sz");
+      expect(counts.size).toBe(groups.size);
+      for (const [uid, group] of groups) {
+        expect(counts.get(uid)).toBe(group.length);
+        expect(sums.get(uid)).toBe(group.reduce((sum, r) => sum + (r["sz"] as number), 0));
+      }
+    });
+
+    test(`--eviction ${policy} stays near the limit with values of any size`, () => {
+      const result = collate(
+        ["-k", "uid", "-a", "count", "-a", "concat,-,q", "-a", "perc,50,lat",
+         "--max-memory", "16k", "--eviction", policy, "--stats"],
+        records
+      );
+      expect(result.exitCode).toBe(0);
+
+      // it purges once a group has grown past the limit, so it can go
+      // over by about one record's values
+      const peak = Number(/memory: .*\(peak (\d+)\)/.exec(result.stderr)![1]);
+      expect(peak).toBeLessThan(16 * 1024 * 1.25);
+
+      const seen = new Map<string, number>();
+      for (const r of result.records) {
+        const uid = String(r["uid"]);
+        seen.set(uid, (seen.get(uid) ?? 0) + (r["count"] as number));
+      }
+      for (const [uid, group] of groups) {
+        expect(seen.get(uid)).toBe(group.length);
+      }
+    });
+  }
+
+  test("with room for every group, no policy evicts anything", () => {
+    for (const policy of POLICIES) {
+      const result = collate(
+        ["-k", "host", "-a", "count", "--max-memory", "1M", "--eviction", policy],
+        records
+      );
+      expect(result.records).toHaveLength(groupBy(records, "host").size);
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate --size auto", () => {
+  // about 3000 keys, more than the 1024 clumps it starts with
+  const records = makeRecords(60000);
+  const groups = groupBy(records, "uid", "host");
+
+  test("grows past a working set bigger than it starts with, counting every record once", () => {
+    const result = collate(["-k", "uid,host", "-a", "count", "--size", "auto", "--stats"], records);
+    expect(result.exitCode).toBe(0);
+
+    const counts = new Map<string, number>();
+    for (const r of result.records) {
+      const key = `${r["uid"]},${r["host"]}`;
+      counts.set(key, (counts.get(key) ?? 0) + (r["count"] as number));
+    }
+    expect(counts.size).toBe(groups.size);
+    for (const [key, group] of groups) {
+      expect(counts.get(key)).toBe(group.length);
+    }
+
+    const [, size, grew] = /auto size: +(\d+) clumps \(grew (\d+) times/.exec(result.stderr)!;
+    expect(Number(grew)).toBeGreaterThan(0);
+    expect(Number(size)).toBeGreaterThan(1024);
+    expect(result.stderr).toMatch(/record \d+: 1024 -> \d+ clumps/);
+
+    // with more room, fewer keys are split up than at the size it started with
+    expect(result.records.length).toBeLessThan(
+      collate(["-k", "uid,host", "-a", "count", "-n", "1024"], records).records.length * 0.75
+    );
+  });
+
+  test("doesn't grow past --max-memory", () => {
+    const result = collate(["-k", "uid,host", "-a", "count", "--size", "auto:64k", "--stats"], records);
+    expect(result.exitCode).toBe(0);
+    const peak = Number(/memory: .*\(peak (\d+)\)/.exec(result.stderr)![1]);
+    expect(peak).toBeLessThan(64 * 1024 * 1.25);
+    expect(result.records.reduce((sum, r) => sum + (r["count"] as number), 0)).toBe(records.length);
+  });
+});
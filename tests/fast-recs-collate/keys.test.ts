@@ -0,0 +1,56 @@
+import { describe, test, expect } from "bun:test";
+import { collate, collateBuilt, makeRecords, sorted } from "./testHelper.ts";
+
+describe.skipIf(!collateBuilt)("recs-collate integer keys", () => {
+  const records = makeRecords(3000);
+
+  test("integer-looking keys group the same whether stored as integers or strings", () => {
+    const args = ["-a", "count", "-a", "sum,lat", "--perfect"];
+    const auto = collate(["-k", "uid,host", ...args], records);
+    const ints = collate(["-k", "uid:int,host", ...args], records);
+    const strs = collate(["-k", "uid:str,host:str", ...args], records);
+
+    expect(auto.exitCode).toBe(0);
+    expect(sorted(auto.records)).toEqual(sorted(strs.records));
+    expect(sorted(ints.records)).toEqual(sorted(strs.records));
+  });
+
+  test("keys that only look a bit like integers stay separate", () => {
+    const input = [
+      { k: "007" },
+      { k: 7 },
+      { k: "7" },
+      { k: -3 },
+      { k: "+7" },
+      { k: 1.5 },
+      { k: "x" },
+      { k: 7 },
+      {},
+    ];
+    const args = ["-a", "count", "--perfect"];
+    const strs = sorted(collate(["-k", "k:str", ...args], input).records);
+
+    expect(sorted(collate(["-k", "k", ...args], input).records)).toEqual(strs);
+    expect(sorted(collate(["-k", "k:int", ...args], input).records)).toEqual(strs);
+    expect(strs).toContainEqual({ k: "7", count: 3 });
+    expect(strs).toContainEqual({ k: "007", count: 1 });
+    expect(strs).toContainEqual({ k: null, count: 1 });
+  });
+
+  test("integers past 64 bits don't wrap around", () => {
+    const input = [
+      { k: 9223372036854775807 },
+      { k: "9223372036854775808" },
+      { k: "-9223372036854775809" },
+    ];
+    const result = collate(["-k", "k", "-a", "count", "--perfect"], input);
+    expect(result.records).toHaveLength(3);
+  });
+
+  test("more than 32 key fields is an error", () => {
+    const keys = Array.from({ length: 33 }, (_, i) => `f${i}`).join(",");
+    const result = collate(["-k", keys, "-a", "count"], records.slice(0, 10));
+    expect(result.exitCode).not.toBe(0);
+    expect(result.stderr).toContain("32");
+  });
+});
@@ -0,0 +1,60 @@
+import { describe, test, expect, beforeAll, afterAll } from "bun:test";
+import { mkdtempSync, rmSync, writeFileSync } from "node:fs";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
+import { collate, collateBuilt, makeRecords, sorted } from "./testHelper.ts";
+
+describe.skipIf(!collateBuilt)("recs-collate --expected-groups", () => {
+  // more than the 4M bytes that auto looks at before guessing
+  const records = makeRecords(80000);
+  const args = ["-k", "uid,q", "-a", "count", "-a", "sum,sz", "--perfect"];
+  let tempDir: string;
+  let file: string;
+
+  beforeAll(() => {
+    tempDir = mkdtempSync(join(tmpdir(), "recs-collate-presize-"));
+    file = join(tempDir, "records.json");
+    writeFileSync(file, records.map((r) => JSON.stringify(r) + "\n").join(""));
+  });
+
+  afterAll(() => {
+    rmSync(tempDir, { recursive: true, force: true });
+  });
+
+  test("a number of groups gives the same groups", () => {
+    const expected = sorted(collate(args, records).records);
+    for (const groups of ["1", "100", "10000", "1000000"]) {
+      const result = collate([...args, "--expected-groups", groups, "--stats"], records);
+      expect(result.exitCode).toBe(0);
+      expect(sorted(result.records)).toEqual(expected);
+      expect(result.stderr).toContain(`expected groups:   ${groups} (from --expected-groups)`);
+    }
+  });
+
+  test("auto guesses from the start of a file or a pipe and gives the same groups", () => {
+    const expected = sorted(collate(args, records).records);
+    for (const [input, extra] of [["", [file]], [records, []]] as const) {
+      const result = collate([...args, "--expected-groups", "auto", "--stats", ...extra], input);
+      expect(result.exitCode).toBe(0);
+      expect(sorted(result.records)).toEqual(expected);
+
+      const guess = Number(/expected groups: +(\d+) \(estimated from the first \d+ bytes\)/.exec(result.stderr)![1]);
+      expect(guess).toBeGreaterThan(expected.length / 2);
+      expect(guess).toBeLessThan(expected.length * 2);
+    }
+  });
+
+  test("more groups than a table can hold are refused", () => {
+    for (const groups of ["0", "-5", "2147483648", "99999999999999999999", "lots"]) {
+      const result = collate(["-k", "uid", "-a", "count", "--expected-groups", groups], records.slice(0, 10));
+      expect(result.exitCode).not.toBe(0);
+      expect(result.stderr).toContain("--expected-groups");
+    }
+  });
+
+  test("a table too big to allocate up front still grows as it goes", () => {
+    const result = collate([...args, "--expected-groups", "2147483647"], records.slice(0, 1000));
+    expect(result.exitCode).toBe(0);
+    expect(sorted(result.records)).toEqual(sorted(collate(args, records.slice(0, 1000)).records));
+  });
+});
@@ -0,0 +1,73 @@
+import { describe, test, expect, beforeAll, afterAll } from "bun:test";
+import { mkdtempSync, readFileSync, rmSync } from "node:fs";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
+import type { JsonObject } from "../../src/types/json.ts";
+import { collate, collateBuilt, makeRecords, sorted } from "./testHelper.ts";
+
+function readRecords(file: string): JsonObject[] {
+  return readFileSync(file, "utf8")
+    .split("\n")
+    .filter((line) => line.length > 0)
+    .map((line) => JSON.parse(line) as JsonObject);
+}
+
+describe.skipIf(!collateBuilt)("recs-collate --query", () => {
+  const records = makeRecords(2000);
+  let tempDir: string;
+
+  beforeAll(() => {
+    tempDir = mkdtempSync(join(tmpdir(), "recs-collate-query-"));
+  });
+
+  afterAll(() => {
+    rmSync(tempDir, { recursive: true, force: true });
+  });
+
+  test("each query writes what it would on its own", () => {
+    const queries = [
+      ["-k", "host", "-a", "count", "-a", "sum,lat", "--perfect"],
+      ["-k", "uid", "-a", "max,sz", "-n", "5"],
+      ["-k", "host,q", "-a", "count", "--perfect", "--cube"],
+    ];
+    const args = queries.flatMap((query, i) => [
+      "--query", query.join(" "), "--output", join(tempDir, `all-${i}.json`),
+    ]);
+    expect(collate(args, records).exitCode).toBe(0);
+
+    queries.forEach((query, i) => {
+      const alone = collate(query, records).records;
+      expect(sorted(readRecords(join(tempDir, `all-${i}.json`)))).toEqual(sorted(alone));
+    });
+  });
+
+  test("quoted arguments keep their spaces", () => {
+    const result = collate(
+      ["--query", `-k host -a 'concat,a b,q' -a "x y=count" --perfect`,
+       "--output", join(tempDir, "quoted.json")],
+      records
+    );
+    expect(result.exitCode).toBe(0);
+
+    const alone = collate(["-k", "host", "-a", "concat,a b,q", "-a", "x y=count", "--perfect"], records);
+    const written = readRecords(join(tempDir, "quoted.json"));
+    expect(sorted(written)).toEqual(sorted(alone.records));
+    expect(Object.keys(written[0]!)).toEqual(["host", "concat_a b_q", "x y"]);
+  });
+
+  test("queries without --output write to stdout", () => {
+    const first = ["-k", "host", "-a", "count", "--perfect"];
+    const second = ["-k", "q", "-a", "count", "--perfect"];
+    const result = collate(["--query", first.join(" "), "--query", second.join(" ")], records);
+
+    expect(result.exitCode).toBe(0);
+    expect(sorted(result.records)).toEqual(
+      sorted([...collate(first, records).records, ...collate(second, records).records])
+    );
+  });
+
+  test("a bad argument in a query is an error", () => {
+    const result = collate(["--query", "-k host --eviction bogus"], records.slice(0, 10));
+    expect(result.exitCode).not.toBe(0);
+  });
+});
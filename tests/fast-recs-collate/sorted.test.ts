@@ -0,0 +1,66 @@
+import { describe, test, expect } from "bun:test";
+import type { JsonObject } from "../../src/types/json.ts";
+import { collate, collateBuilt, makeRecords, sorted } from "./testHelper.ts";
+
+/** the records in order of the fields' values as strings, like recs-sort's default */
+function sortBy(records: JsonObject[], ...fields: string[]): JsonObject[] {
+  const key = (r: JsonObject): string[] => fields.map((f) => String(r[f]));
+  return [...records].sort((a, b) => {
+    const ka = key(a);
+    const kb = key(b);
+    for (let i = 0; i < fields.length; i++) {
+      if (ka[i]! !== kb[i]!) return ka[i]! < kb[i]! ? -1 : 1;
+    }
+    return 0;
+  });
+}
+
+describe.skipIf(!collateBuilt)("recs-collate --assume-sorted and --verify-sorted", () => {
+  const records = makeRecords(3000);
+  const aggs = ["-a", "count", "-a", "sum,lat", "-a", "max,sz", "-a", "concat,-,q"];
+
+  test("sorted input gives the same groups as --perfect, in order", () => {
+    for (const keys of [["host"], ["host", "q"], ["uid"], ["q", "uid"]]) {
+      const input = sortBy(records, ...keys);
+      const args = ["-k", keys.join(","), ...aggs];
+      const perfect = collate([...args, "--perfect"], input).records;
+
+      for (const mode of ["--assume-sorted", "--verify-sorted"]) {
+        const result = collate([...args, mode], input);
+        expect(result.exitCode).toBe(0);
+        expect(result.records).toEqual(sortBy(perfect, ...keys));
+      }
+    }
+  });
+
+  test("sorted input with --cube gives the same groups as --perfect", () => {
+    const input = sortBy(records, "host", "q");
+    // the order values reach a rolled up group in is checked in cube.test.ts
+    const args = ["-k", "host,q", "-a", "count", "-a", "sum,sz", "-a", "max,lat", "--cube"];
+    const result = collate([...args, "--verify-sorted"], input);
+    expect(result.exitCode).toBe(0);
+    expect(sorted(result.records)).toEqual(sorted(collate([...args, "--perfect"], input).records));
+  });
+
+  test("--verify-sorted fails on the first record out of order", () => {
+    const input = sortBy(records.slice(0, 100), "host");
+    const out = [input[0]!, input[1]!, input[2]!, input.at(-1)!, input[3]!];
+    const result = collate(["-k", "host", "-a", "count", "--verify-sorted"], out);
+
+    expect(result.exitCode).toBe(1);
+    expect(result.stderr).toContain("record 5 comes after a record with a greater key");
+  });
+
+  test("keys are in order as strings, even ones that look like numbers", () => {
+    const args = ["-k", "n", "-a", "count", "--verify-sorted"];
+    const asStrings = [1, 10, 2, 9].map((n) => ({ n }));
+    const asNumbers = [1, 2, 9, 10].map((n) => ({ n }));
+
+    expect(collate(args, asStrings).exitCode).toBe(0);
+    expect(collate(args, asStrings).records.map((r) => r["n"])).toEqual(["1", "10", "2", "9"]);
+
+    const result = collate(args, asNumbers);
+    expect(result.exitCode).toBe(1);
+    expect(result.stderr).toContain("record 4 comes after a record with a greater key");
+  });
+});
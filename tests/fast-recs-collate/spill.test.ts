@@ -0,0 +1,95 @@
+import { describe, test, expect } from "bun:test";
+import { COLLATE_BIN, collate, collateBuilt, groupBy, makeRecords, sorted } from "./testHelper.ts";
+
+describe.skipIf(!collateBuilt)("recs-collate --perfect --memory-limit", () => {
+  const records = makeRecords(3000);
+  const aggregators = [
+    "-a", "count",
+    "-a", "sum,lat",
+    "-a", "perc,90,lat",
+    "-a", "concat,-,sz",
+    "-a", "array,q",
+    "-a", "dcount,q",
+    "-a", "first,sz",
+    "-a", "last,sz",
+    "-a", "mode,q",
+  ];
+
+  function spilled(args: string[], limit: string): ReturnType<typeof collate> {
+    const result = collate([...args, "--memory-limit", limit, "--stats"], records);
+    expect(result.exitCode).toBe(0);
+    expect(result.stderr).toContain("spills:");
+    return result;
+  }
+
+  test("spilling gives the same groups as keeping them all in memory", () => {
+    const args = ["-k", "uid,q", ...aggregators, "--perfect"];
+    const inMemory = sorted(collate(args, records).records);
+
+    expect(inMemory).toHaveLength(groupBy(records, "uid", "q").size);
+    expect(sorted(spilled(args, "64k").records)).toEqual(inMemory);
+  });
+
+  test("a spill file bigger than the limit is split again when it's merged", () => {
+    // at 4k each of the top-level spill files holds far more than the
+    // limit, so merging one has to split it again on the next bits of the
+    // key hash rather than read it all back in at once
+    const args = ["-k", "uid,q", ...aggregators, "--perfect"];
+    const inMemory = sorted(collate(args, records).records);
+    const result = spilled(args, "4k");
+
+    expect(sorted(result.records)).toEqual(inMemory);
+    const peak = Number(/memory: .*\(peak (\d+)\)/.exec(result.stderr)![1]);
+    expect(peak).toBeLessThan(4 * 4096);
+  });
+
+  test("spilling works with --cube and --rollup", () => {
+    for (const cubing of [["--cube"], ["--rollup", "uid"]]) {
+      // the order values reach a rolled up group in is checked in cube.test.ts
+      const args = ["-k", "host,q", "-a", "count", "-a", "sum,sz", "-a", "perc,90,lat", "--perfect", ...cubing];
+      const inMemory = sorted(collate(args, records).records);
+
+      expect(sorted(spilled(args, "4k").records)).toEqual(inMemory);
+    }
+  });
+
+  test("counts are right after spilling", () => {
+    const result = spilled(["-k", "uid", "-a", "count", "--perfect"], "4k");
+    const groups = groupBy(records, "uid");
+
+    expect(result.records).toHaveLength(groups.size);
+    for (const r of result.records) {
+      expect(r["count"]).toBe(groups.get(String(r["uid"]))!.length);
+    }
+  });
+
+  test("every aggregator's own spill data is read back whole, empty or not", () => {
+    // some fields are missing or null, so some clumps have nothing kept
+    const sparse = records.map((r, i) => ({ ...r, v: i % 3 ? r["lat"] : null, w: i % 4 ? r["q"] : undefined }));
+    const args = [
+      "-k", "uid",
+      "-a", "tdigest,50,50,v", "-a", "kll,50,50,v", "-a", "hdr,2,50,sz", "-a", "hll,8,w",
+      "-a", "perc,50,v", "-a", "concat,-,q", "-a", "mode,q", "-a", "dcount,w",
+      "-a", "countby,w", "-a", "uarray,w", "-a", "uconcat,-,w", "-a", "vk,w,v",
+      "-a", "first,w", "-a", "last,w", "-a", "recformax,v", "-a", "lastrec", "-a", "array,w",
+      "--perfect",
+    ];
+    const result = collate([...args, "--memory-limit", "4k", "--stats"], sparse);
+    expect(result.exitCode).toBe(0);
+    expect(result.stderr).toContain("spills:");
+    expect(sorted(result.records)).toEqual(sorted(collate(args, sparse).records));
+  });
+
+  test("a spill file that can't be written in full is an error", () => {
+    // spill files over 64K can't be written, and the signal that would say
+    // so is ignored, so the writes come up short
+    const input = makeRecords(20000).map((r) => JSON.stringify(r) + "\n").join("");
+    const proc = Bun.spawnSync(
+      ["sh", "-c", `ulimit -f 64; trap '' XFSZ; exec "$0" "$@"`, COLLATE_BIN,
+       "-k", "uid,q", "-a", "count", "-a", "concat,-,q", "--perfect", "--memory-limit", "64k"],
+      { stdin: Buffer.from(input) }
+    );
+    expect(proc.exitCode).not.toBe(0);
+    expect(proc.stderr.toString()).toContain("error using spill file");
+  });
+});
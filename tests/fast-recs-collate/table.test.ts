@@ -0,0 +1,145 @@
+import { describe, test, expect } from "bun:test";
+import type { JsonObject } from "../../src/types/json.ts";
+import { collate, collateBuilt, groupBy, makeRecords } from "./testHelper.ts";
+
+/**
+ * The count and sum of sz written for each key of records, adding up the
+ * partial groups written when a group is evicted and its key comes back.
+ */
+function totals(records: JsonObject[], ...keys: string[]): Map<string, [number, number]> {
+  const result = new Map<string, [number, number]>();
+  for (const r of records) {
+    const key = keys.map((k) => String(r[k])).join(",");
+    const [count, sum] = result.get(key) ?? [0, 0];
+    result.set(key, [count + (r["count"] as number), sum + (r["sum_sz"] as number)]);
+  }
+  return result;
+}
+
+function expectTotals(result: ReturnType<typeof collate>, input: JsonObject[], ...keys: string[]): void {
+  expect(result.exitCode).toBe(0);
+  const groups = groupBy(input, ...keys);
+  const written = totals(result.records, ...keys);
+  expect(written.size).toBe(groups.size);
+  for (const [key, group] of groups) {
+    expect(written.get(key)).toEqual([group.length, group.reduce((sum, r) => sum + (r["sz"] as number), 0)]);
+  }
+}
+
+describe.skipIf(!collateBuilt)("recs-collate small clump table", () => {
+  // 10 keys for a while, then a new key every few records up to 40, so the
+  // table fills up past 16 part way through
+  const records = makeRecords(2000).map((r, i) => ({
+    ...r,
+    k: `k${i < 500 ? i % 10 : (i * 7) % Math.min(40, 10 + Math.floor((i - 500) / 4))}`,
+  }));
+  const aggs = ["-a", "count", "-a", "sum,sz"];
+
+  test("groups are the same before and after it moves to the hash table", () => {
+    expectTotals(collate(["-k", "k", ...aggs, "--perfect"], records), records, "k");
+    expect(collate(["-k", "k", ...aggs, "--perfect"], records).records).toHaveLength(40);
+  });
+
+  test("every record is counted once with room for 16 clumps or just past it", () => {
+    for (const size of ["15", "16", "17", "18"]) {
+      expectTotals(collate(["-k", "k", ...aggs, "-n", size], records), records, "k");
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate --hot-cache", () => {
+  const records = makeRecords(3000).map((r) => ({ ...r, k: (r["uid"] as number) % 40 }));
+  const aggs = ["-a", "count", "-a", "sum,sz"];
+
+  test("an evicted clump is never found in the cache", () => {
+    // fewer clumps than keys (but more than fit in the small table), so
+    // keys are evicted and come back while the cache still has their slots
+    for (const size of ["20", "32"]) {
+      const args = ["-k", "k", ...aggs, "-n", size];
+      const result = collate([...args, "--hot-cache", "64", "--stats"], records);
+
+      expectTotals(result, records, "k");
+      expect(Number(/clumps evicted: *(\d+)/.exec(result.stderr)![1])).toBeGreaterThan(0);
+      expect(Number(/hot cache hits: *(\d+)/.exec(result.stderr)![1])).toBeGreaterThan(0);
+      expect(result.records).toEqual(collate([...args, "--hot-cache", "0"], records).records);
+    }
+  });
+
+  test("any size of cache gives the same groups", () => {
+    const args = ["-k", "uid,host", ...aggs, "--perfect"];
+    const expected = collate([...args, "--hot-cache", "0"], records).records;
+    for (const size of ["1", "2", "256", "4096"]) {
+      expect(collate([...args, "--hot-cache", size], records).records).toEqual(expected);
+    }
+  });
+
+  test("a size that isn't a power of two is refused", () => {
+    for (const size of ["3", "-1", "x"]) {
+      expect(collate(["-k", "uid", "-a", "count", "--hot-cache", size], records.slice(0, 10)).exitCode).not.toBe(0);
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate runs of records with the same key", () => {
+  // runs of 1 to 6 records with the same host and uid, from 60 of them
+  const records: JsonObject[] = [];
+  const base = makeRecords(3000);
+  for (let run = 0, i = 0; i < base.length; run++) {
+    for (let n = 1 + (run % 6); n > 0 && i < base.length; n--, i++) {
+      records.push({ ...base[i]!, host: `h${run % 3}`, uid: (run * 37) % 60 });
+    }
+  }
+  const aggs = ["-a", "count", "-a", "sum,sz"];
+
+  /** the perfect groups' count and sum of sz, by their keys */
+  function perfectTotals(args: string[], ...keys: string[]): Map<string, [number, number]> {
+    return totals(collate([...args, "--perfect"], records).records, ...keys);
+  }
+
+  test("evictions between runs give the same totals as --perfect", () => {
+    for (const size of ["1", "2", "5", "17"]) {
+      const args = ["-k", "host,uid", ...aggs];
+      const result = collate([...args, "-n", size, "--stats"], records);
+      expect(result.exitCode).toBe(0);
+      expect(Number(/clumps evicted: *(\d+)/.exec(result.stderr)![1])).toBeGreaterThan(0);
+      expect(totals(result.records, "host", "uid")).toEqual(perfectTotals(args, "host", "uid"));
+    }
+  });
+
+  test("evictions between runs give the same totals as --perfect with --cube", () => {
+    // a cube needs a clump for each of its 4 groupings
+    for (const size of ["4", "5", "8", "40"]) {
+      const args = ["-k", "host,uid", ...aggs, "--cube"];
+      const result = collate([...args, "-n", size], records);
+      expect(result.exitCode).toBe(0);
+      expect(totals(result.records, "host", "uid")).toEqual(perfectTotals(args, "host", "uid"));
+    }
+  });
+
+  test("a group evicted while a record is added to it isn't added to again", () => {
+    // concat and perc grow as they're added to, so --max-memory evicts part way through a run
+    for (const policy of ["lru", "clock", "tinylfu"]) {
+      for (const cubing of [[], ["--cube"]]) {
+        const args = ["-k", "host,uid", ...aggs, "-a", "concat,-,q", "-a", "perc,50,lat", ...cubing];
+        const result = collate([...args, "--max-memory", "8k", "--eviction", policy], records);
+        expect(result.exitCode).toBe(0);
+        expect(totals(result.records, "host", "uid")).toEqual(perfectTotals(args, "host", "uid"));
+      }
+    }
+  });
+
+  test("--adjacent writes each run as a group", () => {
+    const result = collate(["-k", "host,uid", ...aggs, "--adjacent"], records);
+    const runs: JsonObject[] = [];
+    for (const r of records) {
+      const last = runs.at(-1);
+      if (last && last["host"] === r["host"] && last["uid"] === String(r["uid"])) {
+        (last["count"] as number)++;
+        (last["sum_sz"] as number) += r["sz"] as number;
+      } else {
+        runs.push({ host: r["host"], uid: String(r["uid"]), count: 1, sum_sz: r["sz"] });
+      }
+    }
+    expect(result.records).toEqual(runs);
+  });
+});
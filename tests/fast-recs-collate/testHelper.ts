@@ -0,0 +1,136 @@
+import { existsSync } from "node:fs";
+import { join } from "node:path";
+import { Record } from "../../src/Record.ts";
+import type { JsonObject, JsonValue } from "../../src/types/json.ts";
+
+// Import registry to ensure all aggregators are registered
+import "../../src/aggregators/registry.ts";
+import { aggregatorRegistry } from "../../src/Aggregator.ts";
+
+/**
+ * The C recs-collate in perl/src/fast-recs-collate.  Its tests are skipped
+ * unless it's been built there (with its Makefile).
+ */
+export const COLLATE_BIN = join(
+  import.meta.dir,
+  "..",
+  "..",
+  "perl",
+  "src",
+  "fast-recs-collate",
+  "recs-collate"
+);
+export const collateBuilt = existsSync(COLLATE_BIN);
+
+export interface CollateResult {
+  records: JsonObject[];
+  stderr: string;
+  exitCode: number;
+}
+
+/**
+ * Run recs-collate with args over records (or JSON lines) and parse what it
+ * writes.
+ */
+export function collate(args: string[], input: JsonObject[] | string): CollateResult {
+  const text = typeof input === "string"
+    ? input
+    : input.map((r) => JSON.stringify(r) + "\n").join("");
+  const proc = Bun.spawnSync([COLLATE_BIN, ...args], {
+    stdin: Buffer.from(text),
+  });
+  const records = proc.stdout
+    .toString()
+    .split("\n")
+    .filter((line) => line.length > 0)
+    .map((line) => JSON.parse(line) as JsonObject);
+  return { records, stderr: proc.stderr.toString(), exitCode: proc.exitCode ?? -1 };
+}
+
+/**
+ * The records in order of their JSON text, for comparing runs that write
+ * the same groups in different orders.
+ */
+export function sorted(records: JsonObject[]): JsonObject[] {
+  return records
+    .map((r) => JSON.stringify(r))
+    .sort()
+    .map((line) => JSON.parse(line) as JsonObject);
+}
+
+/**
+ * The records of each key (the key fields' values, as strings, joined by
+ * commas), in input order.
+ */
+export function groupBy(records: JsonObject[], ...keys: string[]): Map<string, JsonObject[]> {
+  const groups = new Map<string, JsonObject[]>();
+  for (const r of records) {
+    const key = keys.map((k) => String(r[k])).join(",");
+    const group = groups.get(key);
+    if (group) group.push(r);
+    else groups.set(key, [r]);
+  }
+  return groups;
+}
+
+/**
+ * What the TypeScript aggregator for spec makes of the records.
+ */
+export function tsAggregate(spec: string, records: JsonObject[]): JsonValue {
+  const agg = aggregatorRegistry.parse(spec);
+  let state = agg.initial();
+  for (const r of records) {
+    state = agg.combine(state, new Record(r));
+  }
+  return agg.squish(state);
+}
+
+/**
+ * n log-like records, the same ones for the same seed: host (a string with
+ * a few values), uid (an integer with many), q, lat (a number with
+ * decimals), sz (an integer) and t (seconds, mostly increasing).
+ */
+export function makeRecords(n: number, seed = 1): JsonObject[] {
+  let state = seed;
+  const random = (): number => {
+    state = (state * 1103515245 + 12345) % 2147483648;
+    return state / 2147483648;
+  };
+
+  const records: JsonObject[] = [];
+  let t = 1700000000;
+  for (let i = 0; i < n; i++) {
+    t += Math.floor(random() * 5);
+    records.push({
+      host: `h${Math.floor(random() * 6)}`,
+      uid: Math.floor(random() * 500),
+      q: `s${Math.floor(random() * 20)}`,
+      lat: Math.round(random() * 100000) / 1000,
+      sz: Math.floor(random() * 1000),
+      t,
+    });
+  }
+  return records;
+}
+
+/**
+ * Whether recs-collate's value is the TypeScript aggregator's, allowing for
+ * it writing numbers with just 6 significant digits (%g).
+ */
+export function sameValue(actual: JsonValue, expected: JsonValue): boolean {
+  if (typeof actual === "number" && typeof expected === "number") {
+    return Math.abs(actual - expected) <= 1e-5 * Math.max(Math.abs(expected), 1e-6);
+  }
+  if (Array.isArray(actual) && Array.isArray(expected)) {
+    return actual.length === expected.length &&
+      actual.every((value, i) => sameValue(value, expected[i]!));
+  }
+  if (actual !== null && expected !== null &&
+      typeof actual === "object" && typeof expected === "object" &&
+      !Array.isArray(actual) && !Array.isArray(expected)) {
+    const keys = Object.keys(expected);
+    return Object.keys(actual).length === keys.length &&
+      keys.every((key) => key in actual && sameValue(actual[key]!, expected[key]!));
+  }
+  return actual === expected;
+}
@@ -0,0 +1,227 @@
+import { describe, test, expect } from "bun:test";
+import type { JsonObject } from "../../src/types/json.ts";
+import {
+  collate,
+  collateBuilt,
+  groupBy,
+  makeRecords,
+  sameValue,
+  sorted,
+  tsAggregate,
+} from "./testHelper.ts";
+
+describe.skipIf(!collateBuilt)("recs-collate --window", () => {
+  const records = makeRecords(600);
+  const size = 10;
+
+  /** the records for each input record whose key has seen at least size */
+  function windows(): JsonObject[][] {
+    const seen = new Map<string, JsonObject[]>();
+    const result: JsonObject[][] = [];
+    for (const r of records) {
+      const group = seen.get(r["host"] as string) ?? [];
+      group.push(r);
+      seen.set(r["host"] as string, group);
+      if (group.length >= size) result.push(group.slice(-size));
+    }
+    return result;
+  }
+
+  const specs = [
+    "count", "sum,lat", "avg,lat", "min,lat", "max,lat", "concat,-,q",
+    "perc,90,lat", "var,lat", "corr,lat,sz", "cov,lat,sz",
+    "percmap,50 90,lat",
+    "stddev,sz", "linreg,lat,sz", "ord2uni,lat", "ord2biv,lat,sz",
+  ];
+
+  for (const spec of specs) {
+    test(`${spec} is over just the last ${size} records`, () => {
+      const result = collate(["-k", "host", "-a", `w=${spec}`, "--perfect", "--window", String(size)], records);
+      expect(result.exitCode).toBe(0);
+
+      const expected = windows();
+      expect(result.records).toHaveLength(expected.length);
+      result.records.forEach((r, i) => {
+        const want = tsAggregate(spec, expected[i]!);
+        if (!sameValue(r["w"]!, want)) {
+          expect(r["w"]).toEqual(want);
+        }
+      });
+    });
+  }
+
+  test("mode is a most common value in the window", () => {
+    const result = collate(["-k", "host", "-a", "mode,q", "--perfect", "--window", String(size)], records);
+    const expected = windows();
+    expect(result.records).toHaveLength(expected.length);
+    result.records.forEach((r, i) => {
+      const counts = new Map<string, number>();
+      for (const w of expected[i]!) counts.set(w["q"] as string, (counts.get(w["q"] as string) ?? 0) + 1);
+      expect(counts.get(r["mode_q"] as string)).toBe(Math.max(...counts.values()));
+    });
+  });
+
+  test("mode keeps up with many distinct values, and forgets the ones that leave", () => {
+    const args = ["-k", "host", "-a", "mode,uid", "--perfect", "--window", "50", "--stats"];
+    const peak = (result: ReturnType<typeof collate>): number =>
+      Number(/memory: .*\(peak (\d+)\)/.exec(result.stderr)![1]);
+
+    const many = makeRecords(3000);
+    const full = collate(args, many.slice(0, 300));
+    const result = collate(args, many);
+    expect(result.exitCode).toBe(0);
+    expect(result.records.length).toBeGreaterThan(0);
+    expect(peak(result)).toBeLessThan(peak(full) * 1.5);
+  });
+
+  test("aggregators that can't take values back out are refused", () => {
+    const result = collate(["-k", "host", "-a", "first,q", "--perfect", "--window", "5"], records);
+    expect(result.exitCode).not.toBe(0);
+    expect(result.stderr).toContain("--window");
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate --tumble", () => {
+  const records = makeRecords(3000);
+
+  /** the same records, up to 40 seconds out of order */
+  const jittered = makeRecords(3000).map((r, i) => ({
+    ...r,
+    t: (r["t"] as number) - ((i * 7919) % 41),
+  }));
+
+  /**
+   * What --tumble 60s should make of records: the records of each host and
+   * window, less the ones whose window had already closed when they came.
+   */
+  function tumble(input: JsonObject[], lateness: number): { groups: Map<string, JsonObject[]>; late: number } {
+    const groups = new Map<string, JsonObject[]>();
+    let watermark = -Infinity;
+    let late = 0;
+    for (const r of input) {
+      const t = r["t"] as number;
+      const start = Math.floor(t / 60) * 60;
+      if (start + 60 <= watermark) {
+        late++;
+        continue;
+      }
+      const key = `${r["host"]},${start}`;
+      groups.set(key, [...(groups.get(key) ?? []), r]);
+      watermark = Math.max(watermark, t - lateness);
+    }
+    return { groups, late };
+  }
+
+  function expectWindows(result: ReturnType<typeof collate>, groups: Map<string, JsonObject[]>): void {
+    expect(result.exitCode).toBe(0);
+    expect(result.records).toHaveLength(groups.size);
+    for (const r of result.records) {
+      const group = groups.get(`${r["host"]},${r["window_start"]}`);
+      expect(group).toBeDefined();
+      expect(r["count"]).toBe(group!.length);
+      expect(sameValue(r["sum_lat"]!, tsAggregate("sum,lat", group!))).toBe(true);
+    }
+  }
+
+  const args = ["-k", "host", "-a", "count", "-a", "sum,lat", "--perfect", "--window-field", "t", "--tumble", "60s"];
+
+  test("groups records by key and window", () => {
+    expectWindows(collate(args, records), tumble(records, 0).groups);
+  });
+
+  test("writes windows in order as they close", () => {
+    const starts = collate(args, records).records.map((r) => Number(r["window_start"]));
+    expect(starts).toEqual([...starts].sort((a, b) => a - b));
+  });
+
+  test("keeps out of order records within the allowed lateness", () => {
+    const result = collate([...args, "--allowed-lateness", "40s", "--stats"], jittered);
+    expectWindows(result, tumble(jittered, 40).groups);
+    expect(tumble(jittered, 40).late).toBe(0);
+    expect(result.stderr).not.toContain("records dropped");
+  });
+
+  test("drops records for windows that have already closed", () => {
+    const expected = tumble(jittered, 0);
+    expect(expected.late).toBeGreaterThan(0);
+
+    const result = collate([...args, "--stats"], jittered);
+    expectWindows(result, expected.groups);
+    expect(result.stderr).toContain(`records dropped:   ${expected.late} late`);
+  });
+
+  test("a key, input field or aggregator named window_start is refused", () => {
+    for (const bad of [
+      ["-k", "window_start", "-a", "count"],
+      ["-k", "host", "-a", "sum,window_start"],
+      ["-k", "host", "-a", "window_start=count"],
+    ]) {
+      const result = collate([...bad, "--window-field", "t", "--tumble", "60s"], records.slice(0, 10));
+      expect(result.exitCode).not.toBe(0);
+      expect(result.stderr).toContain("window_start");
+    }
+  });
+});
+
+describe.skipIf(!collateBuilt)("recs-collate --session-gap", () => {
+  // times from 0, so that min and max write them exactly
+  const records = makeRecords(3000).map((r) => ({ ...r, t: (r["t"] as number) - 1700000000 }));
+
+  /**
+   * Each host's sessions: runs of its records with no more than gap seconds
+   * between one and the next.
+   */
+  function sessions(gap: number): JsonObject[][] {
+    const open = new Map<string, JsonObject[]>();
+    const result: JsonObject[][] = [];
+    for (const r of records) {
+      const host = r["host"] as string;
+      const session = open.get(host);
+      if (session && (r["t"] as number) - (session.at(-1)!["t"] as number) <= gap) {
+        session.push(r);
+      } else {
+        if (session) result.push(session);
+        open.set(host, [r]);
+      }
+    }
+    return [...result, ...open.values()];
+  }
+
+  for (const gap of [5, 20, 60]) {
+    test(`splits each key's records where they're more than ${gap}s apart`, () => {
+      const result = collate(
+        ["-k", "host", "-a", "count", "-a", "min,t", "-a", "max,t", "-a", "sum,sz",
+         "--perfect", "--session-field", "t", "--session-gap", `${gap}s`],
+        records
+      );
+      expect(result.exitCode).toBe(0);
+
+      const expected = sessions(gap).map((session) => ({
+        host: session[0]!["host"],
+        count: session.length,
+        min_t: session[0]!["t"],
+        max_t: session.at(-1)!["t"],
+        sum_sz: session.reduce((sum, r) => sum + (r["sz"] as number), 0),
+      }));
+      expect(sorted(result.records)).toEqual(sorted(expected));
+    });
+  }
+
+  test("writes a session once a later time shows it's over", () => {
+    const result = collate(
+      ["-k", "host", "-a", "max,t", "--perfect", "--session-field", "t", "--session-gap", "20s"],
+      records
+    );
+    const ends = result.records.map((r) => r["max_t"] as number);
+    const open = groupBy(records, "host").size;
+
+    // all but the sessions still open at the end are written in the order
+    // they ended, give or take the timer wheel's ticks (a fraction of the
+    // gap)
+    let latest = -Infinity;
+    for (const end of ends.slice(0, ends.length - open)) {
+      expect(end).toBeGreaterThan(latest - 20);
+      latest = Math.max(latest, end);
+    }
+  });
+});